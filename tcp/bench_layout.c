@@ -0,0 +1,228 @@
+//=================================================================================================
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      Microbenchmark: cost per segment of the per-connection fields written by the handle thread
+//      (ACK processing) and the send thread, with the fields of both in the same cache lines (the
+//      layout before vsocket_infoset was split by writer) and with each writer on its own lines
+//      (the current layout, see tcp_layer.h). The two threads write the same fields as
+//      handleTCPACK()/cc_onAck() and transmitNewData()/cc_onPacedSend() do per segment, without
+//      the locks, so that only the cache line traffic is measured.
+//
+//      make bench_layout && ./bench_layout [segments]
+//
+//      Needs at least two CPUs to show anything: on one CPU the threads never run at the same time.
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+//=================================================================================================
+//      DEFINITIONS AND MACROS
+//=================================================================================================
+
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED   __attribute__((aligned(CACHE_LINE_SIZE)))
+
+#define DEFAULT_SEGMENTS    20000000
+#define MSS                 1350
+
+
+// Fields as they were declared before the split: both writers share lines
+struct shared_layout {
+    uint32_t send_unack;
+    uint32_t send_next;
+    uint32_t dup_ack;
+    uint32_t remote_ruws;
+    uint64_t start_time;
+    uint64_t send_time;
+    uint32_t exp_acknum;
+    uint32_t cwnd;
+    uint64_t pace_time_us;
+    uint64_t delivered;
+    int64_t rate_tokens;
+    uint64_t app_limited;
+    uint32_t prr_out;
+    uint32_t rack_delivered;
+} CACHE_ALIGNED;
+
+// Fields as they are declared now: one section per writer thread
+struct split_layout {
+    struct {
+        uint32_t send_unack;
+        uint32_t dup_ack;
+        uint32_t remote_ruws;
+        uint64_t start_time;
+        uint32_t cwnd;
+        uint64_t delivered;
+        uint64_t app_limited;
+        uint32_t rack_delivered;
+    } CACHE_ALIGNED;
+
+    struct {
+        uint32_t send_next;
+        uint64_t send_time;
+        uint32_t exp_acknum;
+        uint64_t pace_time_us;
+        int64_t rate_tokens;
+        uint32_t prr_out;
+    } CACHE_ALIGNED;
+};
+
+
+struct bench_arg {
+    void* tcb;
+    uint64_t segments;
+    pthread_barrier_t* start;
+};
+
+//=================================================================================================
+//      PRIVATE FUNCTIONS
+//=================================================================================================
+
+uint64_t getTimeNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+
+// The handle thread: one ACK per segment
+#define ACK_SEGMENT(tcb, i)                                 \
+    do {                                                    \
+        (tcb)->send_unack += MSS;                           \
+        (tcb)->dup_ack = 0;                                 \
+        (tcb)->remote_ruws = 65535 - ((i) & 1023);          \
+        (tcb)->start_time = (i);                            \
+        (tcb)->cwnd += MSS/8;                               \
+        (tcb)->delivered += MSS;                            \
+        (tcb)->app_limited = 0;                             \
+        (tcb)->rack_delivered = 0;                          \
+    } while (0)
+
+// The send thread: one segment out
+#define SEND_SEGMENT(tcb, i)                                \
+    do {                                                    \
+        (tcb)->send_next += MSS;                            \
+        (tcb)->send_time = (i);                             \
+        (tcb)->exp_acknum = (tcb)->send_next;               \
+        (tcb)->pace_time_us = (i) + 10;                     \
+        (tcb)->rate_tokens -= MSS;                          \
+        (tcb)->prr_out += MSS;                              \
+    } while (0)
+
+
+void* sharedAckThreadFunc(void* arg)
+{
+    struct bench_arg* barg = (struct bench_arg*)arg;
+    volatile struct shared_layout* tcb = barg->tcb;
+    uint64_t i;
+
+    pthread_barrier_wait(barg->start);
+    for (i = 0; i < barg->segments; i++) {
+        ACK_SEGMENT(tcb, i);
+    }
+    return NULL;
+}
+
+
+void* sharedSendThreadFunc(void* arg)
+{
+    struct bench_arg* barg = (struct bench_arg*)arg;
+    volatile struct shared_layout* tcb = barg->tcb;
+    uint64_t i;
+
+    pthread_barrier_wait(barg->start);
+    for (i = 0; i < barg->segments; i++) {
+        SEND_SEGMENT(tcb, i);
+    }
+    return NULL;
+}
+
+
+void* splitAckThreadFunc(void* arg)
+{
+    struct bench_arg* barg = (struct bench_arg*)arg;
+    volatile struct split_layout* tcb = barg->tcb;
+    uint64_t i;
+
+    pthread_barrier_wait(barg->start);
+    for (i = 0; i < barg->segments; i++) {
+        ACK_SEGMENT(tcb, i);
+    }
+    return NULL;
+}
+
+
+void* splitSendThreadFunc(void* arg)
+{
+    struct bench_arg* barg = (struct bench_arg*)arg;
+    volatile struct split_layout* tcb = barg->tcb;
+    uint64_t i;
+
+    pthread_barrier_wait(barg->start);
+    for (i = 0; i < barg->segments; i++) {
+        SEND_SEGMENT(tcb, i);
+    }
+    return NULL;
+}
+
+
+// Run both threads on tcb, returns ns per segment
+double runLayout(void* tcb, void* (*ack_func)(void*), void* (*send_func)(void*), uint64_t segments)
+{
+    pthread_barrier_t start;
+    pthread_t ack_thread, send_thread;
+    struct bench_arg barg = { tcb, segments, &start };
+
+    pthread_barrier_init(&start, NULL, 3);
+    pthread_create(&ack_thread, NULL, ack_func, &barg);
+    pthread_create(&send_thread, NULL, send_func, &barg);
+
+    pthread_barrier_wait(&start);
+    uint64_t begin_ns = getTimeNs();
+    pthread_join(ack_thread, NULL);
+    pthread_join(send_thread, NULL);
+    uint64_t elapsed_ns = getTimeNs() - begin_ns;
+
+    pthread_barrier_destroy(&start);
+    return (double)elapsed_ns/segments;
+}
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+int main(int argc, char** argv)
+{
+    uint64_t segments = (argc > 1) ? strtoull(argv[1], NULL, 10) : DEFAULT_SEGMENTS;
+
+    struct shared_layout* shared = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct shared_layout));
+    struct split_layout* split = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct split_layout));
+
+    printf("%llu segments, %ld CPUs online\n", (unsigned long long)segments, sysconf(_SC_NPROCESSORS_ONLN));
+
+    // Warm up once, then measure
+    runLayout(shared, sharedAckThreadFunc, sharedSendThreadFunc, segments/10);
+    double shared_ns = runLayout(shared, sharedAckThreadFunc, sharedSendThreadFunc, segments);
+    runLayout(split, splitAckThreadFunc, splitSendThreadFunc, segments/10);
+    double split_ns = runLayout(split, splitAckThreadFunc, splitSendThreadFunc, segments);
+
+    printf("shared lines (before): %6.2f ns/segment (%zu bytes)\n", shared_ns, sizeof(struct shared_layout));
+    printf("split by writer (now): %6.2f ns/segment (%zu bytes)\n", split_ns, sizeof(struct split_layout));
+
+    free(shared);
+    free(split);
+    return 0;
+}
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
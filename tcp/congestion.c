@@ -0,0 +1,869 @@
+//=================================================================================================
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "congestion.h"
+
+
+//=================================================================================================
+//      DEFINITIONS AND MACROS
+//=================================================================================================
+
+#define RENO_MIN_SSTHRESH_SEGMENTS  2
+
+#define BBR_HIGH_GAIN           2.885       // 2/ln(2): doubles the sending rate every round trip in STARTUP
+#define BBR_CWND_GAIN           2.0
+#define BBR_FULL_BW_THRESH      1.25        // STARTUP ends once the bandwidth grew less than 25%
+#define BBR_FULL_BW_ROUNDS      3           // in three round trips
+#define BBR_MIN_RTT_WINDOW_US   10000000    // min RTT sample expires after 10 seconds (PROBE_RTT)
+#define BBR_PROBE_RTT_US        200000
+#define BBR_MIN_CWND_SEGMENTS   4
+#define BBR_CYCLE_LEN           8
+
+typedef enum Bbr_Mode {
+
+    BBR_STARTUP = 0,    // find the bottleneck bandwidth, doubling the rate every round trip
+    BBR_DRAIN,          // drain the queue STARTUP built
+    BBR_PROBE_BW,       // cruise at the bottleneck bandwidth, probing for more every 8 round trips
+    BBR_PROBE_RTT       // shrink inflight to 4 segments for 200ms to measure the min RTT again
+
+} Bbr_Mode_t;
+
+
+// Operations of one congestion control algorithm
+struct cc_ops {
+    const char* name;
+    bool ecn;           // reduces the window on ECE (BBR v1 ignores ECN)
+    void (*init)(struct vsocket_infoset* socket_info, uint64_t now);
+    void (*onAck)(struct vsocket_infoset* socket_info, struct rate_sample* rs, uint64_t now);
+    void (*enterRecovery)(struct vsocket_infoset* socket_info);
+    void (*exitRecovery)(struct vsocket_infoset* socket_info);
+    void (*onRTO)(struct vsocket_infoset* socket_info);
+};
+
+
+//=================================================================================================
+//      PRIVATE FUNCTION DECLARATIONS
+//=================================================================================================
+
+void renoInit(struct vsocket_infoset* socket_info, uint64_t now);
+void renoOnAck(struct vsocket_infoset* socket_info, struct rate_sample* rs, uint64_t now);
+void renoEnterRecovery(struct vsocket_infoset* socket_info);
+void renoExitRecovery(struct vsocket_infoset* socket_info);
+void renoOnRTO(struct vsocket_infoset* socket_info);
+void renoSetPacingRate(struct vsocket_infoset* socket_info);
+void renoReduceCwnd(struct vsocket_infoset* socket_info, uint32_t delivered);
+
+void bbrInit(struct vsocket_infoset* socket_info, uint64_t now);
+void bbrOnAck(struct vsocket_infoset* socket_info, struct rate_sample* rs, uint64_t now);
+void bbrEnterRecovery(struct vsocket_infoset* socket_info);
+void bbrExitRecovery(struct vsocket_infoset* socket_info);
+void bbrOnRTO(struct vsocket_infoset* socket_info);
+
+
+//=================================================================================================
+//      GLOBAL VARIABLES
+//=================================================================================================
+
+static const struct cc_ops s_cc_ops[TCP_CC_KINDS] = {
+    { "reno", true,  renoInit, renoOnAck, renoEnterRecovery, renoExitRecovery, renoOnRTO },
+    { "bbr",  false, bbrInit,  bbrOnAck,  bbrEnterRecovery,  bbrExitRecovery,  bbrOnRTO  }
+};
+
+static const double s_bbr_pacing_gain[BBR_CYCLE_LEN] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+
+//=================================================================================================
+//      PRIVATE FUNCTIONS
+//=================================================================================================
+
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint32_t getFlightSize(struct vsocket_infoset* socket_info)
+{
+    return socket_info->tcb.send_next - socket_info->tcb.send_unack;
+}
+
+
+// A loss episode starts: remember the window to return to should it prove spurious
+// WARNING: g_vsocket_table_mutex must already be acquired
+void saveUndoState(struct vsocket_infoset* socket_info)
+{
+    socket_info->prior_cwnd = socket_info->cwnd;
+    socket_info->prior_ssthresh = socket_info->ssthresh;
+    socket_info->undo_armed = true;
+    socket_info->undo_retrans = 0;
+}
+
+
+// WARNING: g_vsocket_table_mutex must already be acquired
+int64_t getRateBucketDepth(struct vsocket_infoset* socket_info)
+{
+    int64_t depth = socket_info->max_rate*RATE_BUCKET_US/1000000;
+    
+    return (depth > 2*socket_info->tcb.mss) ? depth : 2*socket_info->tcb.mss;
+}
+
+
+// Add the tokens earned at max_rate since the last refill, up to the bucket depth
+// WARNING: g_vsocket_table_mutex must already be acquired
+void refillRateTokens(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    if (socket_info->max_rate == 0 || now <= socket_info->rate_refill_us) {
+        return;
+    }
+
+    uint64_t earned = (now - socket_info->rate_refill_us)*socket_info->max_rate/1000000;
+    if (earned == 0) {
+        return; // keep the fraction for the next refill
+    }
+
+    int64_t depth = getRateBucketDepth(socket_info);
+    if (socket_info->rate_tokens + (int64_t)earned >= depth) {
+        socket_info->rate_tokens = depth; // a full bucket earns nothing more
+        socket_info->rate_refill_us = now;
+    } else {
+        socket_info->rate_tokens += earned;
+        socket_info->rate_refill_us += earned*1000000/socket_info->max_rate;
+    }
+}
+
+
+//-------------------------------------------------------------------------------------------------
+//      Reno (RFC 5681): slow start, congestion avoidance and fast recovery
+//-------------------------------------------------------------------------------------------------
+
+void renoInit(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    socket_info->ssthresh = UINT32_MAX;
+    renoSetPacingRate(socket_info);
+}
+
+
+// Spread cwnd over the smoothed RTT, faster in slow start. Not paced before the first RTT sample.
+// WARNING: g_vsocket_table_mutex must already be acquired
+void renoSetPacingRate(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->first_measure || socket_info->srtt_us < 1) {
+        socket_info->pacing_rate = 0;
+        return;
+    }
+
+    double ratio = (socket_info->cwnd < socket_info->ssthresh/2) ? PACING_SS_RATIO : PACING_CA_RATIO;
+    socket_info->pacing_rate = (uint64_t)(ratio*socket_info->cwnd*1000000/socket_info->srtt_us);
+}
+
+
+// Proportional Rate Reduction (RFC 6937): during recovery every ACK lets out data in
+// proportion to what it delivered, so the flight shrinks smoothly from RecoverFS to ssthresh
+// instead of stalling for half a window and then bursting. Once the pipe fell below
+// ssthresh (heavy loss), it grows back at most one segment faster than data is delivered.
+// WARNING: g_vsocket_table_mutex must already be acquired
+void renoReduceCwnd(struct vsocket_infoset* socket_info, uint32_t delivered)
+{
+    uint32_t mss = socket_info->tcb.mss;
+    uint32_t pipe = cc_getPipe(socket_info);
+    int64_t sndcnt;
+
+    socket_info->prr_delivered += delivered;
+
+    if (pipe > socket_info->ssthresh) {
+        uint64_t target = ((uint64_t)socket_info->prr_delivered*socket_info->ssthresh + socket_info->recover_fs - 1)/socket_info->recover_fs;
+        sndcnt = (int64_t)target - socket_info->prr_out;
+    } else {
+        int64_t limit = (int64_t)socket_info->prr_delivered - socket_info->prr_out;
+        if (limit < delivered) {
+            limit = delivered;
+        }
+        limit += mss;
+        sndcnt = (socket_info->ssthresh - pipe < limit) ? socket_info->ssthresh - pipe : limit;
+    }
+
+    if (sndcnt < 0) {
+        sndcnt = 0;
+    }
+    if (socket_info->prr_out == 0 && sndcnt < mss) {
+        sndcnt = mss; // the first retransmission always goes out
+    }
+    socket_info->cwnd = pipe + (uint32_t)sndcnt;
+}
+
+
+void renoOnAck(struct vsocket_infoset* socket_info, struct rate_sample* rs, uint64_t now)
+{
+    uint32_t mss = socket_info->tcb.mss;
+
+    if (socket_info->in_recovery) {
+        renoReduceCwnd(socket_info, rs->acked);
+    } else if (rs->acked != 0) {
+        if (socket_info->cwnd < socket_info->ssthresh) {
+            // Slow start, at most two segments per ACK (RFC 3465)
+            socket_info->cwnd += util_min(rs->acked, 2*mss);
+        } else {
+            // Congestion avoidance: one segment per window of data ACKed
+            socket_info->cwnd_acked += rs->acked;
+            if (socket_info->cwnd_acked >= socket_info->cwnd) {
+                socket_info->cwnd_acked -= socket_info->cwnd;
+                socket_info->cwnd += mss;
+            }
+        }
+        socket_info->cwnd = util_min(socket_info->cwnd, CC_MAX_CWND);
+    }
+
+    renoSetPacingRate(socket_info);
+}
+
+
+void renoEnterRecovery(struct vsocket_infoset* socket_info)
+{
+    uint32_t mss = socket_info->tcb.mss;
+
+    socket_info->recover_fs = util_max(getFlightSize(socket_info), 1);
+    socket_info->ssthresh = util_max(socket_info->recover_fs/2, RENO_MIN_SSTHRESH_SEGMENTS*mss);
+    socket_info->prr_delivered = 0;
+    socket_info->prr_out = 0;
+    socket_info->cwnd_acked = 0;
+    renoReduceCwnd(socket_info, 0);
+    renoSetPacingRate(socket_info);
+}
+
+
+// Recovery ends at exactly ssthresh, whatever PRR left cwnd at (RFC 6937)
+void renoExitRecovery(struct vsocket_infoset* socket_info)
+{
+    socket_info->cwnd = socket_info->ssthresh;
+}
+
+
+// ssthresh is only reduced by the first timeout of a loss episode (RFC 5681 3.1)
+void renoOnRTO(struct vsocket_infoset* socket_info)
+{
+    uint32_t mss = socket_info->tcb.mss;
+
+    if (!socket_info->in_loss) {
+        socket_info->ssthresh = util_max(getFlightSize(socket_info)/2, RENO_MIN_SSTHRESH_SEGMENTS*mss);
+    }
+    socket_info->cwnd = mss;
+    socket_info->cwnd_acked = 0;
+    renoSetPacingRate(socket_info);
+}
+
+
+//-------------------------------------------------------------------------------------------------
+//      BBR: model-based congestion control (BBR v1, draft-cardwell-iccrg-bbr-congestion-control)
+//-------------------------------------------------------------------------------------------------
+
+// Bytes in flight that fill gain times the estimated bandwidth-delay product
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint32_t bbrInflight(struct vsocket_infoset* socket_info, double gain)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    if (bbr->btl_bw == 0 || bbr->min_rtt_us == 0) {
+        return CC_INIT_CWND_SEGMENTS*socket_info->tcb.mss; // no model yet
+    }
+
+    double inflight = gain*bbr->btl_bw*bbr->min_rtt_us/1000000;
+    return (inflight < CC_MAX_CWND) ? (uint32_t)inflight : CC_MAX_CWND;
+}
+
+
+// cwnd to come back to after recovery or PROBE_RTT
+// WARNING: g_vsocket_table_mutex must already be acquired
+void bbrSaveCwnd(struct vsocket_infoset* socket_info)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    if (socket_info->in_recovery || socket_info->in_loss || bbr->mode == BBR_PROBE_RTT) {
+        bbr->prior_cwnd = util_max(bbr->prior_cwnd, socket_info->cwnd);
+    } else {
+        bbr->prior_cwnd = socket_info->cwnd;
+    }
+}
+
+
+void bbrEnterStartup(struct vsocket_infoset* socket_info)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    bbr->mode = BBR_STARTUP;
+    bbr->pacing_gain = BBR_HIGH_GAIN;
+    bbr->cwnd_gain = BBR_HIGH_GAIN;
+}
+
+
+// Start the gain cycle at a random phase other than the draining one
+void bbrEnterProbeBW(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    bbr->mode = BBR_PROBE_BW;
+    bbr->cwnd_gain = BBR_CWND_GAIN;
+    bbr->cycle_index = rand()%(BBR_CYCLE_LEN - 1);
+    if (bbr->cycle_index >= 1) {
+        bbr->cycle_index++;
+    }
+    bbr->cycle_stamp_us = now;
+    bbr->pacing_gain = s_bbr_pacing_gain[bbr->cycle_index];
+}
+
+
+// A round trip ends when a segment sent after the previous round ended is delivered
+void bbrUpdateRound(struct vsocket_infoset* socket_info, struct rate_sample* rs)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    bbr->round_start = false;
+    if (rs->has_sample && rs->prior_delivered >= bbr->next_round_delivered) {
+        bbr->next_round_delivered = socket_info->delivered;
+        bbr->round_count++;
+        bbr->round_start = true;
+        bbr->bw_rounds[bbr->round_count%BBR_BW_ROUNDS] = 0;
+    }
+}
+
+
+// Windowed max of the delivery rate over the last BBR_BW_ROUNDS round trips. App-limited
+// samples only count if they show more bandwidth than the estimate.
+void bbrUpdateBtlBw(struct vsocket_infoset* socket_info, struct rate_sample* rs)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+    uint64_t* slot = &(bbr->bw_rounds[bbr->round_count%BBR_BW_ROUNDS]);
+
+    if (rs->delivery_rate != 0 && (!rs->app_limited || rs->delivery_rate >= bbr->btl_bw) && rs->delivery_rate > *slot) {
+        *slot = rs->delivery_rate;
+    }
+
+    int i;
+    bbr->btl_bw = 0;
+    for (i = 0; i < BBR_BW_ROUNDS; i++) {
+        if (bbr->bw_rounds[i] > bbr->btl_bw) {
+            bbr->btl_bw = bbr->bw_rounds[i];
+        }
+    }
+}
+
+
+// PROBE_BW moves to the next gain phase after one min RTT. The probing phase also waits
+// until it actually put more in flight (or saw loss), the draining phase ends early once
+// the queue it left behind is gone.
+void bbrCheckCyclePhase(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    if (bbr->mode != BBR_PROBE_BW) {
+        return;
+    }
+
+    uint32_t pipe = cc_getPipe(socket_info);
+    bool elapsed = (now - bbr->cycle_stamp_us > bbr->min_rtt_us);
+    bool advance = elapsed;
+
+    if (bbr->pacing_gain > 1.0) {
+        advance = elapsed && (socket_info->rack_lost > 0 || pipe >= bbrInflight(socket_info, bbr->pacing_gain));
+    } else if (bbr->pacing_gain < 1.0) {
+        advance = elapsed || pipe <= bbrInflight(socket_info, 1.0);
+    }
+
+    if (advance) {
+        bbr->cycle_index = (bbr->cycle_index + 1)%BBR_CYCLE_LEN;
+        bbr->cycle_stamp_us = now;
+        bbr->pacing_gain = s_bbr_pacing_gain[bbr->cycle_index];
+    }
+}
+
+
+// The pipe is full once the bandwidth estimate stopped growing by 25% for three round trips
+void bbrCheckFullPipe(struct vsocket_infoset* socket_info, struct rate_sample* rs)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    if (bbr->filled_pipe || !bbr->round_start || rs->app_limited) {
+        return;
+    }
+
+    if (bbr->btl_bw >= bbr->full_bw*BBR_FULL_BW_THRESH) {
+        bbr->full_bw = bbr->btl_bw;
+        bbr->full_bw_count = 0;
+        return;
+    }
+
+    bbr->full_bw_count++;
+    bbr->filled_pipe = (bbr->full_bw_count >= BBR_FULL_BW_ROUNDS);
+}
+
+
+void bbrCheckDrain(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    if (bbr->mode == BBR_STARTUP && bbr->filled_pipe) {
+        bbr->mode = BBR_DRAIN;
+        bbr->pacing_gain = 1.0/BBR_HIGH_GAIN;
+        bbr->cwnd_gain = BBR_HIGH_GAIN;
+    }
+    if (bbr->mode == BBR_DRAIN && cc_getPipe(socket_info) <= bbrInflight(socket_info, 1.0)) {
+        bbrEnterProbeBW(socket_info, now);
+    }
+}
+
+
+// Track the min RTT over BBR_MIN_RTT_WINDOW_US. When the estimate expires, PROBE_RTT drains
+// the pipe to BBR_MIN_CWND_SEGMENTS for BBR_PROBE_RTT_US and one round trip to measure it again.
+void bbrUpdateMinRTT(struct vsocket_infoset* socket_info, struct rate_sample* rs, uint64_t now)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+    uint32_t min_cwnd = BBR_MIN_CWND_SEGMENTS*socket_info->tcb.mss;
+    bool expired = (now > bbr->min_rtt_stamp_us + BBR_MIN_RTT_WINDOW_US);
+
+    if (rs->rtt_us != 0 && (bbr->min_rtt_us == 0 || rs->rtt_us <= bbr->min_rtt_us || expired)) {
+        bbr->min_rtt_us = rs->rtt_us;
+        bbr->min_rtt_stamp_us = now;
+    }
+
+    if (expired && bbr->mode != BBR_PROBE_RTT) {
+        bbrSaveCwnd(socket_info);
+        bbr->mode = BBR_PROBE_RTT;
+        bbr->pacing_gain = 1.0;
+        bbr->cwnd_gain = 1.0;
+        bbr->probe_rtt_done_us = 0;
+    }
+
+    if (bbr->mode != BBR_PROBE_RTT) {
+        return;
+    }
+
+    // Samples taken while draining say nothing about the bandwidth
+    socket_info->app_limited = util_max(socket_info->delivered + cc_getPipe(socket_info), 1);
+
+    if (bbr->probe_rtt_done_us == 0 && cc_getPipe(socket_info) <= min_cwnd) {
+        bbr->probe_rtt_done_us = now + BBR_PROBE_RTT_US;
+        bbr->probe_rtt_round_done = false;
+        bbr->next_round_delivered = socket_info->delivered;
+
+    } else if (bbr->probe_rtt_done_us != 0) {
+        if (bbr->round_start) {
+            bbr->probe_rtt_round_done = true;
+        }
+        if (bbr->probe_rtt_round_done && now >= bbr->probe_rtt_done_us) {
+            bbr->min_rtt_stamp_us = now;
+            socket_info->cwnd = util_max(socket_info->cwnd, bbr->prior_cwnd);
+            if (bbr->filled_pipe) {
+                bbrEnterProbeBW(socket_info, now);
+            } else {
+                bbrEnterStartup(socket_info);
+            }
+        }
+    }
+}
+
+
+// Pace at pacing_gain times the bottleneck bandwidth. Until the pipe is full the rate
+// only goes up, a single low sample in STARTUP must not slow it down.
+void bbrSetPacingRate(struct vsocket_infoset* socket_info)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+    uint64_t rate = (uint64_t)(bbr->pacing_gain*bbr->btl_bw);
+
+    if (bbr->btl_bw != 0 && (bbr->filled_pipe || rate > socket_info->pacing_rate)) {
+        socket_info->pacing_rate = rate;
+    }
+}
+
+
+// cwnd approaches cwnd_gain*BDP (plus 3 segments for delayed and stretched ACKs). It grows
+// by the data ACKed, during recovery at least keeping what was delivered in flight
+// (packet conservation).
+void bbrSetCwnd(struct vsocket_infoset* socket_info, struct rate_sample* rs)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+    uint32_t mss = socket_info->tcb.mss;
+    uint32_t target = bbrInflight(socket_info, bbr->cwnd_gain) + 3*mss;
+    uint32_t cwnd = socket_info->cwnd;
+
+    if (socket_info->in_recovery || socket_info->in_loss) {
+        cwnd = util_max(cwnd, cc_getPipe(socket_info) + rs->acked);
+    }
+
+    if (bbr->filled_pipe) {
+        cwnd = util_min(cwnd + rs->acked, target);
+    } else if (cwnd < target || socket_info->delivered < CC_INIT_CWND_SEGMENTS*mss) {
+        cwnd = cwnd + rs->acked;
+    }
+
+    if (!socket_info->in_loss) {
+        cwnd = util_max(cwnd, BBR_MIN_CWND_SEGMENTS*mss);
+    }
+    if (bbr->mode == BBR_PROBE_RTT) {
+        cwnd = util_min(cwnd, BBR_MIN_CWND_SEGMENTS*mss);
+    }
+
+    socket_info->cwnd = util_min(cwnd, CC_MAX_CWND);
+}
+
+
+void bbrInit(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    struct bbr_state* bbr = &(socket_info->bbr);
+
+    bbr->min_rtt_us = socket_info->rack_min_rtt_us;
+    bbr->min_rtt_stamp_us = now;
+    bbr->next_round_delivered = socket_info->delivered;
+    bbrEnterStartup(socket_info);
+
+    // Until there is a bandwidth sample, pace the initial window over the smoothed RTT
+    double rtt_us = socket_info->first_measure ? 1000 : util_max((uint32_t)socket_info->srtt_us, 1);
+    socket_info->pacing_rate = (uint64_t)(BBR_HIGH_GAIN*socket_info->cwnd*1000000/rtt_us);
+}
+
+
+void bbrOnAck(struct vsocket_infoset* socket_info, struct rate_sample* rs, uint64_t now)
+{
+    bbrUpdateRound(socket_info, rs);
+    bbrUpdateBtlBw(socket_info, rs);
+    bbrCheckCyclePhase(socket_info, now);
+    bbrCheckFullPipe(socket_info, rs);
+    bbrCheckDrain(socket_info, now);
+    bbrUpdateMinRTT(socket_info, rs, now);
+
+    bbrSetPacingRate(socket_info);
+    bbrSetCwnd(socket_info, rs);
+}
+
+
+void bbrEnterRecovery(struct vsocket_infoset* socket_info)
+{
+    bbrSaveCwnd(socket_info);
+    socket_info->cwnd = cc_getPipe(socket_info) + socket_info->tcb.mss;
+}
+
+
+void bbrExitRecovery(struct vsocket_infoset* socket_info)
+{
+    socket_info->cwnd = util_max(socket_info->cwnd, socket_info->bbr.prior_cwnd);
+}
+
+
+void bbrOnRTO(struct vsocket_infoset* socket_info)
+{
+    bbrSaveCwnd(socket_info);
+    socket_info->cwnd = socket_info->tcb.mss;
+}
+
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+const char* cc_getName(TCP_Congestion_t kind)
+{
+    return (kind < TCP_CC_KINDS) ? s_cc_ops[kind].name : "unknown";
+}
+
+
+// (Re)start congestion control with the initial window, once the MSS is known
+void cc_init(struct vsocket_infoset* socket_info)
+{
+    uint64_t now = util_getTimeUs();
+
+    socket_info->cwnd = CC_INIT_CWND_SEGMENTS*socket_info->tcb.mss;
+    socket_info->ssthresh = UINT32_MAX;
+    socket_info->cwnd_acked = 0;
+    socket_info->in_recovery = false;
+    socket_info->in_loss = false;
+    socket_info->pacing_rate = 0;
+    socket_info->pace_time_us = 0;
+    memset(&(socket_info->bbr), 0, sizeof(struct bbr_state));
+
+    s_cc_ops[socket_info->cc_kind].init(socket_info, now);
+}
+
+
+// Bytes still in the network (RFC 6675 pipe): in flight, less what is known delivered
+// beyond send_unack or known lost and not retransmitted yet
+uint32_t cc_getPipe(struct vsocket_infoset* socket_info)
+{
+    uint32_t flight = getFlightSize(socket_info);
+    uint32_t gone = socket_info->rack_delivered_bytes + socket_info->rack_lost_bytes;
+
+    return (flight > gone) ? flight - gone : 0;
+}
+
+
+// Bytes the congestion window lets into the network now
+uint32_t cc_getSendQuota(struct vsocket_infoset* socket_info)
+{
+    uint32_t pipe = cc_getPipe(socket_info);
+
+    return (socket_info->cwnd > pipe) ? socket_info->cwnd - pipe : 0;
+}
+
+
+// Snapshot the delivery state into a segment being (re)transmitted. The sample interval
+// starts over when nothing was in flight. Counts what is sent during recovery for PRR.
+void cc_onTransmit(struct vsocket_infoset* socket_info, struct tx_record* record, bool was_idle, uint64_t now)
+{
+    if (was_idle) {
+        socket_info->first_sent_time_us = now;
+        socket_info->delivered_time_us = now;
+    }
+
+    if (socket_info->in_recovery) {
+        socket_info->prr_out += record->len;
+    }
+
+    record->delivered_bytes = socket_info->delivered;
+    record->delivered_time_us = socket_info->delivered_time_us;
+    record->first_sent_time_us = socket_info->first_sent_time_us;
+    record->app_limited = (socket_info->app_limited != 0);
+}
+
+
+// Called after a send pass: if the application left the window unused, the delivery rate
+// samples until that data is delivered are app-limited and can't lower the bandwidth estimate
+void cc_checkAppLimited(struct vsocket_infoset* socket_info, bool has_unsent)
+{
+    uint32_t pipe = cc_getPipe(socket_info);
+
+    if (!has_unsent && pipe < socket_info->cwnd) {
+        socket_info->app_limited = util_max(socket_info->delivered + pipe, 1);
+    }
+}
+
+
+void cc_initRateSample(struct rate_sample* rs)
+{
+    memset(rs, 0, sizeof(struct rate_sample));
+}
+
+
+// bytes of record were delivered (cumulatively ACKed or credited by a duplicate ACK)
+void cc_onDelivered(struct vsocket_infoset* socket_info, struct rate_sample* rs,
+                    struct tx_record* record, uint32_t bytes, uint64_t now)
+{
+    socket_info->delivered += bytes;
+    socket_info->delivered_time_us = now;
+    rs->acked += bytes;
+
+    if (rs->has_sample && record->delivered_bytes < rs->prior_delivered) {
+        return; // a segment sent later already provides the sample
+    }
+
+    rs->has_sample = true;
+    rs->prior_delivered = record->delivered_bytes;
+    rs->prior_time_us = record->delivered_time_us;
+    rs->app_limited = record->app_limited;
+    rs->send_elapsed_us = record->xmit_time_us - record->first_sent_time_us;
+    rs->ack_elapsed_us = socket_info->delivered_time_us - record->delivered_time_us;
+    rs->rtt_us = (record->retrans == 0) ? now - record->xmit_time_us : 0;
+    socket_info->first_sent_time_us = record->xmit_time_us;
+}
+
+
+// End of ACK processing: finish the delivery rate sample (over the longer of the send and
+// ACK intervals, never shorter than the min RTT), leave recovery once recovery_point is
+// ACKed and let the algorithm update cwnd and the pacing rate
+void cc_onAck(struct vsocket_infoset* socket_info, struct rate_sample* rs, uint64_t now)
+{
+    if (rs->has_sample) {
+        uint64_t interval = (rs->send_elapsed_us > rs->ack_elapsed_us) ? rs->send_elapsed_us : rs->ack_elapsed_us;
+        if (interval > 0 && interval >= socket_info->rack_min_rtt_us) {
+            rs->delivery_rate = (socket_info->delivered - rs->prior_delivered)*1000000/interval;
+        }
+    }
+    if (socket_info->app_limited != 0 && socket_info->delivered > socket_info->app_limited) {
+        socket_info->app_limited = 0;
+    }
+
+    s_cc_ops[socket_info->cc_kind].onAck(socket_info, rs, now);
+
+    if ((socket_info->in_recovery || socket_info->in_loss) &&
+        (int32_t)(socket_info->tcb.send_unack - socket_info->recovery_point) >= 0) {
+
+        socket_info->in_recovery = false;
+        socket_info->in_loss = false;
+        socket_info->undo_armed = false;
+        s_cc_ops[socket_info->cc_kind].exitRecovery(socket_info);
+    }
+}
+
+
+// RACK marked a segment lost: reduce once per window of data (RFC 6582 recovery point)
+void cc_onLoss(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->in_recovery || socket_info->in_loss) {
+        return;
+    }
+
+    saveUndoState(socket_info);
+    s_cc_ops[socket_info->cc_kind].enterRecovery(socket_info);
+    socket_info->in_recovery = true;
+    socket_info->recovery_point = socket_info->tcb.send_next;
+    socket_info->ecn_cwr_pending = socket_info->ecn_ok;
+}
+
+
+// A timeout during fast recovery keeps the undo state of the recovery
+void cc_onRTO(struct vsocket_infoset* socket_info)
+{
+    if (!socket_info->in_recovery && !socket_info->in_loss) {
+        saveUndoState(socket_info);
+    }
+
+    s_cc_ops[socket_info->cc_kind].onRTO(socket_info);
+    socket_info->in_recovery = false;
+    socket_info->in_loss = true;
+    socket_info->recovery_point = socket_info->tcb.send_next;
+    socket_info->ecn_cwr_pending = socket_info->ecn_ok;
+}
+
+
+// The peer echoed a CE mark (RFC 3168 6.1.2): reduce the window as for a loss, at most once
+// per window of data. Nothing needs retransmitting, so there is nothing to undo either.
+void cc_onECE(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->in_recovery || socket_info->in_loss) {
+        return;
+    }
+
+    socket_info->ecn_cwr_pending = true;
+    if (!s_cc_ops[socket_info->cc_kind].ecn) {
+        return;
+    }
+    s_cc_ops[socket_info->cc_kind].enterRecovery(socket_info);
+    socket_info->in_recovery = true;
+    socket_info->recovery_point = socket_info->tcb.send_next;
+    socket_info->undo_armed = false;
+    socket_info->ecn_reductions++;
+}
+
+
+// Our own interface queue dropped a segment (Linux's local congestion, tcp_enter_cwr):
+// the bottleneck is here, so every algorithm reduces right away instead of waiting for
+// RACK to notice the hole. RACK still finds and repairs the lost segment itself.
+void cc_onLocalDrop(struct vsocket_infoset* socket_info)
+{
+    socket_info->local_drops++;
+    if (socket_info->in_recovery || socket_info->in_loss) {
+        return;
+    }
+
+    s_cc_ops[socket_info->cc_kind].enterRecovery(socket_info);
+    socket_info->in_recovery = true;
+    socket_info->recovery_point = socket_info->tcb.send_next;
+    socket_info->undo_armed = false;
+    socket_info->ecn_cwr_pending = socket_info->ecn_ok;
+}
+
+
+// The loss episode was spurious (see rack.c): leave recovery and go back to the window
+// from before the reduction, keeping any growth since (like Linux tcp_undo_cwnd_reduction)
+void cc_undo(struct vsocket_infoset* socket_info)
+{
+    socket_info->cwnd = util_max(socket_info->cwnd, socket_info->prior_cwnd);
+    socket_info->ssthresh = util_max(socket_info->ssthresh, socket_info->prior_ssthresh);
+    socket_info->cwnd_acked = 0;
+    socket_info->in_recovery = false;
+    socket_info->in_loss = false;
+    socket_info->undo_armed = false;
+}
+
+
+// The rate segments are spread at: TCPO_PACING_RATE if set, else the algorithm's (0 = not
+// paced), never above TCPO_MAX_RATE
+uint64_t cc_getPacingRate(struct vsocket_infoset* socket_info)
+{
+    uint64_t rate = (socket_info->fixed_pacing_rate != 0) ? socket_info->fixed_pacing_rate : socket_info->pacing_rate;
+
+    if (socket_info->max_rate != 0 && (rate == 0 || rate > socket_info->max_rate)) {
+        rate = socket_info->max_rate;
+    }
+    return rate;
+}
+
+
+// Cap the transmit rate (0 = unlimited), starting with a full token bucket
+void cc_setMaxRate(struct vsocket_infoset* socket_info, uint64_t max_rate)
+{
+    socket_info->max_rate = max_rate;
+    socket_info->rate_tokens = getRateBucketDepth(socket_info);
+    socket_info->rate_refill_us = util_getTimeUs();
+    socket_info->pace_time_us = 0; // the next segment is paced at the new rate
+}
+
+
+// True while the sender has to hold its next segment back: until pace_time_us, or until
+// the token bucket of a rate capped socket is no longer overdrawn
+bool cc_mustWaitForPacing(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    refillRateTokens(socket_info, now);
+
+    if (socket_info->max_rate != 0 && socket_info->rate_tokens <= 0) {
+        return true;
+    }
+    return (cc_getPacingRate(socket_info) != 0 && now < socket_info->pace_time_us);
+}
+
+
+// When cc_mustWaitForPacing() turns false again
+uint64_t cc_getReleaseTime(struct vsocket_infoset* socket_info)
+{
+    uint64_t release = socket_info->pace_time_us;
+
+    if (socket_info->max_rate != 0 && socket_info->rate_tokens <= 0) {
+        uint64_t refill = socket_info->rate_refill_us + (1 - socket_info->rate_tokens)*1000000/socket_info->max_rate + 1;
+        if (refill > release) {
+            release = refill;
+        }
+    }
+    return release;
+}
+
+
+// Most bytes a send pass may release at once: PACING_BURST_US worth at the pacing rate,
+// at least two segments, and no more than the token bucket holds (a pass may overdraw it
+// by less than a segment)
+uint32_t cc_getPacingBurst(struct vsocket_infoset* socket_info)
+{
+    uint32_t burst = UINT32_MAX;
+
+    uint64_t rate = cc_getPacingRate(socket_info);
+    if (rate != 0) {
+        uint64_t paced = rate*PACING_BURST_US/1000000;
+        if (paced > CC_MAX_CWND) {
+            paced = CC_MAX_CWND;
+        }
+        burst = util_max((uint32_t)paced, 2*socket_info->tcb.mss);
+    }
+    if (socket_info->max_rate != 0 && socket_info->rate_tokens < burst) {
+        burst = (socket_info->rate_tokens > socket_info->tcb.mss) ? (uint32_t)socket_info->rate_tokens : socket_info->tcb.mss;
+    }
+    return burst;
+}
+
+
+// The next paced segment may go out once bytes have drained at the pacing rate. The bytes
+// are also taken out of the token bucket of a rate capped socket.
+void cc_onPacedSend(struct vsocket_infoset* socket_info, uint32_t bytes, uint64_t now)
+{
+    if (socket_info->max_rate != 0) {
+        socket_info->rate_tokens -= bytes;
+        if (socket_info->rate_tokens <= 0) {
+            socket_info->rate_limited++;
+        }
+    }
+
+    uint64_t rate = cc_getPacingRate(socket_info);
+    if (rate == 0) {
+        return;
+    }
+
+    uint64_t start = (socket_info->pace_time_us > now) ? socket_info->pace_time_us : now;
+    socket_info->pace_time_us = start + (uint64_t)bytes*1000000/rate;
+}
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
@@ -0,0 +1,99 @@
+#ifndef _CONGESTION_H_
+#define _CONGESTION_H_
+
+//=================================================================================================
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "tcp_layer.h"
+#include "rack.h"
+
+
+//=================================================================================================
+//      DEFINITIONS AND MACROS
+//=================================================================================================
+
+#define CC_INIT_CWND_SEGMENTS   10      // initial window (RFC 6928)
+#define CC_MAX_CWND             (2*DEFAULT_WSIZE)
+
+#define PACING_BURST_US         1000    // a paced sender releases at most 1ms worth of data at once
+
+// Reno paces at a multiple of cwnd/SRTT (like Linux tcp_update_pacing_rate): fast enough
+// that the window still doubles every round trip in slow start
+#define PACING_SS_RATIO         2.0
+#define PACING_CA_RATIO         1.2
+
+// Depth of the TCPO_MAX_RATE token bucket: 10ms worth of data, at least two segments
+#define RATE_BUCKET_US          10000
+
+
+// Delivery rate sample of one ACK (draft-cheng-iccrg-delivery-rate-estimation), taken from
+// the most recently sent of the segments it delivered
+struct rate_sample {
+    uint32_t acked;             //bytes newly delivered by this ACK
+    bool has_sample;
+    uint64_t prior_delivered;   //delivered when that segment was sent
+    uint64_t prior_time_us;
+    uint64_t send_elapsed_us;
+    uint64_t ack_elapsed_us;
+    uint64_t rtt_us;            //0 = that segment was retransmitted
+    bool app_limited;
+    uint64_t delivery_rate;     //bytes/s, 0 = no valid sample
+};
+
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+const char* cc_getName(TCP_Congestion_t kind);
+
+// Caller must hold g_vsocket_table_mutex for all of these.
+
+void cc_init(struct vsocket_infoset* socket_info);
+
+uint32_t cc_getPipe(struct vsocket_infoset* socket_info);
+
+uint32_t cc_getSendQuota(struct vsocket_infoset* socket_info);
+
+void cc_onTransmit(struct vsocket_infoset* socket_info, struct tx_record* record, bool was_idle, uint64_t now);
+
+void cc_checkAppLimited(struct vsocket_infoset* socket_info, bool has_unsent);
+
+void cc_initRateSample(struct rate_sample* rs);
+
+void cc_onDelivered(struct vsocket_infoset* socket_info, struct rate_sample* rs,
+                    struct tx_record* record, uint32_t bytes, uint64_t now);
+
+void cc_onAck(struct vsocket_infoset* socket_info, struct rate_sample* rs, uint64_t now);
+
+void cc_onLoss(struct vsocket_infoset* socket_info);
+
+void cc_onRTO(struct vsocket_infoset* socket_info);
+
+void cc_onECE(struct vsocket_infoset* socket_info);
+
+void cc_onLocalDrop(struct vsocket_infoset* socket_info);
+
+void cc_undo(struct vsocket_infoset* socket_info);
+
+uint64_t cc_getPacingRate(struct vsocket_infoset* socket_info);
+
+void cc_setMaxRate(struct vsocket_infoset* socket_info, uint64_t max_rate);
+
+bool cc_mustWaitForPacing(struct vsocket_infoset* socket_info, uint64_t now);
+
+uint64_t cc_getReleaseTime(struct vsocket_infoset* socket_info);
+
+uint32_t cc_getPacingBurst(struct vsocket_infoset* socket_info);
+
+void cc_onPacedSend(struct vsocket_infoset* socket_info, uint32_t bytes, uint64_t now);
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
+
+#endif //_CONGESTION_H_
@@ -0,0 +1,494 @@
+//=================================================================================================
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "egress_queue.h"
+
+#include <stddef.h>     // for offsetof()
+#include <unistd.h>     // for usleep()
+#include <netinet/ip.h> // for IPTOS_ECN_*
+
+//=================================================================================================
+//      DEFINITIONS AND MACROS
+//=================================================================================================
+
+// A packet waiting for transmission, allocated with only len bytes of ip_packet
+struct egress_packet {
+    uint64_t enqueue_us;        //util_getTimeUs() time, for the sojourn time
+    size_t len;
+    ip_packet_t ip_packet;
+};
+
+// One flow queue with its DRR deficit and CoDel state
+struct egress_flow {
+    GQueue packets;             //struct egress_packet, oldest first
+    size_t bytes;
+    int32_t deficit;            //bytes it may still send in this round
+    bool listed;                //on new_flows or old_flows
+
+    uint64_t first_above_us;    //when the sojourn time will have been above target for an interval, 0 = below
+    uint64_t drop_next_us;      //next drop (or mark) while dropping
+    uint32_t count;             //drops since entering the dropping state
+    uint32_t lastcount;
+    bool dropping;
+};
+
+// The flow queues of one priority band
+struct egress_band {
+    struct egress_flow flows[EGQ_FLOWS];
+    GQueue new_flows;           //flows that just became active, served first
+    GQueue old_flows;
+    uint32_t packets;
+    uint32_t weight;            //quanta per round between the weighted bands
+    int32_t deficit;            //bytes it may still send in this round
+    uint64_t sent_packets;
+};
+
+struct egress_queue {
+    uint32_t vip_address;       //next hop the transmit thread sends to
+    uint32_t quantum;           //DRR quantum: one link MTU
+
+    // Mutex to protect everything below
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        //wakes the transmit thread once packets are queued
+
+    struct egress_band bands[EGQ_BANDS];
+    int band_turn;              //weighted band being served
+    struct egress_packet* stalled_packet;   //the link couldn't take it yet, sent before anything else
+    uint32_t packets;
+    size_t bytes;
+
+    // shown by egq_print()
+    uint32_t codel_drops;
+    uint32_t ecn_marks;
+    uint32_t overlimit_drops;
+    uint32_t link_stalls;       //times the link's send buffer was full
+    uint32_t link_errors;       //packets the link failed to send
+};
+
+
+//=================================================================================================
+//      PRIVATE FUNCTIONS
+//=================================================================================================
+
+// Band of a packet by the class of its DSCP
+Egress_Band_t getBand(uint8_t tos)
+{
+    if (IPTOS_CLASS(tos) >= IPTOS_CLASS_CS6) {
+        return EGQ_BAND_CONTROL;
+    }
+    if (IPTOS_CLASS(tos) >= IPTOS_CLASS_CS4) {
+        return EGQ_BAND_INTERACTIVE;
+    }
+    return EGQ_BAND_BULK;
+}
+
+
+// Flow queue of a packet: source, destination, protocol and the first 4 bytes of the
+// payload (the ports of TCP and UDP)
+uint32_t hashFlow(ip_packet_t* ip_packet)
+{
+    uint32_t ports = 0;
+
+    if (ntohs(ip_packet->ip_header.ip_len) >= IP_HEADER_SIZE + sizeof(ports)) {
+        memcpy(&ports, ip_packet->ip_data, sizeof(ports));
+    }
+
+    uint32_t hash = ip_packet->ip_header.ip_src;
+    hash = hash*31 + ip_packet->ip_header.ip_dst;
+    hash = hash*31 + ip_packet->ip_header.ip_p;
+    hash = hash*31 + ports;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+
+    return hash % EGQ_FLOWS;
+}
+
+
+uint64_t intSqrt(uint64_t value)
+{
+    uint64_t root = value;
+    uint64_t next = (root + 1)/2;
+
+    // Newton's method, decreasing from above until it settles
+    while (next < root) {
+        root = next;
+        next = (root + value/root)/2;
+    }
+    return root;
+}
+
+
+// CoDel control law: drops get closer together with the square root of their count
+uint64_t codelControlLaw(uint64_t time_us, uint32_t count)
+{
+    return time_us + (EGQ_INTERVAL_US*1024)/intSqrt((uint64_t)count << 20);
+}
+
+
+// Take the oldest packet of flow and compare its sojourn time with the target (RFC 8289
+// dodequeue). ok_to_drop is set once it stayed above target for a whole interval.
+// WARNING: queue->mutex must already be acquired
+struct egress_packet* popFlowPacket(struct egress_queue* queue, struct egress_band* band, struct egress_flow* flow,
+                                    uint64_t now, bool* ok_to_drop)
+{
+    *ok_to_drop = false;
+
+    struct egress_packet* packet = g_queue_pop_head(&(flow->packets));
+    if (packet == NULL) {
+        flow->first_above_us = 0;
+        return NULL;
+    }
+    flow->bytes -= packet->len;
+    band->packets--;
+    queue->packets--;
+    queue->bytes -= packet->len;
+
+    if (now - packet->enqueue_us < EGQ_TARGET_US || flow->bytes <= queue->quantum) {
+        flow->first_above_us = 0; // below target, or too little left to be a standing queue
+    } else if (flow->first_above_us == 0) {
+        flow->first_above_us = now + EGQ_INTERVAL_US;
+    } else if (now >= flow->first_above_us) {
+        *ok_to_drop = true;
+    }
+    return packet;
+}
+
+
+// An ECN-capable packet is marked Congestion Experienced instead of being dropped (RFC 3168).
+// Returns false if the packet has to be dropped.
+// WARNING: queue->mutex must already be acquired
+bool markFlowPacket(struct egress_queue* queue, struct egress_packet* packet)
+{
+    ip_packet_t* ip_packet = &(packet->ip_packet);
+    uint8_t ecn = IPTOS_ECN(ip_packet->ip_header.ip_tos);
+
+    if (ecn != IPTOS_ECN_ECT0 && ecn != IPTOS_ECN_ECT1) {
+        return false;
+    }
+
+    ip_packet->ip_header.ip_tos |= IPTOS_ECN_CE;
+    ip_packet->ip_header.ip_sum = 0;
+    ip_packet->ip_header.ip_sum = (uint16_t)ip_sum((char*)&(ip_packet->ip_header), IP_HEADER_SIZE);
+    queue->ecn_marks++;
+    return true;
+}
+
+
+// WARNING: queue->mutex must already be acquired
+void dropFlowPacket(struct egress_queue* queue, struct egress_packet* packet)
+{
+    queue->codel_drops++;
+    free(packet);
+}
+
+
+// CoDel on one flow queue (RFC 8289 dequeue): returns the next packet to send, NULL once the
+// flow is empty. While the queue stays above target, packets are dropped (or marked) at a
+// rate growing with the square root of the drops so far.
+// WARNING: queue->mutex must already be acquired
+struct egress_packet* codelDequeue(struct egress_queue* queue, struct egress_band* band, struct egress_flow* flow,
+                                   uint64_t now)
+{
+    bool ok_to_drop;
+    struct egress_packet* packet = popFlowPacket(queue, band, flow, now, &ok_to_drop);
+
+    if (packet == NULL) {
+        flow->dropping = false;
+        return NULL;
+    }
+
+    if (flow->dropping) {
+        if (!ok_to_drop) {
+            flow->dropping = false; // back below target
+        }
+        while (flow->dropping && now >= flow->drop_next_us) {
+            flow->count++;
+            if (markFlowPacket(queue, packet)) {
+                flow->drop_next_us = codelControlLaw(flow->drop_next_us, flow->count);
+                break;
+            }
+            dropFlowPacket(queue, packet);
+            packet = popFlowPacket(queue, band, flow, now, &ok_to_drop);
+            if (!ok_to_drop) {
+                flow->dropping = false;
+            } else {
+                flow->drop_next_us = codelControlLaw(flow->drop_next_us, flow->count);
+            }
+        }
+    } else if (ok_to_drop) {
+        if (!markFlowPacket(queue, packet)) {
+            dropFlowPacket(queue, packet);
+            packet = popFlowPacket(queue, band, flow, now, &ok_to_drop);
+        }
+
+        // Pick up the drop rate of the last dropping state if it ended recently
+        flow->dropping = true;
+        uint32_t delta = flow->count - flow->lastcount;
+        if (delta > 1 && (int64_t)(now - flow->drop_next_us) < 16*EGQ_INTERVAL_US) {
+            flow->count = delta;
+        } else {
+            flow->count = 1;
+        }
+        flow->drop_next_us = codelControlLaw(now, flow->count);
+        flow->lastcount = flow->count;
+    }
+    return packet;
+}
+
+
+// Deficit round robin over the active flows of a band, new ones first so that sparse flows
+// (ACKs, interactive traffic) go out ahead of bulk flows (RFC 8290 4.2). NULL once all are empty.
+// WARNING: queue->mutex must already be acquired
+struct egress_packet* bandDequeue(struct egress_queue* queue, struct egress_band* band, uint64_t now)
+{
+    while (true) {
+        GQueue* list = &(band->new_flows);
+        struct egress_flow* flow = g_queue_peek_head(list);
+        if (flow == NULL) {
+            list = &(band->old_flows);
+            flow = g_queue_peek_head(list);
+            if (flow == NULL) {
+                return NULL;
+            }
+        }
+
+        if (flow->deficit <= 0) {
+            flow->deficit += queue->quantum;
+            g_queue_push_tail(&(band->old_flows), g_queue_pop_head(list));
+            continue;
+        }
+
+        struct egress_packet* packet = codelDequeue(queue, band, flow, now);
+        if (packet == NULL) {
+            // An emptied new flow goes to old_flows so that it can't return as new at once
+            g_queue_pop_head(list);
+            if (list == &(band->new_flows) && !g_queue_is_empty(&(band->old_flows))) {
+                g_queue_push_tail(&(band->old_flows), flow);
+            } else {
+                flow->listed = false;
+            }
+            continue;
+        }
+
+        flow->deficit -= packet->len;
+        return packet;
+    }
+}
+
+
+// Next packet to send: network control first, then the other bands by weighted deficit
+// round robin. NULL once all bands are empty.
+// WARNING: queue->mutex must already be acquired
+struct egress_packet* fqDequeue(struct egress_queue* queue, uint64_t now)
+{
+    struct egress_band* band = &(queue->bands[EGQ_BAND_CONTROL]);
+    struct egress_packet* packet = bandDequeue(queue, band, now);
+    
+    while (packet == NULL && queue->packets > 0) {
+        band = &(queue->bands[queue->band_turn]);
+        
+        if (band->packets == 0 || band->deficit <= 0) {
+            if (band->packets != 0) {
+                band->deficit += band->weight*queue->quantum;
+            } else {
+                band->deficit = 0; // an idle band saves up no credit
+            }
+            queue->band_turn = (queue->band_turn + 1 < EGQ_BANDS) ? queue->band_turn + 1 : EGQ_BAND_CONTROL + 1;
+            continue;
+        }
+        
+        packet = bandDequeue(queue, band, now);
+        if (packet != NULL) {
+            band->deficit -= packet->len;
+        }
+    }
+    
+    if (packet != NULL) {
+        band->sent_packets++;
+    }
+    return packet;
+}
+
+
+// Make room by dropping from the head of the flow queue holding the most bytes. Returns
+// that flow.
+// WARNING: queue->mutex must already be acquired
+struct egress_flow* dropFromLongestFlow(struct egress_queue* queue)
+{
+    struct egress_band* longest_band = &(queue->bands[0]);
+    struct egress_flow* longest = &(longest_band->flows[0]);
+    int b, i;
+
+    for (b = 0; b < EGQ_BANDS; b++) {
+        for (i = 0; i < EGQ_FLOWS; i++) {
+            if (queue->bands[b].flows[i].bytes > longest->bytes) {
+                longest_band = &(queue->bands[b]);
+                longest = &(longest_band->flows[i]);
+            }
+        }
+    }
+
+    struct egress_packet* packet = g_queue_pop_head(&(longest->packets));
+    longest->bytes -= packet->len;
+    longest_band->packets--;
+    queue->packets--;
+    queue->bytes -= packet->len;
+    queue->overlimit_drops++;
+    free(packet);
+
+    return longest;
+}
+
+
+// Transmit thread of one interface: sends whatever the scheduler picks, sleeps while it is empty
+void* egressThreadFunc(void* arg)
+{
+    struct egress_queue* queue = (struct egress_queue*)arg;
+
+    while (true) {
+        // Critical Section
+        pthread_mutex_lock(&(queue->mutex));
+        struct egress_packet* packet = queue->stalled_packet;
+        queue->stalled_packet = NULL;
+        while (packet == NULL && (packet = fqDequeue(queue, util_getTimeUs())) == NULL) {
+            pthread_cond_wait(&(queue->cond), &(queue->mutex));
+        }
+        pthread_mutex_unlock(&(queue->mutex));
+
+        int ret = link_sendPacket((char*)&(packet->ip_packet), packet->len, queue->vip_address);
+        
+        if (ret == -EAGAIN || ret == -ENOBUFS) {
+            // The link is backed up: hold the packet and wait for room, so that the backlog
+            // builds up here, where CoDel sees it and the senders are told about drops
+            pthread_mutex_lock(&(queue->mutex));
+            queue->stalled_packet = packet;
+            queue->link_stalls++;
+            pthread_mutex_unlock(&(queue->mutex));
+            
+            link_waitWritable(queue->vip_address, EGQ_STALL_WAIT_MS);
+            if (ret == -ENOBUFS) {
+                usleep(EGQ_STALL_WAIT_MS*1000); // writable, but the kernel is out of buffers
+            }
+            continue;
+        }
+        
+        if (ret < 0) {
+            pthread_mutex_lock(&(queue->mutex));
+            queue->link_errors++;
+            pthread_mutex_unlock(&(queue->mutex));
+        }
+        free(packet);
+    }
+
+    return NULL;
+}
+
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+// Egress queue for the interface to the neighbor at vip_address, with its transmit thread
+struct egress_queue* egq_create(uint32_t vip_address)
+{
+    struct egress_queue* queue = (struct egress_queue*)calloc(1, sizeof(struct egress_queue));
+    int b, i;
+
+    queue->vip_address = vip_address;
+    queue->quantum = link_getMTU(vip_address);
+    pthread_mutex_init(&(queue->mutex), NULL);
+    pthread_cond_init(&(queue->cond), NULL);
+    for (b = 0; b < EGQ_BANDS; b++) {
+        struct egress_band* band = &(queue->bands[b]);
+        for (i = 0; i < EGQ_FLOWS; i++) {
+            g_queue_init(&(band->flows[i].packets));
+        }
+        g_queue_init(&(band->new_flows));
+        g_queue_init(&(band->old_flows));
+        band->weight = 1;
+    }
+    queue->bands[EGQ_BAND_INTERACTIVE].weight = EGQ_INTERACTIVE_WEIGHT;
+    queue->band_turn = EGQ_BAND_CONTROL + 1;
+
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, egressThreadFunc, (void*)queue);
+    pthread_detach(thread_id);
+
+    return queue;
+}
+
+
+// Queue a copy of ip_packet for transmission. Returns -ENOBUFS if the queue was full and
+// the packet's own flow lost a packet to make room, 0 otherwise.
+int egq_enqueue(struct egress_queue* queue, ip_packet_t* ip_packet)
+{
+    size_t len = ntohs(ip_packet->ip_header.ip_len);
+    struct egress_packet* packet = (struct egress_packet*)malloc(offsetof(struct egress_packet, ip_packet) + len);
+    memcpy(&(packet->ip_packet), ip_packet, len);
+    packet->len = len;
+
+    struct egress_band* band = &(queue->bands[getBand(ip_packet->ip_header.ip_tos)]);
+    struct egress_flow* flow = &(band->flows[hashFlow(ip_packet)]);
+    int ret = 0;
+
+    // Critical Section
+    pthread_mutex_lock(&(queue->mutex));
+    packet->enqueue_us = util_getTimeUs();
+    g_queue_push_tail(&(flow->packets), packet);
+    flow->bytes += len;
+    band->packets++;
+    if (queue->packets++ == 0) {
+        pthread_cond_signal(&(queue->cond));
+    }
+    queue->bytes += len;
+
+    if (!flow->listed) {
+        flow->listed = true;
+        flow->deficit = queue->quantum;
+        g_queue_push_tail(&(band->new_flows), flow);
+    }
+
+    if (queue->packets > EGQ_LIMIT_PACKETS && dropFromLongestFlow(queue) == flow) {
+        ret = -ENOBUFS;
+    }
+    pthread_mutex_unlock(&(queue->mutex));
+
+    return ret;
+}
+
+
+// Packets this node dropped itself on the interface instead of sending them
+uint32_t egq_getLocalDrops(struct egress_queue* queue)
+{
+    // Critical Section
+    pthread_mutex_lock(&(queue->mutex));
+    uint32_t drops = queue->codel_drops + queue->overlimit_drops + queue->link_errors;
+    pthread_mutex_unlock(&(queue->mutex));
+    
+    return drops;
+}
+
+
+void egq_print(struct egress_queue* queue)
+{
+    static const char* band_names[EGQ_BANDS] = { "control:", "interactive:", "bulk:" };
+    int b;
+    
+    // Critical Section
+    pthread_mutex_lock(&(queue->mutex));
+    printf("    %u packets (%zu bytes) queued\n", queue->packets, queue->bytes);
+    for (b = 0; b < EGQ_BANDS; b++) {
+        struct egress_band* band = &(queue->bands[b]);
+        printf("    %-12s %u packets in %u flows, %" PRIu64 " sent\n", band_names[b], band->packets,
+               g_queue_get_length(&(band->new_flows)) + g_queue_get_length(&(band->old_flows)),
+               band->sent_packets);
+    }
+    printf("    codel: %u dropped, %u marked CE; %u dropped over the %d packet limit\n",
+           queue->codel_drops, queue->ecn_marks, queue->overlimit_drops, EGQ_LIMIT_PACKETS);
+    printf("    link: %u times full, %u send errors\n", queue->link_stalls, queue->link_errors);
+    pthread_mutex_unlock(&(queue->mutex));
+}
@@ -0,0 +1,64 @@
+#ifndef _EGRESS_QUEUE_H_
+#define _EGRESS_QUEUE_H_
+
+//=================================================================================================
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "link_layer.h"
+
+//=================================================================================================
+//      DEFINITIONS AND MACROS
+//=================================================================================================
+
+// Flow queues per band; packets are hashed onto them by addresses, protocol and ports
+#define EGQ_FLOWS           256
+
+// Priority bands by DSCP class. Network control is always served first; the other two share
+// the link by weighted round robin, EGQ_INTERACTIVE_WEIGHT quanta to one, so that neither
+// latency-sensitive traffic waits behind bulk data nor bulk data starves.
+typedef enum {
+    EGQ_BAND_CONTROL = 0,   // CS6, CS7: routing
+    EGQ_BAND_INTERACTIVE,   // CS4, AF4x, CS5, EF
+    EGQ_BAND_BULK,          // everything else
+    EGQ_BANDS
+} Egress_Band_t;
+
+#define EGQ_INTERACTIVE_WEIGHT  4
+
+// Packets held per interface; past this the head of the longest flow queue is dropped
+#define EGQ_LIMIT_PACKETS   1024
+
+// CoDel (RFC 8289): drop (or mark CE) once packets have waited longer than the target for
+// a whole interval
+#define EGQ_TARGET_US       5000
+#define EGQ_INTERVAL_US     100000
+
+// How long the transmit thread waits for room when the link's send buffer is full
+#define EGQ_STALL_WAIT_MS   1
+
+
+// Egress queue of one interface: FQ-CoDel (RFC 8290) per band, drained by its own transmit thread
+struct egress_queue;
+
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+struct egress_queue* egq_create(uint32_t vip_address);
+
+int egq_enqueue(struct egress_queue* queue, ip_packet_t* ip_packet);
+
+uint32_t egq_getLocalDrops(struct egress_queue* queue);
+
+void egq_print(struct egress_queue* queue);
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
+
+#endif //_EGRESS_QUEUE_H_
@@ -9,6 +9,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <assert.h>
+#include <poll.h>
 
 
 //=================================================================================================
@@ -45,11 +46,15 @@ int g_highest_input_interface = 0;    // Highest file descriptor in g_input_inte
 //      PUBLIC FUNCTIONS
 //=================================================================================================
 
-void link_sendPacket(char* payload, size_t payload_len, uint32_t vip_address)
+// Send payload to the neighbor at vip_address in as many UDP frames as it takes. Returns 0,
+// -EAGAIN or -ENOBUFS if the socket can't take the first frame right now (nothing was sent,
+// the caller keeps the packet), or another negative errno if the packet was lost.
+int link_sendPacket(char* payload, size_t payload_len, uint32_t vip_address)
 {
     char* vip = util_convertVIPInt2String(vip_address);
 
     int* socket=g_hash_table_lookup(g_forwarding_table, (gpointer)vip);
+    free(vip);
     struct sockaddr_in* dst_addr=g_hash_table_lookup(g_send_socket_addr_lookup, (gpointer)socket);
     char ip_str[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(dst_addr->sin_addr), ip_str, INET_ADDRSTRLEN);
@@ -62,6 +67,7 @@ void link_sendPacket(char* payload, size_t payload_len, uint32_t vip_address)
     //printf("but is physically sending packets to %s\n", ip_str);
 
     char send_buffer[UDP_FRAME_SIZE];
+    int flags = MSG_DONTWAIT; // once the first frame is out, the others wait for room
     
     while(true){
         if(data_left<=0) break;
@@ -80,10 +86,37 @@ void link_sendPacket(char* payload, size_t payload_len, uint32_t vip_address)
             data_left=0;
         }
 
-        if(sendto(*socket, send_buffer, send_size, 0, (struct sockaddr*)dst_addr, sizeof(*dst_addr))!=send_size){
-            fprintf(stderr, "have error in sending message because %s\n", strerror(errno));
+        if(sendto(*socket, send_buffer, send_size, flags, (struct sockaddr*)dst_addr, sizeof(*dst_addr))!=send_size){
+            int error = errno;
+            if (flags == MSG_DONTWAIT && (error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS)) {
+                return (error == ENOBUFS) ? -ENOBUFS : -EAGAIN;
+            }
+            fprintf(stderr, "have error in sending message because %s\n", strerror(error));
+            return -error;
         }
+        flags = 0;
     } // end while()
+    
+    return 0;
+}
+
+
+// Wait up to timeout_ms for room in the send buffer of the link to the neighbor at vip_address
+void link_waitWritable(uint32_t vip_address, int timeout_ms)
+{
+    char* vip = util_convertVIPInt2String(vip_address);
+    int* socket = g_hash_table_lookup(g_forwarding_table, (gpointer)vip);
+    free(vip);
+    
+    if (socket == NULL) {
+        return;
+    }
+    
+    struct pollfd pfd;
+    pfd.fd = *socket;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout_ms);
 }
 
 
@@ -113,6 +146,30 @@ void link_receivePacket(char* payload, size_t* payload_len, int socket)
 }
 
 
+// True if another frame is already queued on socket (reading it won't block)
+bool link_hasPendingInput(int socket)
+{
+    char byte;
+    
+    return (recv(socket, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) >= 0);
+}
+
+
+// Largest payload sent in a single UDP frame to the neighbor at vip_address, 0 if there is no such link
+size_t link_getMTU(uint32_t vip_address)
+{
+    char* vip = util_convertVIPInt2String(vip_address);
+    int* socket = g_hash_table_lookup(g_forwarding_table, (gpointer)vip);
+    free(vip);
+    
+    if (socket == NULL) {
+        return 0;
+    }
+    
+    return UDP_FRAME_SIZE; // every link is a UDP socket with the same frame size
+}
+
+
 void link_setupForwardingTableAndSockets(list_t* list)
 {
 
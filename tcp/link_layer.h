@@ -26,12 +26,18 @@ extern int g_highest_input_interface;       // Highest file descriptor in g_inpu
 //      PUBLIC FUNCTION DECLARATIONS
 //=================================================================================================
 
-void link_sendPacket(char* payload, size_t payload_len, uint32_t vip_address);
+int link_sendPacket(char* payload, size_t payload_len, uint32_t vip_address);
+
+void link_waitWritable(uint32_t vip_address, int timeout_ms);
 
 void link_receivePacket(char* payload, size_t* payload_len, int socket);
 
+bool link_hasPendingInput(int socket);
+
 void link_setupForwardingTableAndSockets(list_t* list);
 
+size_t link_getMTU(uint32_t vip_address);
+
 
 //=================================================================================================
 //      END OF FILE
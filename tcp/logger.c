@@ -9,6 +9,7 @@
 
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 //=================================================================================================
 //      DEFINITIONS AND MACROS
@@ -30,25 +31,38 @@ void lgr_open(int vsocket)
     struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
     uint32_t saddr = socket_info->tcb.local_vip;
     pthread_mutex_unlock(&g_vsocket_table_mutex);
-        
-    pthread_mutex_init(&(socket_info->logger.lock), NULL);
+    
+    // Logger is kept out of line, it is cold compared to the TCB
+    Logger_t* logger = (Logger_t*)malloc(sizeof(Logger_t));
+    pthread_mutex_init(&(logger->lock), NULL);
     
     char filename[35];
     memset(filename, 0, 35);
     sprintf(filename, "log_s%d_vip_%s.txt", vsocket, util_convertVIPInt2StringNoPeriod(saddr));
     
+    logger->fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    
     // Critical Section
-    pthread_mutex_lock(&(socket_info->logger.lock));
-    socket_info->logger.fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-    pthread_mutex_unlock(&(socket_info->logger.lock));
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    socket_info->logger = logger;
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
 }
 
 
+// Called without g_vsocket_table_mutex held
 void lgr_storeTCPPacket(void* info, struct timespec* receipt_time, tcp_packet_t* tcp_packet,
                         uint32_t packet_len, Packet_Type_t pkt_type)
 {
     struct vsocket_infoset* socket_info = (struct vsocket_infoset*)info;
     
+    // Handshake packets are sent/received before lgr_open(), late ones after lgr_close()
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    bool logging = (socket_info->logger != NULL);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    if (!logging) {
+        return;
+    }
+    
     char buf[BUF_SIZE];
     
     memset(buf, 0, BUF_SIZE);
@@ -90,23 +104,48 @@ void lgr_storeTCPPacket(void* info, struct timespec* receipt_time, tcp_packet_t*
     
     strcat(buf, "\n");
     
-    // Critical Section
-    pthread_mutex_lock(&(socket_info->logger.lock));
-    write(socket_info->logger.fd, buf, strlen(buf));
-    pthread_mutex_unlock(&(socket_info->logger.lock));
+    // Critical Section: the logger lock is taken before the table lock is released, so lgr_close()
+    // (which waits for it) can't free the logger under us
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    Logger_t* logger = socket_info->logger;
+    if (logger != NULL) {
+        pthread_mutex_lock(&(logger->lock));
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    if (logger != NULL) {
+        write(logger->fd, buf, strlen(buf));
+        pthread_mutex_unlock(&(logger->lock));
+    }
 }
 
 
+// Packets sent or received afterwards are no longer logged. Called when the last connection
+// thread quits (see releaseThreadBuffers()).
 void lgr_close(int vsocket)
 {
+    Logger_t* logger = NULL;
+    
+    // Critical Section
     pthread_mutex_lock(&g_vsocket_table_mutex);
     struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
+    if (socket_info != NULL) {
+        logger = socket_info->logger;
+        socket_info->logger = NULL;
+    }
     pthread_mutex_unlock(&g_vsocket_table_mutex);
     
+    if (logger == NULL) {
+        return;
+    }
+    
     // Critical Section
-    pthread_mutex_lock(&(socket_info->logger.lock));
-    close(socket_info->logger.fd);
-    pthread_mutex_unlock(&(socket_info->logger.lock));
+    pthread_mutex_lock(&(logger->lock));
+    close(logger->fd);
+    pthread_mutex_unlock(&(logger->lock));
+    
+    pthread_mutex_destroy(&(logger->lock));
+    free(logger);
 }
 
 
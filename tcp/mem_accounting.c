@@ -0,0 +1,143 @@
+//================================================================================================= 
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "mem_accounting.h"
+
+//=================================================================================================
+//      GLOBAL VARIABLES
+//=================================================================================================
+
+// Mutex to protect all variables below
+static pthread_mutex_t g_mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t s_mem_usage[MEM_KINDS];
+static size_t s_mem_total = 0;
+
+static size_t s_mem_low = MEM_DEFAULT_LOW;
+static size_t s_mem_pressure = MEM_DEFAULT_PRESSURE;
+static size_t s_mem_high = MEM_DEFAULT_HIGH;
+
+static bool s_under_pressure = false;
+static uint32_t s_refused = 0;
+
+static const char* s_kind_names[MEM_KINDS] = { "send", "recv", "out-of-order" };
+
+//=================================================================================================
+//      PRIVATE FUNCTIONS
+//=================================================================================================
+
+// WARNING: g_mem_mutex must already be acquired
+void updatePressure(void)
+{
+    if (s_mem_total >= s_mem_pressure) {
+        s_under_pressure = true;
+    } else if (s_mem_total < s_mem_low) {
+        s_under_pressure = false;
+    }
+}
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+// Returns false (and charges nothing) if the allocation must be refused
+bool mem_charge(Mem_Kind_t kind, size_t bytes)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_mem_mutex);
+    
+    // Hard limit, or no new out-of-order space while under pressure
+    if ((s_mem_total + bytes > s_mem_high) || (s_under_pressure && kind == MEM_OOO)) {
+        s_refused++;
+        pthread_mutex_unlock(&g_mem_mutex);
+        return false;
+    }
+    
+    s_mem_usage[kind] += bytes;
+    s_mem_total += bytes;
+    updatePressure();
+    
+    pthread_mutex_unlock(&g_mem_mutex);
+    
+    return true;
+}
+
+
+void mem_uncharge(Mem_Kind_t kind, size_t bytes)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_mem_mutex);
+    
+    assert(s_mem_usage[kind] >= bytes);
+    s_mem_usage[kind] -= bytes;
+    s_mem_total -= bytes;
+    updatePressure();
+    
+    pthread_mutex_unlock(&g_mem_mutex);
+}
+
+
+bool mem_underPressure(void)
+{
+    pthread_mutex_lock(&g_mem_mutex);
+    bool ret = s_under_pressure;
+    pthread_mutex_unlock(&g_mem_mutex);
+    
+    return ret;
+}
+
+
+// Shrink the advertised window while the node is under memory pressure
+uint32_t mem_clampWindow(uint32_t window)
+{
+    if (mem_underPressure()) {
+        return util_min(window, MEM_PRESSURE_WINDOW);
+    }
+    
+    return window;
+}
+
+
+bool mem_setLimits(size_t low, size_t pressure, size_t high)
+{
+    if (low > pressure || pressure > high) {
+        return false;
+    }
+    
+    // Critical Section
+    pthread_mutex_lock(&g_mem_mutex);
+    s_mem_low = low;
+    s_mem_pressure = pressure;
+    s_mem_high = high;
+    updatePressure();
+    pthread_mutex_unlock(&g_mem_mutex);
+    
+    return true;
+}
+
+
+void mem_printUsage(void)
+{
+    int kind;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_mem_mutex);
+    
+    printf("\n------Buffer Memory-----\n");
+    for (kind = 0; kind < MEM_KINDS; kind++) {
+        printf("%s: %zu bytes\n", s_kind_names[kind], s_mem_usage[kind]);
+    }
+    printf("total: %zu bytes (low %zu, pressure %zu, high %zu)\n", s_mem_total, s_mem_low, s_mem_pressure, s_mem_high);
+    printf("state: %s, refused allocations: %u\n", s_under_pressure ? "under pressure" : "normal", s_refused);
+    printf("------End Buffer Memory-----\n\n");
+    
+    pthread_mutex_unlock(&g_mem_mutex);
+}
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
@@ -0,0 +1,57 @@
+#ifndef _MEM_ACCOUNTING_H_
+#define _MEM_ACCOUNTING_H_
+
+//================================================================================================= 
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "utility.h"
+
+//=================================================================================================
+//      DEFINITIONS AND MACROS
+//=================================================================================================
+
+// Node-wide limits for socket buffer memory (like Linux tcp_mem):
+//  -- above MEM_PRESSURE the node enters pressure mode and stays there until usage drops below MEM_LOW
+//  -- nothing may be charged past MEM_HIGH
+#define MEM_DEFAULT_LOW         (32*1024*1024)
+#define MEM_DEFAULT_PRESSURE    (48*1024*1024)
+#define MEM_DEFAULT_HIGH        (64*1024*1024)
+
+#define MEM_PRESSURE_WINDOW     (4*1350)    // advertised window clamp under pressure (4 segments)
+
+
+typedef enum Mem_Kind {
+
+    MEM_SEND = 0,   // swin_buffer
+    MEM_RECV,       // in_data
+    MEM_OOO,        // rwin_buffer + pending_data (out-of-order reassembly)
+    MEM_KINDS
+
+} Mem_Kind_t;
+
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+bool mem_charge(Mem_Kind_t kind, size_t bytes);
+
+void mem_uncharge(Mem_Kind_t kind, size_t bytes);
+
+bool mem_underPressure(void);
+
+uint32_t mem_clampWindow(uint32_t window);
+
+bool mem_setLimits(size_t low, size_t pressure, size_t high);
+
+void mem_printUsage(void);
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
+
+#endif //_MEM_ACCOUNTING_H_
@@ -6,9 +6,11 @@
 
 #include "net_layer.h"
 
+#include "egress_queue.h"
 #include "util/colordefs.h"
 
 #include <unistd.h>     // for usleep()
+#include <netinet/ip.h> // for IPTOS_CLASS_*
 
 //=================================================================================================
 //      DEFINITIONS AND MACROS
@@ -31,6 +33,8 @@ typedef enum {
 
 #define RIP_REQUEST_SIZE        4
 
+#define RIP_TOS                 IPTOS_CLASS_CS6 // network control, ahead of all other traffic
+
 //=================================================================================================
 //      GLOBAL VARIABLES
 //=================================================================================================
@@ -55,8 +59,8 @@ static pthread_mutex_t g_local_vips_mutex = PTHREAD_MUTEX_INITIALIZER;
 static GHashTable* s_all_local_vips = NULL;
 
 
-// Mutex to protect function sendPacket()
-static pthread_mutex_t g_send_packet_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Egress queue of each interface, keyed by the neighbor's VIP (read only after net_setupTables())
+static GHashTable* s_egress_queues = NULL;
 
 
 static list_t* g_neighbor_keys = NULL;
@@ -76,9 +80,11 @@ static int FALSE_VALUE = FALSE;     // treat as const, do not change
 //=================================================================================================
 
 void buildIPPacket(ip_packet_t* ip_packet, int to_vip_address, int from_vip_address,
-                   ip_protocol_t protocol, char* data, size_t data_len);
+                   ip_protocol_t protocol, uint8_t tos, char* data, size_t data_len);
 
 int sendIPPacket(ip_packet_t* ip_packet, bool routing_msg);
+int getNextHopForSend(uint32_t to_vip_addr, uint32_t* nxt_vip_addr);
+bool buildGSOPiece(ip_packet_t* ip_packet, void* super_segment, gso_segment_t segment, int index);
 int receiveIPPacket(ip_packet_t* ip_packet, int interface, uint32_t vip_address);
 
 void printRoute(gpointer key_vip, gpointer nxt_vip);
@@ -155,7 +161,10 @@ void* net_routingThreadFunction(void* arg)
 //      PUBLIC FUNCTIONS
 //=================================================================================================
 
-bool net_sendMessage(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t protocol, char* data, size_t data_len)
+// Returns SENT_IP_PACKET, LOCAL_DROP if the packet was queued but the interface queue had
+// to drop one of the same flow to make room, or why it could not be sent
+int net_sendMessage(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t protocol, uint8_t tos,
+                    char* data, size_t data_len)
 {
     int result = 0;
     ip_packet_t ip_packet;
@@ -173,7 +182,7 @@ bool net_sendMessage(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t proto
         
     } else { // Build and send packet
         
-        buildIPPacket(&ip_packet, to_vip_addr, from_vip_addr, protocol, data, data_len);
+        buildIPPacket(&ip_packet, to_vip_addr, from_vip_addr, protocol, tos, data, data_len);
         
         // Check if user is sending message to a local VIP
         // Protect shared variable s_all_local_vips
@@ -186,6 +195,7 @@ bool net_sendMessage(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t proto
             if ((*value_ptr) != FALSE_VALUE) { // Check if VIP is up
                 result = SENT_IP_PACKET;
                 util_callHandler(ip_packet.ip_header.ip_p, &ip_packet);
+                util_callFlushHandlers();
                 
             } else { // Local VIP is down
                 result = LINK_DOWN;
@@ -198,11 +208,65 @@ bool net_sendMessage(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t proto
     
     //printSendIPPacketResult(result, true);
     
-    if (result == SENT_IP_PACKET) {
-        return true;
+    return result;
+}
+
+
+// Send a super-segment built once by the protocol: it is split into wire packets only here,
+// with one route lookup and one IP header template for all of its pieces. Returns the same as
+// net_sendMessage(), LOCAL_DROP if it did for any of the pieces.
+int net_sendMessageGSO(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t protocol, uint8_t tos,
+                       void* super_segment, gso_segment_t segment)
+{
+    int count = 0;
+    int result = 0;
+    uint32_t nxt_vip_addr;
+    int* value_ptr = NULL;
+    
+    // IP header template, only ip_len and ip_sum change from piece to piece
+    ip_packet_t* ip_packet = (ip_packet_t*)malloc(sizeof(ip_packet_t));
+    buildIPPacket(ip_packet, to_vip_addr, from_vip_addr, protocol, tos, NULL, 0);
+    
+    // Check if user is sending message to a local VIP
+    // Protect shared variable s_all_local_vips
+    pthread_mutex_lock(&g_local_vips_mutex);
+    value_ptr = g_hash_table_lookup(s_all_local_vips, &to_vip_addr);
+    pthread_mutex_unlock(&g_local_vips_mutex);
+    
+    if (value_ptr != NULL) { // Sending to a local VIP, hand each piece up the stack
+    
+        if ((*value_ptr) != FALSE_VALUE) { // Check if VIP is up
+            result = SENT_IP_PACKET;
+            while (buildGSOPiece(ip_packet, super_segment, segment, count)) {
+                util_callHandler(protocol, ip_packet);
+                count++;
+            }
+            util_callFlushHandlers(); // the pieces may be coalesced again (GRO)
+            
+        } else { // Local VIP is down
+            result = LINK_DOWN;
+        }
+        
     } else {
-        return false;
+    
+        result = getNextHopForSend(to_vip_addr, &nxt_vip_addr);
+        
+        if (result == SENT_IP_PACKET) {
+            struct egress_queue* queue = g_hash_table_lookup(s_egress_queues, &nxt_vip_addr);
+            while (buildGSOPiece(ip_packet, super_segment, segment, count)) {
+                if (egq_enqueue(queue, ip_packet) == -ENOBUFS) {
+                    result = LOCAL_DROP;
+                }
+                count++;
+            }
+        }
+        
+        //printSendIPPacketResult(result, true);
     }
+    
+    free(ip_packet);
+    
+    return result;
 }
 
 
@@ -230,6 +294,7 @@ void net_setupTables(char* link_file)
     s_interfaces_operable = g_hash_table_new(g_int_hash, g_int_equal);
     g_neighbors = g_hash_table_new(g_int_hash, g_int_equal);
     s_all_local_vips = g_hash_table_new(g_int_hash, g_int_equal);
+    s_egress_queues = g_hash_table_new(g_int_hash, g_int_equal);
     // ----- Extra Tables ---------------------------------------------- //    
     
     // Create list (keys into neighbors)
@@ -287,6 +352,12 @@ void net_setupTables(char* link_file)
     
     // Create all UDP connections and store sockets in Forwarding Table
     link_setupForwardingTableAndSockets(g_interfaces_list);
+    
+    // One egress queue and transmit thread per interface
+    for (current = g_interfaces_list->head; current != NULL; current = current->next) {
+        link = (current->data);
+        g_hash_table_insert(s_egress_queues, &(link->remote_virt_ip.s_addr), egq_create(link->remote_virt_ip.s_addr));
+    }
 }
 
 
@@ -367,7 +438,7 @@ bool net_handlePacketInput(int interface)
     ip_packet.ip_header.ip_sum = (uint16_t)ip_sum((char*)&(ip_packet.ip_header), IP_HEADER_BYTES);
     
     // Forward packet
-    bool result = sendIPPacket(&ip_packet, false);
+    int result = sendIPPacket(&ip_packet, false);
     
     NET_PRINT("\nForwarding packet: ");
     printSendIPPacketResult(result, true);
@@ -414,11 +485,13 @@ void net_printNetworkInterfaces(void)
         
         // Print out if interface is up or down
         if ((*value_ptr) == TRUE) {
-            printf("(up)\n");
+            printf("(up)");
         } else {
-            printf("(down)\n");
+            printf("(down)");
         }
         
+        printf(", %u dropped locally\n", egq_getLocalDrops(g_hash_table_lookup(s_egress_queues, vip_addr_ptr)));
+        
     } // end for()
     
     printf("---End Interfaces---\n\n");
@@ -438,6 +511,30 @@ void net_printNetworkRoutes(void)
 }
 
 
+// Egress queue of each interface, in interface order
+void net_printEgressQueues(void)
+{
+    int interface;
+    uint32_t* vip_addr_ptr = NULL;
+    size_t size;
+    
+    size = g_hash_table_size(g_neighbors);
+    
+    printf("\n---Egress Queues---\n");
+    
+    for (interface = 0; interface < size; interface++) {
+    
+        vip_addr_ptr = g_hash_table_lookup(g_neighbors, &interface);
+        
+        printf("%d - to VIP %d.%d.%d.%d\n", interface, MASK_BYTE1((*vip_addr_ptr)), \
+            MASK_BYTE2((*vip_addr_ptr)), MASK_BYTE3((*vip_addr_ptr)), MASK_BYTE4((*vip_addr_ptr)));
+        egq_print(g_hash_table_lookup(s_egress_queues, vip_addr_ptr));
+    }
+    
+    printf("---End Egress Queues---\n\n");
+}
+
+
 void net_downInterface(int interface)
 {
     changeInterface(interface, DOWN);
@@ -486,7 +583,7 @@ void net_handleRIPPacket(ip_packet_t* ip_packet)
         size_t reply_len;
         
         buildRIPResponsePacket(sender_vip, reply, &reply_len);
-        buildIPPacket(&ip_packet_to_send, dst_vip, src_vip, RIP_PROTOCOL, reply, reply_len);
+        buildIPPacket(&ip_packet_to_send, dst_vip, src_vip, RIP_PROTOCOL, RIP_TOS, reply, reply_len);
         printSendIPPacketResult(sendIPPacket(&ip_packet_to_send, true), false);
  
     }
@@ -555,18 +652,49 @@ uint32_t net_getLocalAddrTowardDestination(uint32_t dest_addr)
 
 
 
+// MTU of the link packets to dest_addr leave on (IP header included), 0 if there is no route
+size_t net_getMTUTowardDestination(uint32_t dest_addr)
+{
+    uint32_t* nxt_hop_addr_ptr = NULL;
+    int* value_ptr = NULL;
+    
+    // Local VIPs never reach the link layer
+    // Protect shared variable s_all_local_vips
+    pthread_mutex_lock(&g_local_vips_mutex);
+    value_ptr = g_hash_table_lookup(s_all_local_vips, &dest_addr);
+    pthread_mutex_unlock(&g_local_vips_mutex);
+    
+    if (value_ptr != NULL) {
+        return IP_MAX_PACKET_SIZE;
+    }
+    
+    // Protect shared variable s_routing_table
+    pthread_mutex_lock(&g_routing_table_mutex);
+    nxt_hop_addr_ptr = g_hash_table_lookup(s_routing_table, &dest_addr);
+    if (nxt_hop_addr_ptr == NULL) {
+        pthread_mutex_unlock(&g_routing_table_mutex);
+        return 0;
+    }
+    uint32_t nxt_hop_addr = *nxt_hop_addr_ptr;
+    pthread_mutex_unlock(&g_routing_table_mutex);
+    
+    return link_getMTU(nxt_hop_addr);
+}
+
+
 //=================================================================================================
 //      PRIVATE FUNCTIONS
 //=================================================================================================
 
 void buildIPPacket(ip_packet_t* ip_packet, int to_vip_address, int from_vip_address,
-                   ip_protocol_t protocol, char* data, size_t data_len)
+                   ip_protocol_t protocol, uint8_t tos, char* data, size_t data_len)
 {
-    memset((char*)ip_packet, 0, sizeof((*ip_packet)));
+    // Only the header needs clearing, ip_len bounds what is read of ip_data
+    memset((char*)&(ip_packet->ip_header), 0, IP_HEADER_BYTES);
 
     ip_packet->ip_header.ip_v = IPv4;
     ip_packet->ip_header.ip_hl = IP_HEADER_WORDS;
-    //ip_packet->ip_header.ip_tos = 0;
+    ip_packet->ip_header.ip_tos = tos;
     ip_packet->ip_header.ip_len = htons(IP_HEADER_BYTES+data_len);
     //ip_packet->ip_header.ip_id = 0;
     ip_packet->ip_header.ip_off = IP_DF; // defined in utility.h
@@ -616,10 +744,10 @@ int sendIPPacket(ip_packet_t* ip_packet, bool routing_msg)
         
         if (((*dist_value_ptr) != INFINITY_DISTANCE) || routing_msg) {
          
-            // Protect shared function sendPacket()
-            pthread_mutex_lock(&g_send_packet_mutex);        
-            link_sendPacket((char*)ip_packet, ntohs(ip_packet->ip_header.ip_len), (*to_vip_addr_ptr));
-            pthread_mutex_unlock(&g_send_packet_mutex);
+            // The interface's transmit thread sends it
+            if (egq_enqueue(g_hash_table_lookup(s_egress_queues, to_vip_addr_ptr), ip_packet) == -ENOBUFS) {
+                return LOCAL_DROP;
+            }
             
             return SENT_IP_PACKET;
             
@@ -633,6 +761,62 @@ int sendIPPacket(ip_packet_t* ip_packet, bool routing_msg)
 }
 
 
+// Same checks as sendIPPacket(), done once for all pieces of a super-segment. Returns
+// SENT_IP_PACKET and sets nxt_vip_addr if the destination can be reached.
+int getNextHopForSend(uint32_t to_vip_addr, uint32_t* nxt_vip_addr)
+{
+    int* dist_value_ptr = NULL;
+    int* link_value_ptr = NULL;
+    
+    // Protect shared variable s_routing_table
+    pthread_mutex_lock(&g_routing_table_mutex);
+    uint32_t* nxt_vip_addr_ptr = (uint32_t*)(g_hash_table_lookup(s_routing_table, &to_vip_addr));
+    if (nxt_vip_addr_ptr != NULL) {
+        *nxt_vip_addr = *nxt_vip_addr_ptr;
+        dist_value_ptr = (int*)(g_hash_table_lookup(s_routing_distances, &to_vip_addr));
+    }
+    pthread_mutex_unlock(&g_routing_table_mutex);
+    
+    // Check if destination is not in routing table
+    if (nxt_vip_addr_ptr == NULL) {
+        return UNKNOWN_DESTINATION;
+    }
+    
+    // Protect shared variable s_interfaces_operable
+    pthread_mutex_lock(&g_interfaces_operable_mutex);
+    link_value_ptr = (int*)(g_hash_table_lookup(s_interfaces_operable, nxt_vip_addr));
+    pthread_mutex_unlock(&g_interfaces_operable_mutex);
+    
+    // Check if link to node at vip_address is up
+    if ((*link_value_ptr) != TRUE) {
+        return LINK_DOWN;
+    }
+    
+    if ((*dist_value_ptr) == INFINITY_DISTANCE) {
+        return INFINITY_DISTANCE;
+    }
+    
+    return SENT_IP_PACKET;
+}
+
+
+// Fill ip_data with piece number index of the super-segment and complete the header
+// template (ip_len, ip_sum). Returns false once there are no more pieces.
+bool buildGSOPiece(ip_packet_t* ip_packet, void* super_segment, gso_segment_t segment, int index)
+{
+    size_t data_len = segment(super_segment, index, ip_packet->ip_data);
+    if (data_len == 0) {
+        return false;
+    }
+    
+    ip_packet->ip_header.ip_len = htons(IP_HEADER_BYTES+data_len);
+    ip_packet->ip_header.ip_sum = 0;
+    ip_packet->ip_header.ip_sum = (uint16_t)ip_sum((char*)&(ip_packet->ip_header), IP_HEADER_BYTES);
+    
+    return true;
+}
+
+
 int receiveIPPacket(ip_packet_t* ip_packet, int interface, uint32_t vip_address)
 {
     size_t in_data_len = 0;
@@ -728,7 +912,7 @@ void sendRouteInfoRequest(gpointer key, gpointer neighbor_vip)
     
     from_vip_ptr = g_hash_table_lookup(g_my_vip_from_sender, neighbor_vip);
     
-    buildIPPacket(&ip_packet, (*((uint32_t*)(neighbor_vip))), (*from_vip_ptr), RIP_PROTOCOL, data, RIP_REQUEST_SIZE);
+    buildIPPacket(&ip_packet, (*((uint32_t*)(neighbor_vip))), (*from_vip_ptr), RIP_PROTOCOL, RIP_TOS, data, RIP_REQUEST_SIZE);
     sendIPPacket(&ip_packet, true);
 }
 
@@ -753,7 +937,7 @@ void updateInterfaces(gpointer key, gpointer neighbor_vip)
 
         uint32_t* src_vip_ptr = g_hash_table_lookup(g_my_vip_from_sender, dst_vip_ptr);
 
-        buildIPPacket(&ip_packet, *dst_vip_ptr, *src_vip_ptr, RIP_PROTOCOL, reply, reply_len);
+        buildIPPacket(&ip_packet, *dst_vip_ptr, *src_vip_ptr, RIP_PROTOCOL, RIP_TOS, reply, reply_len);
         sendIPPacket(&ip_packet, true);
     }
 }
@@ -965,6 +1149,8 @@ void printSendIPPacketResult(int result, bool debug)
         NET_PRINT("\nPacket dropped because destination is unknown.\n");
     } else if (result == INFINITY_DISTANCE) {
         NET_PRINT("\nPacket dropped because route to destination is unknown.\n");
+    } else if (result == LOCAL_DROP) {
+        NET_PRINT("\nPacket queued, but the interface queue was full and dropped one of its flow.\n");
     } else if ((result == SENT_IP_PACKET) && (debug == true)) {
         NET_PRINT("\nPacket sent successfully.\n");
     }
@@ -33,9 +33,14 @@
 
 #define LINK_DOWN               -1
 #define UNKNOWN_DESTINATION     -11
+#define LOCAL_DROP              -12     // the interface queue was full and dropped a packet of this flow
 #define RECEIVED_IP_PACKET      0x11
 #define SENT_IP_PACKET          0x16
 
+// Software GSO: writes piece number index of a super-segment (transport header and payload)
+// into buf and returns its length, 0 once there are no more pieces
+typedef size_t (*gso_segment_t)(void* super_segment, int index, char* buf);
+
 
 //=================================================================================================
 //      PUBLIC FUNCTIONS
@@ -45,7 +50,11 @@ void printIPPacket(ip_packet_t* ip_packet);
 
 void* net_routingThreadFunction(void* arg);
 
-bool net_sendMessage(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t protocol, char* data, size_t data_len);
+int net_sendMessage(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t protocol, uint8_t tos,
+                    char* data, size_t data_len);
+
+int net_sendMessageGSO(uint32_t from_vip_addr, uint32_t to_vip_addr, uint8_t protocol, uint8_t tos,
+                       void* super_segment, gso_segment_t segment);
 
 void net_setupTables(char* link_file);
 
@@ -57,6 +66,8 @@ void net_printNetworkInterfaces(void);
 
 void net_printNetworkRoutes(void);
 
+void net_printEgressQueues(void);
+
 void net_downInterface(int interface);
 
 void net_upInterface(int interface);
@@ -67,6 +78,8 @@ void net_handleRIPPacket(ip_packet_t* ip_packet);
 
 uint32_t net_getLocalAddrTowardDestination(uint32_t dest_addr);
 
+size_t net_getMTUTowardDestination(uint32_t dest_addr);
+
 
 //=================================================================================================
 //      END OF FILE
@@ -9,6 +9,7 @@
 
 #include "net_layer.h"
 #include "tcp_layer.h"
+#include "mem_accounting.h"
 
 
 #include <glib.h>
@@ -37,6 +38,8 @@
 #define SHUTDOWN_WRITE	1
 #define SHUTDOWN_BOTH	3
 
+#define INPUT_BURST_MAX 16  // most packets read from one interface per select() pass
+
 
 //=================================================================================================
 //      GLOBAL VARIABLES
@@ -54,6 +57,25 @@ struct sendrecvfile_arg {
     int fd;
 };
 
+// Names accepted by the sockopt command
+struct {
+    const char *name;
+    TCP_Option_t option;
+} sockopt_table[] = {
+  {"rcvbuf", TCPO_RCVBUF},
+  {"rcvbuf-max", TCPO_RCVBUF_MAX},
+  {"nodelay", TCPO_NODELAY},
+  {"maxseg", TCPO_MAXSEG},
+  {"rcvlowat", TCPO_RCVLOWAT},
+  {"congestion", TCPO_CONGESTION},
+  {"pacing-rate", TCPO_PACING_RATE},
+  {"max-rate", TCPO_MAX_RATE},
+  {"ecn", TCPO_ECN},
+  {"dscp", TCPO_DSCP},
+  {"nonblock", TCPO_NONBLOCK},
+  {"error", TCPO_ERROR}
+};
+
 
 //=================================================================================================
 //      PRIVATE FUNCTIONS
@@ -126,11 +148,13 @@ void help_cmd(const char *line)
     printf("- help: Print this list of commands.\n"
            "- interfaces: Print information about each interface, one per line.\n"
            "- routes: Print information about the route to each known destination, one per line.\n"
+           "- queues: Print the egress queue of each interface (backlog, CoDel drops and CE marks).\n"
            "- sockets: List all sockets, along with the state the TCP connection associated with them is in, and their current window sizes.\n"
            "- down [integer]: Bring an interface \"down\".\n"
            "- up [integer]: Bring an interface \"up\" (it must be an existing interface, probably one you brought down)\n"
            "- accept [port]: Spawn a socket, bind it to the given port, and start accepting connections on that port.\n"
-           "- connect [ip] [port]: Attempt to connect to the given ip address, in dot notation, on the given port.  send [socket] [data]: Send a string on a socket.\n"
+           "- connect [ip] [port] [y/n]: Attempt to connect to the given ip address, in dot notation, on the given port. If the last argument is y, return at once and let the handshake finish in the background (see poll). Default is n.  send [socket] [data]: Send a string on a socket.\n"
+           "- poll [socket] [timeout ms]: Wait up to the timeout (default 0, -1 = forever) until the socket is readable, writable or its connect failed.\n"
            "- recv [socket] [numbytes] [y/n]: Try to read data from a given socket. If the last argument is y, then you should block until numbytes is received, or the connection closes. If n, then don.t block; return whatever recv returns. Default is n.\n"
            "- sendfile [filename] [ip] [port]: Connect to the given ip and port, send the entirety of the specified file, and close the connection.\n"
            "- recvfile [filename] [port]: Listen for a connection on the given port. Once established, write everything you can read from the socket to the given file. Once the other side closes the connection, close the connection as well.\n"
@@ -138,6 +162,9 @@ void help_cmd(const char *line)
            "- close [socket]: v_close on the given socket.\n"
            "- window [socket]: display the send/recv windows.\n"
            "- rwin [socket]: display the contents of the recv window.\n"
+           "- sockopt [socket] [option] [value]: display a socket option, or set it if a value is given (options: rcvbuf, rcvbuf-max, nodelay, maxseg, rcvlowat, congestion [0 = reno, 1 = bbr], pacing-rate [bytes/s, 0 = congestion control], max-rate [bytes/s, 0 = unlimited], ecn [0/1, before connect/accept], dscp [0..63, e.g. 46 = EF for interactive traffic], nonblock [0/1, v_connect() returns at once], error [why the last connect failed, read only]).\n"
+           "- ratelimit [socket] [bytes/s]: display the transmit rate cap of a socket (of all capped sockets if none is given), or set it if a rate is given (0 = unlimited).\n"
+           "- mem [low] [pressure] [high]: display node-wide socket buffer memory, or set its limits in bytes.\n"
            "- quit: exit the program.\n");
 
     return;
@@ -155,6 +182,17 @@ void interfaces_cmd(const char *line)
 }
 
 
+void queues_cmd(const char *line)
+{
+    (void)line;
+
+    // Print egress queues
+    net_printEgressQueues();
+
+    return;
+}
+
+
 void routes_cmd(const char *line)
 {
     (void)line;
@@ -299,14 +337,15 @@ void connect_cmd(const char *line)
     char ip_string[LINE_MAX];
     struct in_addr ip_addr;
     uint16_t port;
+    char nonblock = 'n';
     int ret;
     int s;
   
-    ret = sscanf(line, "connect %s %" SCNu16, ip_string, &port);
-    if (ret != 2) {
-        ret = sscanf(line, "c %s %" SCNu16, ip_string, &port);
-        if (ret != 2) {
-            fprintf(stderr, "syntax error (usage: connect [ip address] [port])\n");
+    ret = sscanf(line, "connect %s %" SCNu16 " %c", ip_string, &port, &nonblock);
+    if (ret < 2) {
+        ret = sscanf(line, "c %s %" SCNu16 " %c", ip_string, &port, &nonblock);
+        if (ret < 2) {
+            fprintf(stderr, "syntax error (usage: connect [ip address] [port] [y/n])\n");
             return;
         }
     }
@@ -325,7 +364,15 @@ void connect_cmd(const char *line)
         return;
     }
     
+    if (nonblock == 'y') {
+        v_setsockopt(s, TCPO_NONBLOCK, 1);
+    }
+    
     ret = v_connect(s, &ip_addr, port);
+    if (ret == -EINPROGRESS) {
+        printf("v_connect() in progress on socket %d\n", s);
+        return;
+    }
     if (ret < 0) {
         fprintf(stderr, "v_connect() error: %s\n", strerror(-ret));
         return;
@@ -336,6 +383,35 @@ void connect_cmd(const char *line)
 }
 
 
+void poll_cmd(const char *line)
+{
+    struct v_pollfd pollfd;
+    int timeout_ms = 0;
+    int ret;
+
+    ret = sscanf(line, "poll %d %d", &pollfd.vsocket, &timeout_ms);
+    if (ret < 1) {
+        fprintf(stderr, "syntax error (usage: poll [socket] [timeout ms])\n");
+        return;
+    }
+    
+    pollfd.events = V_POLLIN | V_POLLOUT;
+    ret = v_poll(&pollfd, 1, timeout_ms);
+    if (ret == 0) {
+        printf("socket %d: not ready\n", pollfd.vsocket);
+        return;
+    }
+    
+    printf("socket %d:%s%s%s%s\n", pollfd.vsocket,
+           (pollfd.revents & V_POLLIN) ? " readable" : "",
+           (pollfd.revents & V_POLLOUT) ? " writable" : "",
+           (pollfd.revents & V_POLLERR) ? " error" : "",
+           (pollfd.revents & V_POLLNVAL) ? " not a socket" : "");
+
+    return;
+}
+
+
 void send_cmd(const char *line)
 {
     int num_consumed;
@@ -783,6 +859,98 @@ void rwin_rr_cmd(const char *line)
     return;
 }
 
+void sockopt_cmd(const char *line)
+{
+    char name[LINE_MAX];
+    int socket;
+    int value;
+    int ret;
+    unsigned i;
+
+    ret = sscanf(line, "sockopt %d %s %d", &socket, name, &value);
+    if (ret < 2) {
+        fprintf(stderr, "syntax error (usage: sockopt [socket] [option] [value])\n");
+        return;
+    }
+    
+    for (i = 0; i < sizeof(sockopt_table) / sizeof(sockopt_table[0]); i++) {
+        if (!strcmp(name, sockopt_table[i].name)) {
+            break;
+        }
+    }
+    if (i == sizeof(sockopt_table) / sizeof(sockopt_table[0])) {
+        fprintf(stderr, "unknown socket option '%s'\n", name);
+        return;
+    }
+    
+    if (ret == 3) {
+        ret = v_setsockopt(socket, sockopt_table[i].option, value);
+        if (ret < 0) {
+            fprintf(stderr, "v_setsockopt() error: %s\n", strerror(-ret));
+        }
+        return;
+    }
+    
+    ret = v_getsockopt(socket, sockopt_table[i].option, &value);
+    if (ret < 0) {
+        fprintf(stderr, "v_getsockopt() error: %s\n", strerror(-ret));
+        return;
+    }
+
+    printf("%s: %d\n", name, value);
+    return;
+}
+
+
+void ratelimit_cmd(const char *line)
+{
+    int socket;
+    int rate;
+    int ret;
+
+    ret = sscanf(line, "ratelimit %d %d", &socket, &rate);
+    if (ret <= 0) {
+        tcp_printRateLimits(-1);
+        return;
+    }
+    
+    if (ret == 1) {
+        tcp_printRateLimits(socket);
+        return;
+    }
+    
+    ret = v_setsockopt(socket, TCPO_MAX_RATE, rate);
+    if (ret < 0) {
+        fprintf(stderr, "v_setsockopt() error: %s\n", strerror(-ret));
+    }
+
+    return;
+}
+
+
+void mem_cmd(const char *line)
+{
+    size_t low, pressure, high;
+    int ret;
+
+    ret = sscanf(line, "mem %zu %zu %zu", &low, &pressure, &high);
+    if (ret <= 0) {
+        mem_printUsage();
+        return;
+    }
+    
+    if (ret != 3) {
+        fprintf(stderr, "syntax error (usage: mem [low] [pressure] [high])\n");
+        return;
+    }
+    
+    if (!mem_setLimits(low, pressure, high)) {
+        fprintf(stderr, "mem limits must satisfy low <= pressure <= high\n");
+        return;
+    }
+
+    return;
+}
 
 
 void quit_cmd(const char *line)
@@ -804,6 +972,8 @@ struct {
   {"li", interfaces_cmd},
   {"routes", routes_cmd},
   {"lr", routes_cmd},
+  {"queues", queues_cmd},
+  {"lq", queues_cmd},
   {"sockets", sockets_cmd},
   {"ls", sockets_cmd},
   {"down", down_cmd},
@@ -812,6 +982,7 @@ struct {
   {"a", accept_cmd},
   {"connect", connect_cmd},
   {"c", connect_cmd},
+  {"poll", poll_cmd},
   {"send", send_cmd},
   {"s", send_cmd},
   {"w", send_cmd},
@@ -824,6 +995,9 @@ struct {
   {"close", close_cmd},
   {"rwin", rwin_cmd},
   {"rwin-rr", rwin_rr_cmd},
+  {"sockopt", sockopt_cmd},
+  {"ratelimit", ratelimit_cmd},
+  {"mem", mem_cmd},
   {"quit", quit_cmd},
   {"q", quit_cmd}
 };
@@ -893,10 +1067,20 @@ void* handleInputThreadFunction(void* arg)
         for (interface = 0; interface < g_highest_input_interface+1; interface++) {
         
             if (FD_ISSET(interface, &input_interfaces_copy)) {
-                net_handlePacketInput(interface);
+            
+                // Read the whole burst queued on the interface, so that consecutive segments can be coalesced
+                int burst = 0;
+                do {
+                    net_handlePacketInput(interface);
+                    burst++;
+                } while (burst < INPUT_BURST_MAX && link_hasPendingInput(interface));
+                
             } // end if FD_ISSET()
         
         } // end for
+        
+        // End of the receive burst, deliver whatever was coalesced
+        util_callFlushHandlers();
     
     } // end while
     
@@ -940,6 +1124,7 @@ int main(int argc, char** argv)
     util_netRegisterHandler(TEST_PROTOCOL, net_handleTestPacket);
     util_netRegisterHandler(RIP_PROTOCOL, net_handleRIPPacket);
     util_netRegisterHandler(TCP_PROTOCOL, tcp_handleTCPPacket);
+    util_netRegisterFlushHandler(tcp_flushCoalescedPackets);
     
     net_setupTables(argv[1]);
     
@@ -0,0 +1,446 @@
+//=================================================================================================
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "rack.h"
+#include "congestion.h"
+
+
+//=================================================================================================
+//      PRIVATE FUNCTIONS
+//=================================================================================================
+
+// True if the segment ending at seq1 sent at time1 was sent after the one ending at seq2 sent at time2
+bool sentAfter(uint64_t time1, tcp_seq seq1, uint64_t time2, tcp_seq seq2)
+{
+    return (time1 > time2) || (time1 == time2 && (int32_t)(seq1 - seq2) > 0);
+}
+
+
+// RACK (RFC 8985 6.2 step 2): remember the most recently sent segment known to be delivered.
+// A retransmitted segment ACKed within min RTT of its retransmission was most likely
+// delivered by the original transmission, it says nothing about the send order.
+// WARNING: g_vsocket_table_mutex must already be acquired
+void updateRACK(struct vsocket_infoset* socket_info, struct tx_record* record, uint64_t now)
+{
+    uint64_t rtt = now - record->xmit_time_us;
+
+    if (record->retrans > 0 && rtt < socket_info->rack_min_rtt_us) {
+        return;
+    }
+    if (record->retrans == 0 && (socket_info->rack_min_rtt_us == 0 || rtt < socket_info->rack_min_rtt_us)) {
+        socket_info->rack_min_rtt_us = util_max(rtt, 1);
+    }
+
+    if (sentAfter(record->xmit_time_us, record->seq + record->len,
+                  socket_info->rack_xmit_time_us, socket_info->rack_end_seq)) {
+        socket_info->rack_rtt_us = rtt;
+        socket_info->rack_xmit_time_us = record->xmit_time_us;
+        socket_info->rack_end_seq = record->seq + record->len;
+    }
+}
+
+
+// Reordering window: a quarter of the min RTT, none once RACK_DUPTHRESH segments past
+// the hole were delivered (that much reordering is taken as loss, like three duplicate ACKs)
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint64_t getReorderWindow(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->rack_delivered >= RACK_DUPTHRESH) {
+        return 0;
+    }
+
+    uint64_t reo_wnd = socket_info->rack_min_rtt_us/4;
+    if (!socket_info->first_measure && reo_wnd > (uint64_t)socket_info->srtt_us) {
+        reo_wnd = (uint64_t)socket_info->srtt_us;
+    }
+    return reo_wnd;
+}
+
+
+// WARNING: g_vsocket_table_mutex must already be acquired
+void clearDelivered(struct vsocket_infoset* socket_info, struct tx_record* record)
+{
+    if (record->delivered) {
+        record->delivered = false;
+        socket_info->rack_delivered--;
+        socket_info->rack_delivered_bytes -= record->len;
+    }
+}
+
+
+// WARNING: g_vsocket_table_mutex must already be acquired
+void clearLost(struct vsocket_infoset* socket_info, struct tx_record* record)
+{
+    if (record->lost) {
+        record->lost = false;
+        socket_info->rack_lost--;
+        socket_info->rack_lost_bytes -= record->len;
+    }
+}
+
+
+// record, marked lost or retransmitted during the loss episode, was cumulatively ACKed. Without
+// timestamps or DSACK, the ACK is known to come from the original transmission (Eifel,
+// RFC 3522) if the segment was never sent again, or if it arrived sooner after the
+// retransmission than any RTT seen. Any retransmission ACKed later was needed, so the
+// episode can't be undone any more.
+// WARNING: g_vsocket_table_mutex must already be acquired
+bool isSpuriousLoss(struct vsocket_infoset* socket_info, struct tx_record* record, uint64_t now)
+{
+    if (record->retrans == 0) {
+        return true;
+    }
+    if (socket_info->rack_min_rtt_us != 0 && now - record->xmit_time_us < socket_info->rack_min_rtt_us) {
+        socket_info->undo_retrans -= util_min(record->retrans, socket_info->undo_retrans);
+        return true;
+    }
+
+    socket_info->undo_armed = false;
+    return false;
+}
+
+
+// Every retransmission of the loss episode was spurious: the remaining loss marks are as
+// wrong as the ones proven, and the congestion control goes back to where it was
+// WARNING: g_vsocket_table_mutex must already be acquired
+void undoLoss(struct vsocket_infoset* socket_info)
+{
+    GList* node;
+    for (node = socket_info->tx_records->head; node != NULL; node = node->next) {
+        clearLost(socket_info, node->data);
+    }
+
+    socket_info->rto_backoff = 0;
+    socket_info->spurious_undos++;
+    cc_undo(socket_info);
+}
+
+
+// Lost segments leave the pipe, the first loss of a window starts loss recovery
+// WARNING: g_vsocket_table_mutex must already be acquired
+void markLost(struct vsocket_infoset* socket_info, struct tx_record* record)
+{
+    clearDelivered(socket_info, record);
+    if (!record->lost) {
+        record->lost = true;
+        socket_info->rack_lost++;
+        socket_info->rack_lost_bytes += record->len;
+        cc_onLoss(socket_info);
+    }
+}
+
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+// New data (or the FIN) went out. Starts the retransmission timer if nothing was in flight
+// (RFC 6298 5.1) and re-arms the tail loss probe.
+void rack_onTransmit(struct vsocket_infoset* socket_info, tcp_seq seq, uint32_t len, uint64_t now)
+{
+    if (socket_info->tx_records == NULL) {
+        socket_info->tx_records = g_queue_new();
+    }
+    bool was_idle = g_queue_is_empty(socket_info->tx_records);
+    if (was_idle) {
+        socket_info->start_time = now;
+    }
+
+    struct tx_record* record = g_malloc0(sizeof(struct tx_record));
+    record->seq = seq;
+    record->len = len;
+    record->xmit_time_us = now;
+    cc_onTransmit(socket_info, record, was_idle, now);
+    g_queue_push_tail(socket_info->tx_records, record);
+
+    rack_armProbe(socket_info, now);
+}
+
+
+// The record is being sent again (loss repair, tail loss probe or RTO)
+void rack_onRetransmit(struct vsocket_infoset* socket_info, struct tx_record* record, uint64_t now)
+{
+    bool was_idle = (cc_getPipe(socket_info) == 0);
+    
+    clearLost(socket_info, record);
+    record->xmit_time_us = now;
+    cc_onTransmit(socket_info, record, was_idle, now);
+    record->retrans++;
+    socket_info->retrans_segments++;
+    if (socket_info->undo_armed) {
+        socket_info->undo_retrans++;
+    }
+
+    socket_info->exp_acknum = 0; // Karn's algorithm: no RTT sample across a retransmission
+}
+
+
+// Cumulative ACK of new data: drop the records it covers, feed them to RACK and look for
+// segments sent before them that are still missing. The newly delivered data drives the
+// congestion control. An ACK proving that the last of the loss episode's retransmissions
+// was spurious undoes the reduction.
+void rack_onAck(struct vsocket_infoset* socket_info, tcp_seq acknum, uint64_t now)
+{
+    GQueue* records = socket_info->tx_records;
+    struct rate_sample rs;
+    bool spurious = false;
+
+    cc_initRateSample(&rs);
+    socket_info->rto_backoff = 0;
+    if (socket_info->tlp_outstanding && (int32_t)(acknum - socket_info->tlp_end_seq) >= 0) {
+        socket_info->tlp_outstanding = false;
+    }
+
+    while (records != NULL && !g_queue_is_empty(records)) {
+        struct tx_record* record = g_queue_peek_head(records);
+
+        if ((int32_t)(acknum - (record->seq + record->len)) < 0) {
+            // Partly ACKed (a retransmission that straddled segments), keep the rest
+            if ((int32_t)(acknum - record->seq) > 0) {
+                uint32_t acked = acknum - record->seq;
+                clearDelivered(socket_info, record);
+                cc_onDelivered(socket_info, &rs, record, acked, now);
+                if (record->lost) {
+                    socket_info->rack_lost_bytes -= acked;
+                }
+                record->len -= acked;
+                record->seq = acknum;
+            }
+            break;
+        }
+
+        g_queue_pop_head(records);
+        if (record->delivered) {
+            clearDelivered(socket_info, record); // counted when the duplicate ACK came in
+        } else {
+            updateRACK(socket_info, record, now);
+            cc_onDelivered(socket_info, &rs, record, record->len, now);
+            if (socket_info->undo_armed && (record->lost || record->retrans > 0)) {
+                spurious |= isSpuriousLoss(socket_info, record, now);
+            }
+        }
+        clearLost(socket_info, record);
+        g_free(record);
+    }
+    
+    if (spurious && socket_info->undo_armed && socket_info->undo_retrans == 0) {
+        undoLoss(socket_info);
+    }
+
+    // The new head is the hole the ACK stopped at, whatever the duplicate ACKs suggested
+    struct tx_record* head = (records != NULL) ? g_queue_peek_head(records) : NULL;
+    if (head != NULL) {
+        clearDelivered(socket_info, head);
+    }
+
+    rack_detectLoss(socket_info, now);
+    cc_onAck(socket_info, &rs, now);
+    rack_armProbe(socket_info, now);
+}
+
+
+// Without SACK, a duplicate ACK only says that one more segment past the hole at send_unack
+// arrived. Like Linux's NewReno emulation, credit it to the oldest segment after the head
+// not credited yet.
+void rack_onDupAck(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    if (socket_info->tx_records == NULL || socket_info->persist_time_us != 0) {
+        return; // zero window probes are answered with duplicate ACKs
+    }
+
+    struct rate_sample rs;
+    cc_initRateSample(&rs);
+
+    GList* node = socket_info->tx_records->head;
+    for (node = (node != NULL) ? node->next : NULL; node != NULL; node = node->next) {
+        struct tx_record* record = node->data;
+
+        if (!record->delivered && !record->lost) {
+            record->delivered = true;
+            socket_info->rack_delivered++;
+            socket_info->rack_delivered_bytes += record->len;
+            updateRACK(socket_info, record, now);
+            cc_onDelivered(socket_info, &rs, record, record->len, now);
+            break;
+        }
+    }
+
+    socket_info->tlp_time_us = 0; // in loss recovery now
+    rack_detectLoss(socket_info, now);
+    cc_onAck(socket_info, &rs, now);
+}
+
+
+// Retransmission timer expired: back off, forget what the duplicate ACKs suggested and
+// take everything in flight as lost. The congestion window (one segment after an RTO)
+// then decides how fast it is sent again, starting from the head.
+void rack_onRTO(struct vsocket_infoset* socket_info)
+{
+    socket_info->rto_backoff = util_min(socket_info->rto_backoff + 1, RTO_MAX_BACKOFF);
+    socket_info->rto_timeouts++;
+    socket_info->tlp_time_us = 0;
+    socket_info->tlp_outstanding = false;
+    socket_info->rack_timer_us = 0;
+    cc_onRTO(socket_info);
+
+    if (socket_info->tx_records == NULL) {
+        return;
+    }
+
+    GList* node;
+    for (node = socket_info->tx_records->head; node != NULL; node = node->next) {
+        markLost(socket_info, node->data);
+    }
+}
+
+
+// RACK loss detection (RFC 8985 6.2 step 5): a segment sent before the most recently
+// delivered one is lost once it has been out for RACK's RTT plus the reordering window.
+// Arms the reordering timer for segments not overdue yet.
+void rack_detectLoss(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    socket_info->rack_timer_us = 0;
+
+    if (socket_info->tx_records == NULL || socket_info->rack_xmit_time_us == 0) {
+        return;
+    }
+
+    uint64_t reo_wnd = getReorderWindow(socket_info);
+    uint64_t timeout = 0;
+
+    GList* node;
+    for (node = socket_info->tx_records->head; node != NULL; node = node->next) {
+        struct tx_record* record = node->data;
+
+        if (record->delivered || record->lost ||
+            !sentAfter(socket_info->rack_xmit_time_us, socket_info->rack_end_seq,
+                       record->xmit_time_us, record->seq + record->len)) {
+            continue;
+        }
+
+        uint64_t deadline = record->xmit_time_us + socket_info->rack_rtt_us + reo_wnd;
+        if (now >= deadline) {
+            markLost(socket_info, record);
+        } else if (deadline > timeout) {
+            timeout = deadline;
+        }
+    }
+
+    socket_info->rack_timer_us = timeout;
+}
+
+
+// Oldest record waiting to be retransmitted, NULL if none
+struct tx_record* rack_getLostRecord(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->rack_lost == 0) {
+        return NULL;
+    }
+
+    GList* node;
+    for (node = socket_info->tx_records->head; node != NULL; node = node->next) {
+        struct tx_record* record = node->data;
+        if (record->lost) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+
+// Most recently sent new data, retransmitted by a tail loss probe when there is no new data to send
+struct tx_record* rack_getLastRecord(struct vsocket_infoset* socket_info)
+{
+    return (socket_info->tx_records != NULL) ? g_queue_peek_tail(socket_info->tx_records) : NULL;
+}
+
+
+// Schedule a tail loss probe (RFC 8985 7.2) while data is in flight and the connection is
+// not recovering from loss already: PTO = 2*SRTT, plus the peer's delayed ACK time if only
+// one segment is out. The probe fires only if it comes before the RTO.
+void rack_armProbe(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    socket_info->tlp_time_us = 0;
+
+    GQueue* records = socket_info->tx_records;
+    if (records == NULL || g_queue_is_empty(records) || socket_info->tlp_outstanding ||
+        socket_info->rack_lost > 0 || socket_info->rack_delivered > 0 ||
+        socket_info->rto_backoff > 0 || socket_info->persist_time_us != 0) {
+        return;
+    }
+
+    uint64_t pto = TLP_INITIAL_US;
+    if (!socket_info->first_measure) {
+        pto = (uint64_t)(2*socket_info->srtt_us);
+        if (g_queue_get_length(records) == 1) {
+            pto += DELACK_US;
+        }
+        if (pto < TLP_MIN_US) {
+            pto = TLP_MIN_US;
+        }
+    }
+
+    if (now + pto < rack_getRTOTime(socket_info)) {
+        socket_info->tlp_time_us = now + pto;
+    }
+}
+
+
+// Absolute expiry of the retransmission timer: the RTO (RTO_MIN_US..RTO_MAX_US) doubled once per backoff
+uint64_t rack_getRTOTime(struct vsocket_infoset* socket_info)
+{
+    uint64_t rto = (socket_info->rto_us > RTO_MIN_US) ? (uint64_t)socket_info->rto_us : RTO_MIN_US;
+
+    rto = rto << socket_info->rto_backoff;
+    if (rto > RTO_MAX_US) {
+        rto = RTO_MAX_US;
+    }
+    return socket_info->start_time + rto;
+}
+
+
+// send_next was moved back (persist probe byte not ACKed): it is no longer in flight
+void rack_dropUnsent(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->tx_records == NULL) {
+        return;
+    }
+
+    while (!g_queue_is_empty(socket_info->tx_records)) {
+        struct tx_record* record = g_queue_peek_tail(socket_info->tx_records);
+        if ((int32_t)(record->seq - socket_info->tcb.send_next) < 0) {
+            break;
+        }
+
+        g_queue_pop_tail(socket_info->tx_records);
+        clearDelivered(socket_info, record);
+        clearLost(socket_info, record);
+        g_free(record);
+    }
+}
+
+
+void rack_freeRecords(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->tx_records == NULL) {
+        return;
+    }
+
+    while (!g_queue_is_empty(socket_info->tx_records)) {
+        g_free(g_queue_pop_head(socket_info->tx_records));
+    }
+    g_queue_free(socket_info->tx_records);
+    socket_info->tx_records = NULL;
+    socket_info->rack_lost = 0;
+    socket_info->rack_lost_bytes = 0;
+    socket_info->rack_delivered = 0;
+    socket_info->rack_delivered_bytes = 0;
+}
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
@@ -0,0 +1,84 @@
+#ifndef _RACK_H_
+#define _RACK_H_
+
+//=================================================================================================
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "tcp_layer.h"
+
+
+//=================================================================================================
+//      DEFINITIONS AND MACROS
+//=================================================================================================
+
+// Retransmission timeout bounds (RFC 6298 2.4/2.5, Linux limits): the timeout doubles with
+// every expiry until new data is ACKed
+#define RTO_MIN_US          200000
+#define RTO_MAX_US          60000000
+#define RTO_MAX_BACKOFF     15
+
+// Tail loss probe timeout (RFC 8985 7.2): 2*SRTT, at least TLP_MIN_US, TLP_INITIAL_US before
+// the first RTT sample
+#define TLP_MIN_US          10000
+#define TLP_INITIAL_US      1000000
+
+// Segments past send_unack known delivered after which the reordering window closes (RFC 8985 6.2)
+#define RACK_DUPTHRESH      3
+
+
+// One per segment in flight, kept in sequence order in tx_records
+struct tx_record {
+    tcp_seq seq;
+    uint32_t len;
+    uint64_t xmit_time_us;  //last (re)transmission
+    uint32_t retrans;       //times retransmitted
+    bool delivered;         //beyond send_unack, delivered as evidenced by a duplicate ACK
+    bool lost;              //waiting to be retransmitted
+    
+    // delivery rate snapshot taken at the last (re)transmission (see congestion.c)
+    uint64_t delivered_bytes;
+    uint64_t delivered_time_us;
+    uint64_t first_sent_time_us;
+    bool app_limited;
+};
+
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+// Caller must hold g_vsocket_table_mutex for all of these.
+
+void rack_onTransmit(struct vsocket_infoset* socket_info, tcp_seq seq, uint32_t len, uint64_t now);
+
+void rack_onRetransmit(struct vsocket_infoset* socket_info, struct tx_record* record, uint64_t now);
+
+void rack_onAck(struct vsocket_infoset* socket_info, tcp_seq acknum, uint64_t now);
+
+void rack_onDupAck(struct vsocket_infoset* socket_info, uint64_t now);
+
+void rack_onRTO(struct vsocket_infoset* socket_info);
+
+void rack_detectLoss(struct vsocket_infoset* socket_info, uint64_t now);
+
+struct tx_record* rack_getLostRecord(struct vsocket_infoset* socket_info);
+
+struct tx_record* rack_getLastRecord(struct vsocket_infoset* socket_info);
+
+void rack_armProbe(struct vsocket_infoset* socket_info, uint64_t now);
+
+uint64_t rack_getRTOTime(struct vsocket_infoset* socket_info);
+
+void rack_dropUnsent(struct vsocket_infoset* socket_info);
+
+void rack_freeRecords(struct vsocket_infoset* socket_info);
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
+
+#endif //_RACK_H_
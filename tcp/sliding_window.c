@@ -9,6 +9,9 @@
 #include "tcp_util.h"
 #include "util/circular_buffer.h"
 #include "port_util.h"
+#include "mem_accounting.h"
+#include "rack.h"
+#include "congestion.h"
 
 #include <unistd.h>
 
@@ -16,32 +19,705 @@
 //      DEFINITIONS AND MACROS
 //=================================================================================================
 
-#define LOCK_AQUIRED 0
+#define PERSIST_MIN_US          200000      // persist timer bounds (the timer starts at the RTO
+#define PERSIST_MAX_US          60000000    // and doubles with every unanswered probe)
+#define PERSIST_MAX_BACKOFF     15
+
+#define SWS_OVERRIDE_US         200000      // longest a small segment is held back (RFC 1122: 0.1-1 sec)
+
+#define SEND_BURST_MAX          16          // most new segments built and handed to the network layer per pass
+#define SEND_BURST_BYTES        (SEND_BURST_MAX*TCP_MTU)
+
+#define RCVLOWAT_TIMEOUT_US     200000      // longest a reader waits for the low-watermark before taking what is there
+
+#define TIME_WAIT_US            60000000    // 2MSL
+
+#define MOVE_CHUNK              1024        // bounce buffer of moveBufferData(), connection threads have small stacks
 
 //=================================================================================================
 //      GLOBAL VARIABLES
 //=================================================================================================
 
-static pthread_mutex_t g_timeout_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 //=================================================================================================
 //      PRIVATE FUNCTIONS
 //=================================================================================================
 
+// Clear one pending_data entry, keeping ooo_segments in step
+void clearPendingData(struct vsocket_infoset* socket_info, size_t index)
+{
+    if (socket_info->pending_data[index] != 0) {
+        socket_info->pending_data[index] = 0;
+        socket_info->ooo_segments--;
+    }
+}
+
+
+// Absolute CLOCK_REALTIME time wait_us from now, for pthread_cond_timedwait()
+void setCondDeadline(struct timespec* deadline, uint64_t wait_us)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    uint64_t nsec = deadline->tv_nsec + wait_us*1000;
+    deadline->tv_sec += nsec/1000000000;
+    deadline->tv_nsec = nsec%1000000000;
+}
+
+
+// New data is in in_data: wake a sleeping reader only once its low-watermark is reached,
+// or right away for PSH (and FIN, see signalRecvEOF()); v_poll() callers always
+// WARNING: g_vsocket_table_mutex must already be acquired
+void wakeRecvWaiters(struct vsocket_infoset* socket_info, bool push)
+{
+    if (push) {
+        socket_info->recv_push = true;
+    }
+    
+    if (socket_info->recv_wait_bytes != 0 &&
+        (push || circular_buffer_get_size(socket_info->in_data) >= socket_info->recv_wait_bytes)) {
+        pthread_cond_broadcast(&(socket_info->recv_cond));
+    }
+    tcp_wakePollers(socket_info);
+}
+
+
+// Sleep until in_data holds wanted bytes, a PSH or FIN arrived, or RCVLOWAT_TIMEOUT_US passed
+// WARNING: g_vsocket_table_mutex must already be acquired (released while waiting)
+void waitForRecvData(struct vsocket_infoset* socket_info, uint32_t wanted)
+{
+    struct timespec deadline;
+    setCondDeadline(&deadline, RCVLOWAT_TIMEOUT_US);
+    
+    while (!socket_info->quit && !socket_info->recv_eof && !socket_info->recv_push &&
+           circular_buffer_get_size(socket_info->in_data) < wanted) {
+        
+        socket_info->recv_wait_bytes = wanted;
+        if (pthread_cond_timedwait(&(socket_info->recv_cond), &g_vsocket_table_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    socket_info->recv_wait_bytes = 0;
+}
+
+
+void signalRecvEOF(struct vsocket_infoset* socket_info)
+{
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    socket_info->recv_eof = true;
+    pthread_cond_broadcast(&(socket_info->recv_cond));
+    tcp_wakePollers(socket_info);
+    sw_allocRecvBuffers(socket_info);
+    circular_buffer_t* in_data = socket_info->in_data;
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    circular_buffer_signal_eof(in_data);
+}
+
+
+// Called by the send thread, release swin_buffer once everything is ACKed and the writer is idle
+void releaseIdleSendBuffer(struct vsocket_infoset* socket_info)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    if (socket_info->swin_buffer != NULL &&
+        socket_info->tcb.send_next == socket_info->tcb.send_unack &&
+        circular_buffer_is_empty(socket_info->swin_buffer) &&
+        util_getTimeUs() - socket_info->send_activity_us > BUFFER_IDLE_US) {
+        
+        sw_freeSendBuffer(socket_info);
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
+
+// Called by the handle thread (the only writer of rwin_buffer and in_data) when no packet arrived for a while
+void releaseIdleRecvBuffers(struct vsocket_infoset* socket_info)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    // A blocked reader still holds in_data
+    if (util_getTimeUs() - socket_info->recv_activity_us > BUFFER_IDLE_US &&
+        socket_info->in_data != NULL && socket_info->active_readers == 0 &&
+        circular_buffer_is_empty(socket_info->in_data)) {
+        
+        mem_uncharge(MEM_RECV, circular_buffer_get_capacity(socket_info->in_data));
+        circular_buffer_free(&(socket_info->in_data));
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
+
+// rwin_buffer only exists while out-of-order data is held. Called by the handle thread.
+bool allocOOOBuffer(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->rwin_buffer != NULL) {
+        return true;
+    }
+    
+    if (!mem_charge(MEM_OOO, DEFAULT_WSIZE*(1+sizeof(uint16_t)))) {
+        return false;
+    }
+    
+    // A fresh buffer starts writing at index 0, which maps to recv_next
+    circular_buffer_init(&(socket_info->rwin_buffer), DEFAULT_WSIZE);
+    socket_info->pending_data = (uint16_t*)calloc(DEFAULT_WSIZE, sizeof(uint16_t));
+    socket_info->ooo_segments = 0;
+    
+    return true;
+}
+
+
+// Drops any out-of-order data still held, the sender will retransmit it
+// WARNING: g_vsocket_table_mutex must already be acquired
+void freeOOOBuffer(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->rwin_buffer == NULL) {
+        return;
+    }
+    
+    circular_buffer_free(&(socket_info->rwin_buffer));
+    free(socket_info->pending_data);
+    socket_info->pending_data = NULL;
+    socket_info->ooo_segments = 0;
+    
+    mem_uncharge(MEM_OOO, DEFAULT_WSIZE*(1+sizeof(uint16_t)));
+}
+
+
+// Called by the handle thread, give back out-of-order space while the node is under memory pressure
+void pruneOOOBuffer(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->rwin_buffer == NULL || !mem_underPressure()) {
+        return;
+    }
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    freeOOOBuffer(socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
+
+// Room left in in_data, the most the peer may send beyond recv_next
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint32_t getFreeRecvSpace(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->in_data == NULL) {
+        return socket_info->tcb.rws;
+    }
+    
+    return socket_info->tcb.rws - circular_buffer_get_size(socket_info->in_data);
+}
+
+
+// Receiver side silly window syndrome avoidance (RFC 1122 4.2.3.3): the right edge of the
+// window (recv_next + ruws) only moves once it can move by min(rws/2, one segment of the negotiated MSS).
+// WARNING: g_vsocket_table_mutex must already be acquired
+void updateRecvWindow(struct vsocket_infoset* socket_info)
+{
+    uint32_t free_space = getFreeRecvSpace(socket_info);
+    uint32_t threshold = util_min(socket_info->tcb.rws/2, socket_info->tcb.mss);
+    
+    if (free_space >= socket_info->tcb.ruws + threshold || free_space < socket_info->tcb.ruws) {
+        socket_info->tcb.ruws = free_space;
+    }
+}
+
+
+// Receiver-side RTT estimate for auto-tuning: time for recv_next to advance by one window
+// (an upper bound of the RTT when the sender is application limited)
+// WARNING: g_vsocket_table_mutex must already be acquired
+void measureRecvRTT(struct vsocket_infoset* socket_info)
+{
+    uint64_t now = util_getTimeUs();
+    
+    if (socket_info->rcv_rtt_time_us != 0 && (int32_t)(socket_info->tcb.recv_next - socket_info->rcv_rtt_seq) >= 0) {
+        double sample = (double)(now - socket_info->rcv_rtt_time_us);
+        
+        if (socket_info->rcv_rtt_us == 0 || sample < socket_info->rcv_rtt_us) {
+            socket_info->rcv_rtt_us = sample;
+        } else {
+            socket_info->rcv_rtt_us = (0.875*socket_info->rcv_rtt_us) + (0.125*sample);
+        }
+        socket_info->rcv_rtt_time_us = 0;
+    }
+    
+    if (socket_info->rcv_rtt_time_us == 0) {
+        socket_info->rcv_rtt_seq = socket_info->tcb.recv_next + socket_info->tcb.rws;
+        socket_info->rcv_rtt_time_us = now;
+    }
+}
+
+
+// Once per receiver RTT, ask for a window twice what the application read in that RTT
+// WARNING: g_vsocket_table_mutex must already be acquired
+void adjustRecvSpace(struct vsocket_infoset* socket_info, uint32_t copied)
+{
+    uint64_t now = util_getTimeUs();
+    
+    socket_info->rcvq_copied += copied;
+    
+    if (socket_info->rcv_rtt_us == 0 || now - socket_info->rcvq_time_us < socket_info->rcv_rtt_us) {
+        return;
+    }
+    
+    if (socket_info->rcvq_copied > socket_info->rcvq_space) {
+        socket_info->rcvq_space = socket_info->rcvq_copied;
+        socket_info->rcvbuf_target = util_min(2*socket_info->rcvq_space, socket_info->rcvbuf_max);
+    }
+    
+    socket_info->rcvq_copied = 0;
+    socket_info->rcvq_time_us = now;
+}
+
+
+// Move up to len bytes from the front of "from" to "to" (dropped if "to" is NULL) without
+// allocating, returns the bytes moved. Never blocks on an empty "from".
+size_t moveBufferData(circular_buffer_t* from, circular_buffer_t* to, size_t len)
+{
+    unsigned char chunk[MOVE_CHUNK];
+    size_t size = circular_buffer_get_size(from);
+    size_t moved = 0;
+    
+    len = (len < size) ? len : size;
+    while (moved < len) {
+        size_t count = (len - moved < MOVE_CHUNK) ? len - moved : MOVE_CHUNK;
+        int bytes_read = circular_buffer_read(from, chunk, count);
+        if (bytes_read <= 0) {
+            break;
+        }
+        if (to != NULL) {
+            circular_buffer_write(to, chunk, bytes_read);
+        }
+        moved += bytes_read;
+    }
+    
+    return moved;
+}
+
+
+// Called by the handle thread (the only writer of in_data). Grows in_data and rws to rcvbuf_target
+// while no out-of-order data depends on the current window. Readers only touch in_data under
+// g_vsocket_table_mutex (see sw_readData()), so it can be swapped even while one is waiting.
+// WARNING: g_vsocket_table_mutex must already be acquired
+void growRecvBuffer(struct vsocket_infoset* socket_info)
+{
+    uint32_t target = util_min(socket_info->rcvbuf_target, socket_info->rcvbuf_max);
+    
+    if (target <= socket_info->tcb.rws || socket_info->rwin_buffer != NULL || mem_underPressure()) {
+        return;
+    }
+    
+    if (socket_info->in_data != NULL) {
+        circular_buffer_t* in_data = socket_info->in_data;
+        uint32_t capacity = circular_buffer_get_capacity(in_data);
+        
+        if (!mem_charge(MEM_RECV, target - capacity)) {
+            return;
+        }
+        
+        // Move unread data over to the bigger buffer
+        circular_buffer_t* grown = NULL;
+        circular_buffer_init(&grown, target);
+        
+        moveBufferData(in_data, grown, circular_buffer_get_size(in_data));
+        if (socket_info->recv_eof) {
+            circular_buffer_signal_eof(grown);
+        }
+        
+        // Only the growth was charged, the old capacity stays charged as part of target
+        circular_buffer_free(&(socket_info->in_data));
+        socket_info->in_data = grown;
+    }
+    
+    socket_info->tcb.rws = target;
+    updateRecvWindow(socket_info);
+}
+
+
+// The last of the two connection threads to quit frees the buffers and closes the log, in_data
+// is left to a reader still inside sw_readData() (the last one to leave frees it)
+void releaseThreadBuffers(int vsocket, struct vsocket_infoset* socket_info)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    socket_info->threads_running--;
+    bool last = (socket_info->threads_running == 0);
+    if (last) {
+        sw_freeSendBuffer(socket_info);
+        if (socket_info->active_readers == 0) {
+            sw_freeRecvBuffers(socket_info);
+        }
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    if (last) {
+        lgr_close(vsocket);
+    }
+}
+
+
+// An idle established connection needs no handle thread: it exits, and the next packet queued
+// starts a new one (see sw_wakeHandleThread()). Returns true if the calling thread must exit.
+bool parkHandleThread(struct vsocket_infoset* socket_info)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    bool park = (!socket_info->quit && socket_info->state == TCPS_ESTAB &&
+                 socket_info->rwin_buffer == NULL && socket_info->in_data == NULL &&
+                 bqueue_empty(&(socket_info->bq_buffer)));
+    socket_info->handle_parked = park;
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    return park;
+}
+
+
+// Bytes in swin_buffer not sent yet
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint32_t getUnsentBytes(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->swin_buffer == NULL) {
+        return 0;
+    }
+    
+    uint32_t write_index = circular_buffer_get_write_index(socket_info->swin_buffer);
+    uint32_t next_index = (socket_info->tcb.send_next - socket_info->tcb.seq_send_init)%DEFAULT_WSIZE;
+    
+    if (write_index == next_index) {
+        // Either nothing to send, or a full buffer of which nothing was sent yet
+        bool full = (socket_info->tcb.send_next == socket_info->tcb.send_unack &&
+                     circular_buffer_is_full(socket_info->swin_buffer));
+        return full ? DEFAULT_WSIZE : 0;
+    }
+    
+    return (write_index + DEFAULT_WSIZE - next_index)%DEFAULT_WSIZE;
+}
+
+
+// WARNING: g_vsocket_table_mutex must already be acquired
+void armPersistTimer(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    // In 64 bits: util_min()/util_max() take uint32_t, the RTO is a double
+    uint64_t timeout = (socket_info->rto_us > PERSIST_MIN_US) ? (uint64_t)socket_info->rto_us : PERSIST_MIN_US;
+    
+    // Stop doubling at the cap instead of shifting past it (and out of the 64 bits)
+    uint32_t backoff = socket_info->persist_backoff;
+    while (backoff > 0 && timeout < PERSIST_MAX_US) {
+        timeout <<= 1;
+        backoff--;
+    }
+    
+    socket_info->persist_time_us = now + ((timeout < PERSIST_MAX_US) ? timeout : PERSIST_MAX_US);
+}
+
+
+// The peer's window opened: stop probing. A probe byte the peer dropped (not covered
+// by acknum) is simply sent again with the rest of the data.
+// WARNING: g_vsocket_table_mutex must already be acquired
+void leavePersist(struct vsocket_infoset* socket_info, uint32_t acknum)
+{
+    socket_info->persist_time_us = 0;
+    socket_info->persist_backoff = 0;
+    if (acknum == socket_info->tcb.send_unack) {
+        socket_info->tcb.send_next = socket_info->tcb.send_unack;
+        rack_dropUnsent(socket_info);
+    }
+    socket_info->exp_acknum = 0;
+    socket_info->start_time = util_getTimeUs();
+}
+
+
+// Keep the earliest of the send thread's timers
+void setSendWakeup(uint64_t* wakeup_us, uint64_t time_us)
+{
+    if (*wakeup_us == 0 || time_us < *wakeup_us) {
+        *wakeup_us = time_us;
+    }
+}
+
+
+// Acknowledgement number for anything we send: recv_next, plus one once the FIN has been received in order
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint32_t getAckNum(struct vsocket_infoset* socket_info)
+{
+    return socket_info->recv_eof ? socket_info->tcb.recv_next + 1 : socket_info->tcb.recv_next;
+}
+
+
+// Delayed ACK (RFC 1122 4.2.3.2, RFC 5681 4.2): returns true if in-order data must be ACKed
+// right away, otherwise leaves the ACK pending for up to DELACK_US so that a data segment
+// from the send thread can carry it. The ACK goes out at once for every second full-sized
+// segment, when a segment filled a hole in the sequence space, and for the FIN.
+// WARNING: g_vsocket_table_mutex must already be acquired
+bool scheduleDelayedAck(struct vsocket_infoset* socket_info, uint32_t seg_len, bool filled_hole)
+{
+    socket_info->delack_bytes += seg_len;
+    
+    if (filled_hole || socket_info->recv_eof || socket_info->delack_bytes >= 2*socket_info->tcb.mss ||
+        socket_info->ecn_quickack) {
+        socket_info->ecn_quickack = false;
+        return true;
+    }
+    
+    if (socket_info->delack_time_us == 0) {
+        socket_info->delack_time_us = util_getTimeUs() + DELACK_US;
+        sw_wakeSendThread(socket_info);
+    }
+    return false;
+}
+
+
+// Every segment sent carries the latest ACK, nothing is pending after it
+// WARNING: g_vsocket_table_mutex must already be acquired
+void clearDelayedAck(struct vsocket_infoset* socket_info)
+{
+    socket_info->delack_time_us = 0;
+    socket_info->delack_bytes = 0;
+}
+
+
+// ECN flags of an outgoing segment: ECE while echoing a CE mark, CWR once after a window
+// reduction, carried by the next segment of new data only (RFC 3168 6.1.2/6.1.3)
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint8_t getECNFlags(struct vsocket_infoset* socket_info, bool new_data)
+{
+    uint8_t flags = socket_info->ecn_echo ? TH_ECE : 0;
+    
+    if (new_data && socket_info->ecn_cwr_pending) {
+        socket_info->ecn_cwr_pending = false;
+        flags |= TH_CWR;
+    }
+    return flags;
+}
+
+
+// Our interface queue reported dropping a packet of this connection to make room for one of
+// its segments: back off now, RACK repairs the hole once later data is acknowledged
+void handleLocalDrop(struct vsocket_infoset* socket_info, int result)
+{
+    if (result != LOCAL_DROP) {
+        return;
+    }
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    cc_onLocalDrop(socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
+
+// Send a pure ACK of everything received so far (also used as window update)
+void sendAck(struct vsocket_infoset* socket_info)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    uint32_t saddr = socket_info->tcb.local_vip;
+    uint32_t daddr = socket_info->tcb.remote_vip;
+    uint16_t sport = socket_info->tcb.local_port;
+    uint16_t dport = socket_info->tcb.remote_port;
+    uint32_t seqnum = socket_info->tcb.send_next;
+    uint32_t acknum = getAckNum(socket_info);
+    uint16_t uws = sw_getAdvertisedWindow(socket_info);
+    uint8_t flags = TH_ACK | getECNFlags(socket_info, false);
+    uint8_t tos = TCP_CONTROL_TOS(socket_info->tos);
+    clearDelayedAck(socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    tcp_packet_t ack_tcp_packet;
+    
+    // Build TCP ACK packet
+    buildTCPPacket(&ack_tcp_packet, saddr, daddr, sport, dport, seqnum, acknum, flags, uws, NULL, 0);
+    
+    tcp_sendMessage(socket_info, saddr, daddr, tos, &ack_tcp_packet, TCP_HDR_SIZE);
+}
+
+
+// Largest segment of new data the peer's window and the congestion window allow right now, 0 if none
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint32_t getUsableSegmentLen(struct vsocket_infoset* socket_info)
+{
+    uint32_t unsent = getUnsentBytes(socket_info);
+    uint32_t flight = socket_info->tcb.send_next - socket_info->tcb.send_unack;
+    
+    if (unsent == 0 || socket_info->tcb.remote_ruws <= flight) {
+        return 0;
+    }
+    
+    uint32_t usable = util_min(socket_info->tcb.remote_ruws - flight, cc_getSendQuota(socket_info));
+    return util_min(unsent, util_min(usable, socket_info->tcb.mss));
+}
+
+
+// Sender side silly window syndrome avoidance (RFC 1122 4.2.3.4) with Nagle's algorithm:
+// returns the length of the segment to send now, or 0 to hold the data back. A segment
+// goes out if it is a full MSS, if it empties the buffer with nothing in flight (or with
+// TCPO_NODELAY), if it is at least half the largest window the peer offered, or once the
+// data has been held back for SWS_OVERRIDE_US.
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint32_t getSendSegmentLen(struct vsocket_infoset* socket_info, uint64_t now)
+{
+    uint32_t len = getUsableSegmentLen(socket_info);
+    
+    if (len == 0) {
+        socket_info->sws_hold_time_us = 0; // nothing to send, or a closed window (persist timer)
+        return 0;
+    }
+    
+    uint32_t unsent = getUnsentBytes(socket_info);
+    uint32_t flight = socket_info->tcb.send_next - socket_info->tcb.send_unack;
+    
+    if (len == socket_info->tcb.mss ||
+        (len == unsent && (flight == 0 || socket_info->nodelay)) ||
+        len >= socket_info->tcb.max_sndwnd/2 ||
+        (socket_info->sws_hold_time_us != 0 && now >= socket_info->sws_hold_time_us + SWS_OVERRIDE_US)) {
+        
+        socket_info->sws_hold_time_us = 0;
+        return len;
+    }
+    
+    if (socket_info->sws_hold_time_us == 0) {
+        socket_info->sws_hold_time_us = now;
+    }
+    return 0;
+}
+
+
+// Timer service callback: the pacing delay of the connection is over
+void paceTimerFunc(void* arg)
+{
+    struct vsocket_infoset* socket_info = (struct vsocket_infoset*)arg;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    sw_wakeSendThread(socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
+
+// Returns true if the send thread has something to do now, otherwise sets wakeup_us
+// to the time the next timer expires (0 = none). Arms the persist timer when data
+// waits behind a closed window, and runs RACK once its reordering timer expired.
+// Retransmissions and new data wait for the congestion window, the pacing timer and the
+// rate cap; the pacing timer is kept by the timer service so paced flows need no timed sleeps.
+// WARNING: g_vsocket_table_mutex must already be acquired
+bool checkSendWork(struct vsocket_infoset* socket_info, uint64_t* wakeup_us)
+{
+    uint64_t now = util_getTimeUs();
+    uint32_t flight = socket_info->tcb.send_next - socket_info->tcb.send_unack;
+    uint32_t unsent = getUnsentBytes(socket_info);
+    bool pace_wait = cc_mustWaitForPacing(socket_info, now);
+    
+    *wakeup_us = 0;
+    
+    if (socket_info->rack_timer_us != 0 && now >= socket_info->rack_timer_us) {
+        rack_detectLoss(socket_info, now);
+    }
+    if (socket_info->rack_lost > 0 && cc_getSendQuota(socket_info) > 0) {
+        if (!pace_wait) {
+            return true;
+        }
+        tsv_schedule(&(socket_info->pace_timer), cc_getReleaseTime(socket_info));
+    }
+    
+    if (unsent > 0 && socket_info->tcb.remote_ruws == 0 && flight == 0 && socket_info->persist_time_us == 0) {
+        armPersistTimer(socket_info, now);
+    }
+    
+    if (socket_info->persist_time_us != 0) {
+        if (now >= socket_info->persist_time_us) {
+            return true;
+        }
+        setSendWakeup(wakeup_us, socket_info->persist_time_us);
+        
+    } else if (flight != 0) {
+        uint64_t rto_time = rack_getRTOTime(socket_info);
+        if (now >= rto_time) {
+            return true;
+        }
+        setSendWakeup(wakeup_us, rto_time);
+        
+        if (socket_info->tlp_time_us != 0) {
+            if (now >= socket_info->tlp_time_us) {
+                return true;
+            }
+            setSendWakeup(wakeup_us, socket_info->tlp_time_us);
+        }
+        if (socket_info->rack_timer_us != 0) {
+            setSendWakeup(wakeup_us, socket_info->rack_timer_us);
+        }
+    }
+    
+    if (getSendSegmentLen(socket_info, now) > 0) {
+        if (!pace_wait) {
+            return true;
+        }
+        tsv_schedule(&(socket_info->pace_timer), cc_getReleaseTime(socket_info));
+    }
+    if (socket_info->sws_hold_time_us != 0) {
+        setSendWakeup(wakeup_us, socket_info->sws_hold_time_us + SWS_OVERRIDE_US);
+    }
+    
+    // A delayed ACK that no data segment picked up goes out on its own
+    if (socket_info->delack_time_us != 0) {
+        if (now >= socket_info->delack_time_us) {
+            return true;
+        }
+        setSendWakeup(wakeup_us, socket_info->delack_time_us);
+    }
+    
+    // Wake up once more to release the idle swin_buffer
+    if (socket_info->swin_buffer != NULL && flight == 0 && unsent == 0) {
+        uint64_t idle_time = socket_info->send_activity_us + BUFFER_IDLE_US;
+        if (now > idle_time) {
+            return true;
+        }
+        setSendWakeup(wakeup_us, idle_time + 1);
+    }
+    
+    return false;
+}
+
+
+// WARNING: g_vsocket_table_mutex must already be acquired (released while waiting)
+void waitForSendWork(struct vsocket_infoset* socket_info, uint64_t wakeup_us)
+{
+    if (wakeup_us == 0) {
+        pthread_cond_wait(&(socket_info->send_cond), &g_vsocket_table_mutex);
+        return;
+    }
+    
+    uint64_t now = util_getTimeUs();
+    if (wakeup_us <= now) {
+        return;
+    }
+    
+    // pthread_cond_timedwait() takes an absolute CLOCK_REALTIME time
+    struct timespec deadline;
+    setCondDeadline(&deadline, wakeup_us - now);
+    
+    pthread_cond_timedwait(&(socket_info->send_cond), &g_vsocket_table_mutex, &deadline);
+}
+
+
+// Retransmit (or probe with) data already sent once, never timed for the RTO (Karn's algorithm).
+// A segment ending with the FIN's sequence number is sent with FIN set instead of that byte.
 void transmitUnACKedData(struct vsocket_infoset* socket_info, uint32_t start_index, 
-                         uint16_t data_len, uint32_t seqnum, bool do_rto_calc)
+                         uint16_t data_len, uint32_t seqnum)
 {
     char temp[TCP_MTU];
     memset(temp, 0, TCP_MTU);
+    uint8_t flags = TH_ACK;
     
     // Critical Section
     pthread_mutex_lock(&g_vsocket_table_mutex);
-    if (socket_info->tcb.send_next == socket_info->tcb.seq_fin+1) {
+    if (socket_info->tcb.send_next == socket_info->tcb.seq_fin+1 && seqnum + data_len == socket_info->tcb.send_next) {
         data_len--;
+        flags |= TH_FIN;
     }
     pthread_mutex_unlock(&g_vsocket_table_mutex);
             
-    circular_buffer_get_contents(socket_info->swin_buffer, start_index, data_len, temp);
+    if (data_len > 0) {
+        circular_buffer_get_contents(socket_info->swin_buffer, start_index, data_len, temp);
+    }
         
     // Get all variables inside critical section
     pthread_mutex_lock(&g_vsocket_table_mutex);
@@ -49,109 +725,293 @@ void transmitUnACKedData(struct vsocket_infoset* socket_info, uint32_t start_ind
     uint32_t daddr = (socket_info->tcb).remote_vip;
     uint16_t sport = (socket_info->tcb).local_port;
     uint16_t dport = (socket_info->tcb).remote_port;
-    uint16_t rws = (socket_info->tcb).rws;
-    uint32_t acknum = (socket_info->tcb).recv_next;
+    uint16_t rws = sw_getAdvertisedWindow(socket_info);
+    uint32_t acknum = getAckNum(socket_info);
+    flags |= getECNFlags(socket_info, false);
+    uint8_t tos = socket_info->tos;
+    clearDelayedAck(socket_info); // piggybacked on this segment
     pthread_mutex_unlock(&g_vsocket_table_mutex);
             
     //build packet and send
     tcp_packet_t tcp_packet;
     buildTCPPacket(&tcp_packet, saddr, daddr, sport, dport,
-                   seqnum, acknum, TH_ACK, rws, temp, data_len);
-     
-    // RTO calculation setup             
-    if (do_rto_calc == true) {
+                   seqnum, acknum, flags, rws, temp, data_len);
+
+    handleLocalDrop(socket_info, tcp_sendMessage(socket_info, saddr, daddr, tos, &tcp_packet, TCP_HDR_SIZE+data_len));
+}
+
+
+// Retransmit the segments RACK or the RTO marked lost, oldest first, as far as the
+// congestion window and the pacing timer allow
+void retransmitLostData(struct vsocket_infoset* socket_info)
+{
+    while (true) {
+        
         // Critical Section
         pthread_mutex_lock(&g_vsocket_table_mutex);
-        if (socket_info->exp_acknum == 0) {
-            socket_info->exp_acknum = socket_info->tcb.send_next + data_len;
-            socket_info->send_time = clock();    
+        uint64_t now = util_getTimeUs();
+        struct tx_record* record = rack_getLostRecord(socket_info);
+        if (record == NULL || cc_getSendQuota(socket_info) == 0 || cc_mustWaitForPacing(socket_info, now)) {
+            pthread_mutex_unlock(&g_vsocket_table_mutex);
+            return;
         }
-        pthread_mutex_unlock(&g_vsocket_table_mutex);    
+        uint32_t seqnum = record->seq;
+        uint32_t data_len = record->len;
+        uint32_t index = (seqnum - socket_info->tcb.seq_send_init)%DEFAULT_WSIZE;
+        rack_onRetransmit(socket_info, record, now);
+        cc_onPacedSend(socket_info, data_len, now);
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        
+        transmitUnACKedData(socket_info, index, data_len, seqnum);
     }
-                           
-    tcp_sendMessage(socket_info, saddr, daddr, &tcp_packet, TCP_HDR_SIZE+data_len);
+}
+
+
+// Send as much new data as the peer's window, the congestion window, SWS avoidance and
+// Nagle allow (at most SEND_BURST_MAX segments, and at most the pacing burst when paced):
+// the segments are carved out of the send window under one lock and handed to the network
+// layer as one super-segment, which it splits into MSS sized segments (software GSO). A
+// tail loss probe sends a single segment, Nagle and pacing aside. Returns false if nothing was sent.
+bool transmitNewData(struct vsocket_infoset* socket_info, bool probe)
+{
+    uint32_t total_len = 0;
+    int count = 0;
+    int max_count = probe ? 1 : SEND_BURST_MAX;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    uint64_t now = util_getTimeUs();
+    uint32_t seqnum = socket_info->tcb.send_next;
+    uint32_t first_len = 0;
+    uint32_t burst = probe ? UINT32_MAX : cc_getPacingBurst(socket_info);
+    
+    if (!probe && cc_mustWaitForPacing(socket_info, now)) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return false;
+    }
+    
+    // Every segment but the last is a full MSS, so the burst is one contiguous run of data
+    while (count < max_count) {
+        uint32_t data_len = probe ? getUsableSegmentLen(socket_info) : getSendSegmentLen(socket_info, now);
+        if (data_len == 0 || (count > 0 && total_len + data_len > burst)) {
+            break;
+        }
+        
+        if (count == 0) {
+            first_len = data_len;
+        }
+        socket_info->tcb.send_next = socket_info->tcb.send_next + data_len; // Update send_next
+        total_len += data_len;
+        count++;
+    }
+    
+    cc_checkAppLimited(socket_info, getUnsentBytes(socket_info) > 0);
+    if (count == 0) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return false;
+    }
+    
+    uint32_t saddr = (socket_info->tcb).local_vip;
+    uint32_t daddr = (socket_info->tcb).remote_vip;
+    uint16_t sport = (socket_info->tcb).local_port;
+    uint16_t dport = (socket_info->tcb).remote_port;
+    uint16_t rws = sw_getAdvertisedWindow(socket_info);
+    uint32_t acknum = getAckNum(socket_info);
+    uint32_t mss = socket_info->tcb.mss;
+    uint32_t start_index = (seqnum - socket_info->tcb.seq_send_init)%DEFAULT_WSIZE;
+    bool push = (getUnsentBytes(socket_info) == 0); // PSH once everything written so far is out
+    uint8_t flags = TH_ACK | getECNFlags(socket_info, true);
+    uint8_t tos = socket_info->tos | (socket_info->ecn_ok ? IPTOS_ECN_ECT0 : 0);
+    clearDelayedAck(socket_info); // piggybacked on the burst
+    
+    // RTO calculation setup: time the first segment of the burst
+    if (socket_info->exp_acknum == 0) {
+        socket_info->exp_acknum = seqnum + first_len;
+        socket_info->send_time = now;
+    }
+    
+    // One transmit record per segment the burst is split into
+    uint32_t offset;
+    for (offset = 0; offset < total_len; offset += mss) {
+        rack_onTransmit(socket_info, seqnum + offset, util_min(mss, total_len - offset), now);
+    }
+    cc_onPacedSend(socket_info, total_len, now);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    // swin_buffer (and burst_data with it) stays allocated while data is in flight, and only
+    // the send thread uses burst_data
+    char* data = socket_info->burst_data;
+    circular_buffer_get_contents(socket_info->swin_buffer, start_index, total_len, data);
+    
+    tcp_super_segment_t super_segment;
+    tcp_buildSuperSegment(&super_segment, saddr, daddr, sport, dport,
+                          seqnum, acknum, flags, rws, data, total_len, mss, push);
+    
+    handleLocalDrop(socket_info, tcp_sendSuperSegment(socket_info, saddr, daddr, tos, &super_segment));
+    
+    return true;
 }
 
 
 uint32_t getIndexForTCBSendValue(struct vsocket_infoset* socket_info, uint32_t send_val)
 {
     pthread_mutex_lock(&g_vsocket_table_mutex);
-    uint32_t index = (send_val - socket_info->tcb.seq_send_init)%socket_info->tcb.sws;
+    uint32_t index = (send_val - socket_info->tcb.seq_send_init)%DEFAULT_WSIZE; // swin_buffer capacity
     pthread_mutex_unlock(&g_vsocket_table_mutex);
         
     return index;
 }
 
 
+// Persist timer expired: send one byte beyond the closed window, the peer answers with
+// an ACK carrying its current window (see handleTCPData())
+void sendWindowProbe(struct vsocket_infoset* socket_info)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    uint32_t seqnum = socket_info->tcb.send_unack;
+    if (socket_info->tcb.send_next == seqnum) {
+        socket_info->tcb.send_next++; // the probe byte is taken from the unsent data
+        rack_onTransmit(socket_info, seqnum, 1, util_getTimeUs());
+    }
+    uint32_t index = (seqnum - socket_info->tcb.seq_send_init)%DEFAULT_WSIZE;
+    
+    socket_info->persist_backoff = util_min(socket_info->persist_backoff + 1, PERSIST_MAX_BACKOFF);
+    armPersistTimer(socket_info, util_getTimeUs());
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    transmitUnACKedData(socket_info, index, 1, seqnum);
+}
+
+
+// Tail loss probe timer expired (RFC 8985 7.3): send one segment of new data if the peer's
+// window allows, otherwise retransmit the last segment sent, so that a lost tail is
+// answered with an ACK (and repaired by RACK) instead of waiting for the RTO
+void sendLossProbe(struct vsocket_infoset* socket_info)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    uint64_t now = util_getTimeUs();
+    socket_info->tlp_time_us = 0;
+    socket_info->tlp_outstanding = true;
+    socket_info->tlp_end_seq = socket_info->tcb.send_next;
+    socket_info->tlp_probes++;
+    socket_info->start_time = now; // the RTO restarts after the probe
+    
+    struct tx_record* record = NULL;
+    if (getUsableSegmentLen(socket_info) == 0) {
+        record = rack_getLastRecord(socket_info);
+    }
+    
+    uint32_t seqnum = 0;
+    uint32_t data_len = 0;
+    uint32_t index = 0;
+    if (record != NULL) {
+        seqnum = record->seq;
+        data_len = record->len;
+        index = (seqnum - socket_info->tcb.seq_send_init)%DEFAULT_WSIZE;
+        rack_onRetransmit(socket_info, record, now);
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    if (record != NULL) {
+        transmitUnACKedData(socket_info, index, data_len, seqnum);
+    } else {
+        transmitNewData(socket_info, true);
+    }
+}
+
+
 void handleTCPData(struct vsocket_infoset* socket_info, tcp_packet_t* rv_tcp_packet, size_t rv_tcp_data_len, ip_header_t* ip_header)
 {
     uint32_t rv_seqnum = ntohl((rv_tcp_packet->tcp_header).th_seq);
     
     pthread_mutex_lock(&g_vsocket_table_mutex);
     uint32_t recv_next = socket_info->tcb.recv_next;
-    uint32_t rws = socket_info->tcb.rws;
+    growRecvBuffer(socket_info);
+    bool has_buffer = sw_allocRecvBuffers(socket_info);
+    uint32_t free_space = getFreeRecvSpace(socket_info);
+    socket_info->recv_activity_us = util_getTimeUs();
     pthread_mutex_unlock(&g_vsocket_table_mutex);
     
+    // Over the node memory limit, drop the segment (the sender will retransmit it)
+    if (!has_buffer) {
+        return;
+    }
     
-    // Check if sequence number is valid
-    // if RCV.NXT<=SEG.SEQ<RECV.NXT+RCV.WND
+    // Check if the segment is valid: it must fit in the space left in in_data, so
+    // that delivering it (and any out-of-order data before it) never blocks
+    // if RCV.NXT<=SEG.SEQ && SEG.SEQ+SEG.LEN<=RCV.NXT+free space
     if ((rv_seqnum >= recv_next) &&
-        (rv_seqnum < recv_next + rws)) {
+        (rv_seqnum + rv_tcp_data_len <= recv_next + free_space)) {
 
+        size_t total_data_len = rv_tcp_data_len;
+        
         // Data in order if sequence number == recv next
-        if (rv_seqnum == recv_next) {
+        if (rv_seqnum == recv_next && socket_info->rwin_buffer == NULL) {
+        
+            // No out-of-order data held, append straight to in_data
+            circular_buffer_write(socket_info->in_data, (void*)tcp_getData(rv_tcp_packet), rv_tcp_data_len);
+        
+        } else if (rv_seqnum == recv_next) {
             
             // Clean up pending_data array between socket_info->tcb.recv_next and rv_seqnum.
             size_t start_index = circular_buffer_get_write_index(socket_info->rwin_buffer);
             int index;
             int end = util_min(start_index + rv_tcp_data_len, DEFAULT_WSIZE);
             for (index = start_index; index < end; index++) {
-                socket_info->pending_data[index] = 0;
+                clearPendingData(socket_info, index);
             }
             if (start_index + rv_tcp_data_len > DEFAULT_WSIZE) {
                 int wrap = (start_index + rv_tcp_data_len) % DEFAULT_WSIZE;
                 for (index = 0; index < wrap; index++) {
-                    socket_info->pending_data[index] = 0;
+                    clearPendingData(socket_info, index);
                 }
             }
                     
             // Write into circular buffer
             pthread_mutex_lock(&g_vsocket_table_mutex);
-            int result = circular_buffer_write(socket_info->rwin_buffer, (void*)rv_tcp_packet->tcp_data, rv_tcp_data_len);
+            int result = circular_buffer_write(socket_info->rwin_buffer, (void*)tcp_getData(rv_tcp_packet), rv_tcp_data_len);
             assert(result == rv_tcp_data_len);
             pthread_mutex_unlock(&g_vsocket_table_mutex);
                         
             // Check for data already received (pending_data array)
             size_t pdata_len = 0;
             size_t write_index = 0;
-            size_t total_data_len = rv_tcp_data_len;
             do {
                 // Get index
                 write_index = circular_buffer_get_write_index(socket_info->rwin_buffer);
                                 
                 pdata_len = socket_info->pending_data[write_index];
                 circular_buffer_increment_write_pointer(socket_info->rwin_buffer, pdata_len);
-                socket_info->pending_data[write_index] = 0;
+                clearPendingData(socket_info, write_index);
                                 
                 total_data_len += pdata_len;
 
             } while (pdata_len != 0);
                                 
-            // Read as much is possible and copy into in_data
-            unsigned char temp[DEFAULT_WSIZE];
-            memset(temp, 0, DEFAULT_WSIZE);
-            int bytes_read = circular_buffer_read(socket_info->rwin_buffer, &temp, DEFAULT_WSIZE);
-
-            circular_buffer_write(socket_info->in_data, &temp, bytes_read);
+            // Copy everything now in order into in_data
+            moveBufferData(socket_info->rwin_buffer, socket_info->in_data, circular_buffer_get_size(socket_info->rwin_buffer));
+            
+            // Everything out-of-order has been delivered, give the space back
+            if (socket_info->ooo_segments == 0) {
+                pthread_mutex_lock(&g_vsocket_table_mutex);
+                freeOOOBuffer(socket_info);
+                pthread_mutex_unlock(&g_vsocket_table_mutex);
+            }
+        }
+        
+        if (rv_seqnum == recv_next) {
                             
             // Critical Section
             pthread_mutex_lock(&g_vsocket_table_mutex);
             // Update the recv_next
             socket_info->tcb.recv_next = socket_info->tcb.recv_next + total_data_len;
-            socket_info->tcb.ruws = util_min(socket_info->tcb.ruws + total_data_len, socket_info->tcb.rws);            
-            uint32_t seqnum = socket_info->tcb.send_next;
-            uint32_t acknum = socket_info->tcb.recv_next;
-            uint16_t uws = (uint16_t)(socket_info->tcb.ruws);
+            // The right edge stays put, it only moves on when space frees up (see updateRecvWindow())
+            socket_info->tcb.ruws = (socket_info->tcb.ruws > total_data_len) ? socket_info->tcb.ruws - total_data_len : 0;
+            updateRecvWindow(socket_info);
+            measureRecvRTT(socket_info);
+            wakeRecvWaiters(socket_info, ((rv_tcp_packet->tcp_header).th_flags & TH_PUSH) != 0);
             
             uint32_t rv_fin_seqnum = socket_info->tcb.recv_fin;
             recv_next = socket_info->tcb.recv_next;
@@ -160,131 +1020,270 @@ void handleTCPData(struct vsocket_infoset* socket_info, tcp_packet_t* rv_tcp_pac
             // if recv FIN seqnum == recv_next (we aren't expecting any more data)
             // So signal_eof to in_data buffer
             if (rv_fin_seqnum == recv_next) {
-                circular_buffer_signal_eof(socket_info->in_data);
-                
-                // Increment the acknum
-                acknum++;
+                signalRecvEOF(socket_info);
+            }
+            
+            // ACK all data read, or leave it to the next data segment we send
+            pthread_mutex_lock(&g_vsocket_table_mutex);
+            bool ack_now = scheduleDelayedAck(socket_info, rv_tcp_data_len, total_data_len != rv_tcp_data_len);
+            pthread_mutex_unlock(&g_vsocket_table_mutex);
+            
+            if (ack_now) {
+                sendAck(socket_info);
             }
-                                                    
-            // Send ACK for all data read
-            tcp_packet_t ack_tcp_packet;
-                            
-            uint32_t saddr = ntohl(ip_header->ip_dst);
-            uint32_t daddr = ntohl(ip_header->ip_src);
-            uint16_t sport = ntohs(rv_tcp_packet->tcp_header.th_dport);
-            uint16_t dport = ntohs(rv_tcp_packet->tcp_header.th_sport);
-                            
-            // Build TCP ACK packet
-            buildTCPPacket(&ack_tcp_packet, saddr, daddr, sport, dport, seqnum, acknum, TH_ACK, uws, NULL, 0);
-                                           
-            tcp_sendMessage(socket_info, saddr, daddr, &ack_tcp_packet, TCP_HDR_SIZE);
                                    
         } else { // Data not in order
                         
             // Critical Section
             pthread_mutex_lock(&g_vsocket_table_mutex);
             size_t offset = rv_seqnum - socket_info->tcb.recv_next;
+            bool has_ooo_buffer = allocOOOBuffer(socket_info);
             pthread_mutex_unlock(&g_vsocket_table_mutex);
-                         
-            int result = circular_buffer_store(socket_info->rwin_buffer, rv_tcp_packet->tcp_data, rv_tcp_data_len, offset);
-            assert(result == rv_tcp_data_len);
+            
+            // Refused under memory pressure: don't hold the segment, just send the duplicate ACK
+            if (has_ooo_buffer) {
+                int result = circular_buffer_store(socket_info->rwin_buffer, tcp_getData(rv_tcp_packet), rv_tcp_data_len, offset);
+                assert(result == rv_tcp_data_len);
                             
-            // Update pending_data array
-            size_t index = circular_buffer_get_write_index(socket_info->rwin_buffer);
-                
-            // Critical Section
-            pthread_mutex_lock(&g_vsocket_table_mutex);
-            socket_info->pending_data[(index+offset) % DEFAULT_WSIZE] = rv_tcp_data_len;
-            socket_info->tcb.ruws = util_min(socket_info->tcb.ruws, socket_info->tcb.rws - (offset + rv_tcp_data_len));
+                // Update pending_data array
+                size_t index = circular_buffer_get_write_index(socket_info->rwin_buffer);
                 
-            uint32_t seqnum = socket_info->tcb.send_next;
-            uint32_t acknum = socket_info->tcb.recv_next;
-            uint16_t uws = socket_info->tcb.ruws;
+                // Critical Section
+                pthread_mutex_lock(&g_vsocket_table_mutex);
+                if (socket_info->pending_data[(index+offset) % DEFAULT_WSIZE] == 0) {
+                    socket_info->ooo_segments++;
+                }
+                socket_info->pending_data[(index+offset) % DEFAULT_WSIZE] = rv_tcp_data_len;
+                pthread_mutex_unlock(&g_vsocket_table_mutex);
+            }
+            
+            // Send (duplicate) ACK of recv_next right away, the sender counts these for fast retransmit
+            sendAck(socket_info);
+        }
+    // end if sequence number is valid
+    } else { // Old duplicate or beyond the window
+        
+        // Send ACK of recv_next
+        sendAck(socket_info);
+    }
+}  
+
+
+// Process the ACK field and window of any segment, with or without data
+void handleTCPACK(struct vsocket_infoset* socket_info, tcp_packet_t* rv_tcp_packet, size_t rv_tcp_data_len, ip_header_t* ip_header)
+{
+    //check ack number of ACK packet
+    uint32_t recv_acknum=ntohl((rv_tcp_packet->tcp_header).th_ack);
+
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    uint32_t send_unack=(socket_info->tcb).send_unack;
+    uint32_t send_next=(socket_info->tcb).send_next;
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    // Check whether ACK acceptable: send_unack<recv_acknum<=send_next
+    if (recv_acknum < send_unack || recv_acknum > send_next) return;
+       
+    // Update remote_ruws, the send thread resumes as soon as the window opens
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    uint32_t old_remote_ruws = (socket_info->tcb).remote_ruws;
+    (socket_info->tcb).remote_ruws = ntohs((rv_tcp_packet->tcp_header).th_win);
+    (socket_info->tcb).max_sndwnd = util_max((socket_info->tcb).max_sndwnd, (socket_info->tcb).remote_ruws);
+    if (socket_info->persist_time_us != 0 && (socket_info->tcb).remote_ruws > 0) {
+        leavePersist(socket_info, recv_acknum);
+    }
+    sw_wakeSendThread(socket_info);
+    uint32_t remote_ruws = (socket_info->tcb).remote_ruws;
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    // Slide the send window by recv_acknum-send_unack. swin_buffer is only looked at under the lock,
+    // the send thread may release it (see releaseIdleSendBuffer()). The FIN occupies no buffer space.
+    uint32_t acked = recv_acknum-send_unack;
+    if (acked > 0) {
+    
+        // Critical Section
+        pthread_mutex_lock(&g_vsocket_table_mutex);
+        if (socket_info->swin_buffer != NULL) {
+            moveBufferData(socket_info->swin_buffer, NULL, acked);
+        }
+        uint64_t now = util_getTimeUs();
+        socket_info->tcb.send_unack = send_unack + acked; //update send_unack
+        socket_info->tcb.dup_ack = 0; //reset dup
+        socket_info->start_time = now;
+        socket_info->send_activity_us = now;
+        rack_onAck(socket_info, socket_info->tcb.send_unack, now);
+        sw_wakeSendThread(socket_info);
+        tcp_wakePollers(socket_info); // room for v_write()
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+    }
+
+    // Window updates, ACKs with nothing outstanding and data segments are not duplicate ACKs (RFC 5681)
+    if (recv_acknum == send_unack && send_next != send_unack && remote_ruws == old_remote_ruws && rv_tcp_data_len == 0) {
+    
+        // Increment duplicate ACK counter, one more segment past the hole has arrived
+        pthread_mutex_lock(&g_vsocket_table_mutex);
+        socket_info->tcb.dup_ack = socket_info->tcb.dup_ack + 1;
+        rack_onDupAck(socket_info, util_getTimeUs());
+        if (socket_info->rack_lost > 0 || socket_info->rack_timer_us != 0) {
+            sw_wakeSendThread(socket_info);
+        }
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+    }
+}
+
+// ECN signals of a segment on an ECN connection (RFC 3168 6.1): CWR ends the echo of an earlier
+// mark, a CE mark on data starts it (the segment is ACKed at once so the peer learns quickly),
+// ECE on an ACK makes the congestion control reduce the window without waiting for a loss.
+void handleECN(struct vsocket_infoset* socket_info, ip_packet_t* ip_packet, tcp_packet_t* rv_tcp_packet, size_t rv_tcp_data_len)
+{
+    uint8_t flags = (rv_tcp_packet->tcp_header).th_flags;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    if ((flags & TH_CWR) != 0) {
+        socket_info->ecn_echo = false;
+    }
+    if (IPTOS_ECN((ip_packet->ip_header).ip_tos) == IPTOS_ECN_CE && rv_tcp_data_len > 0) {
+        socket_info->ecn_ce_received++;
+        if (!socket_info->ecn_echo) {
+            socket_info->ecn_echo = true;
+            socket_info->ecn_quickack = true;
+        }
+    }
+    if ((flags & (TH_ECE|TH_ACK)) == (TH_ECE|TH_ACK)) {
+        cc_onECE(socket_info);
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
+
+// Van Jacobson header prediction: in ESTAB, a segment with nothing but ACK (and PUSH) set,
+// the expected sequence number and an unchanged window is either pure in-order data
+// (nothing newly ACKed) or a pure ACK of new data (no payload). Both are handled here
+// under a single lock; returns false to leave the segment to the general path.
+bool handleTCPFastPath(struct vsocket_infoset* socket_info, tcp_packet_t* rv_tcp_packet, size_t rv_tcp_data_len)
+{
+    if (((rv_tcp_packet->tcp_header).th_flags & ~TH_PUSH) != TH_ACK) {
+        return false;
+    }
+    
+    uint32_t rv_seqnum = ntohl((rv_tcp_packet->tcp_header).th_seq);
+    uint32_t rv_acknum = ntohl((rv_tcp_packet->tcp_header).th_ack);
+    uint16_t rv_window = ntohs((rv_tcp_packet->tcp_header).th_win);
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    if (socket_info->state != TCPS_ESTAB ||
+        rv_seqnum != socket_info->tcb.recv_next ||
+        rv_window != socket_info->tcb.remote_ruws ||
+        socket_info->persist_time_us != 0) {
+        
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return false;
+    }
+    
+    if (rv_tcp_data_len > 0) {
+    
+        // Pure in-order data: nothing newly ACKed, no out-of-order data held and room left in in_data
+        growRecvBuffer(socket_info);
+        if (rv_acknum != socket_info->tcb.send_unack ||
+            socket_info->rwin_buffer != NULL ||
+            socket_info->in_data == NULL ||
+            rv_tcp_data_len > getFreeRecvSpace(socket_info)) {
+            
             pthread_mutex_unlock(&g_vsocket_table_mutex);
-                            
-            // Send ACK of recv_next
-            tcp_packet_t ack_tcp_packet;
-                            
-            uint32_t saddr = ntohl(ip_header->ip_dst);
-            uint32_t daddr = ntohl(ip_header->ip_src);
-            uint16_t sport = ntohs(rv_tcp_packet->tcp_header.th_dport);
-            uint16_t dport = ntohs(rv_tcp_packet->tcp_header.th_sport);
-                            
-            // Build TCP ACK packet
-            buildTCPPacket(&ack_tcp_packet, saddr, daddr, sport, dport, seqnum, acknum, TH_ACK, uws, NULL, 0);
-                                           
-            tcp_sendMessage(socket_info, saddr, daddr, &ack_tcp_packet, TCP_HDR_SIZE);
+            return false;
         }
-    // end if sequence number is valid
-    } else if (rv_seqnum < recv_next) {
         
-        // Critical Section
-        pthread_mutex_lock(&g_vsocket_table_mutex);
-        uint32_t seqnum = socket_info->tcb.send_next;
-        uint32_t acknum = socket_info->tcb.recv_next;
-        uint16_t uws = socket_info->tcb.ruws;
+        // There is room, so this never blocks
+        circular_buffer_write(socket_info->in_data, (void*)tcp_getData(rv_tcp_packet), rv_tcp_data_len);
+        wakeRecvWaiters(socket_info, ((rv_tcp_packet->tcp_header).th_flags & TH_PUSH) != 0);
+        
+        socket_info->recv_activity_us = util_getTimeUs();
+        socket_info->tcb.recv_next = socket_info->tcb.recv_next + rv_tcp_data_len;
+        socket_info->tcb.ruws = (socket_info->tcb.ruws > rv_tcp_data_len) ? socket_info->tcb.ruws - rv_tcp_data_len : 0;
+        updateRecvWindow(socket_info);
+        measureRecvRTT(socket_info);
+        bool ack_now = scheduleDelayedAck(socket_info, rv_tcp_data_len, false);
         pthread_mutex_unlock(&g_vsocket_table_mutex);
-                            
-        // Send ACK of recv_next
-        tcp_packet_t re_ack_tcp_packet;
-      
-        uint32_t saddr = ntohl(ip_header->ip_dst);
-        uint32_t daddr = ntohl(ip_header->ip_src);
-        uint16_t sport = ntohs(rv_tcp_packet->tcp_header.th_dport);
-        uint16_t dport = ntohs(rv_tcp_packet->tcp_header.th_sport);
-                            
-        // Build TCP ACK packet
-        buildTCPPacket(&re_ack_tcp_packet, saddr, daddr, sport, dport, seqnum, acknum, TH_ACK, uws, NULL, 0);
-                                           
-        tcp_sendMessage(socket_info, saddr, daddr, &re_ack_tcp_packet, TCP_HDR_SIZE);
+        
+        if (ack_now) {
+            sendAck(socket_info);
+        }
+        return true;
     }
-}  
+    
+    // Pure ACK of new data: acknum within (send_unack, send_next]
+    uint32_t acked = rv_acknum - socket_info->tcb.send_unack;
+    if (acked == 0 ||
+        acked > socket_info->tcb.send_next - socket_info->tcb.send_unack ||
+        socket_info->swin_buffer == NULL) {
+        
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return false;
+    }
+    
+    // Slide the send window
+    moveBufferData(socket_info->swin_buffer, NULL, acked);
+    
+    uint64_t now = util_getTimeUs();
+    socket_info->tcb.send_unack = rv_acknum;
+    socket_info->tcb.dup_ack = 0;
+    socket_info->start_time = now;
+    socket_info->send_activity_us = now;
+    rack_onAck(socket_info, rv_acknum, now);
+    sw_wakeSendThread(socket_info);
+    tcp_wakePollers(socket_info); // room for v_write()
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    return true;
+}
 
 
-void handleTCPACK(struct vsocket_infoset* socket_info, tcp_packet_t* rv_tcp_packet, size_t rv_tcp_data_len, ip_header_t* ip_header)
+// Arms the 2MSL timer if the last state change entered TIME_WAIT. A retransmitted FIN
+// restarts it (RFC 793).
+void armTimeWait(struct vsocket_infoset* socket_info)
 {
-    assert(rv_tcp_data_len==0);//ACK packet contains no data
-
-    //check ack number of ACK packet
-    uint32_t recv_acknum=ntohl((rv_tcp_packet->tcp_header).th_ack);
-
+    // Critical Section
     pthread_mutex_lock(&g_vsocket_table_mutex);
-    uint32_t send_unack=(socket_info->tcb).send_unack;
-    uint32_t send_next=(socket_info->tcb).send_next;
+    if (socket_info->state == TCPS_TIME_WAIT) {
+        tsv_schedule(&(socket_info->time_wait_timer), util_getTimeUs() + TIME_WAIT_US);
+    }
     pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
+
+// FIN received, possibly on the last data segment (the FIN then follows the data)
+void handleTCPFIN(int vsocket, struct vsocket_infoset* socket_info, tcp_packet_t* rv_tcp_packet, size_t rv_tcp_data_len)
+{
+    int error_code = 0;
     
-    // Check whether ACK acceptable: send_unack<recv_acknum<=send_next
-    if (recv_acknum < send_unack || recv_acknum > send_next) return;
+    if (!isValidAction(vsocket, TCPA_RECV_FIN, &error_code)){
+        return;
+    }
        
-    // Update remote_ruws
+    // Critical Section
     pthread_mutex_lock(&g_vsocket_table_mutex);
-    (socket_info->tcb).remote_ruws = ntohs((rv_tcp_packet->tcp_header).th_win);
+    socket_info->tcb.recv_fin = ntohl(rv_tcp_packet->tcp_header.th_seq) + rv_tcp_data_len;
+    uint32_t rv_fin_seqnum = socket_info->tcb.recv_fin;
+    uint32_t recv_next = socket_info->tcb.recv_next;
     pthread_mutex_unlock(&g_vsocket_table_mutex);
     
-    // read from buffer, could slide window by amount of slide_len=recv_acknum-send_unack
-    unsigned char temp[DEFAULT_WSIZE];
-    memset(temp, 0, DEFAULT_WSIZE);
-
-    int bytes_read = circular_buffer_read(socket_info->swin_buffer, &temp, recv_acknum-send_unack);
-    if (bytes_read > 0) {
+    changeState(vsocket, TCPA_RECV_FIN);
+    armTimeWait(socket_info);
     
-        // Critical Section
-        pthread_mutex_lock(&g_vsocket_table_mutex);
-        socket_info->tcb.send_unack = send_unack + bytes_read; //update send_unack
-        socket_info->tcb.dup_ack = 0; //reset dup
-        socket_info->start_time = clock();
-        pthread_mutex_unlock(&g_vsocket_table_mutex);
+    // if recv FIN seqnum == recv_next (we aren't expecting any more data)
+    // So signal_eof to in_data buffer
+    if (rv_fin_seqnum != recv_next) {
+        return;
     }
 
-    if (recv_acknum == send_unack) {
-    
-        // Increment duplicate ACK counter
-        pthread_mutex_lock(&g_vsocket_table_mutex);
-        socket_info->tcb.dup_ack = socket_info->tcb.dup_ack + 1;
-        pthread_mutex_unlock(&g_vsocket_table_mutex);
-    }
+    signalRecvEOF(socket_info);
+
+    // Send ACK, acknum is seq_rcvd+1 now that recv_eof is set
+    sendAck(socket_info);
 }
 
+
 void releaseSocketResources(int vsocket)
 {
     // Critical Section 
@@ -292,6 +1291,9 @@ void releaseSocketResources(int vsocket)
 	struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
     socket_info->quit = true;
     ptu_releasePort(socket_info->tcb.local_port);
+    sw_wakeSendThread(socket_info);
+    sw_wakeHandleThread(socket_info); // a parked thread comes back only to quit
+    pthread_cond_broadcast(&(socket_info->recv_cond));
     pthread_mutex_unlock(&g_vsocket_table_mutex);
         
     // Enqueue garbarge packet to get thread to quit
@@ -300,17 +1302,16 @@ void releaseSocketResources(int vsocket)
 }
 
 
-void* timeoutThreadFunc(void* arg)
+// TIME_WAIT is over: the socket is closed. arg is the socket id itself.
+void timeWaitTimerFunc(void* arg)
 {
-    int vsocket = *((int*)arg);
+    int vsocket = (int)(intptr_t)arg;
+    int error_code = 0;
     
-    if (pthread_mutex_trylock(&g_timeout_mutex) == LOCK_AQUIRED) {
-        sleep(60); // Sleep for 1 min 
+    if (isValidAction(vsocket, TCPA_TIMEOUT, &error_code)) {
         changeState(vsocket, TCPA_TIMEOUT);
         releaseSocketResources(vsocket);
     }
-
-    return NULL;
 }
   
 
@@ -318,6 +1319,102 @@ void* timeoutThreadFunc(void* arg)
 //      PUBLIC FUNCTIONS
 //=================================================================================================
 
+bool sw_allocSendBuffer(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->swin_buffer != NULL) {
+        return true;
+    }
+    
+    if (!mem_charge(MEM_SEND, DEFAULT_WSIZE + SEND_BURST_BYTES)) {
+        return false;
+    }
+    
+    circular_buffer_init(&(socket_info->swin_buffer), DEFAULT_WSIZE);
+    socket_info->burst_data = (char*)malloc(SEND_BURST_BYTES); // off the send thread's small stack
+    
+    // A fresh buffer starts writing at index 0, which now maps to send_next
+    // (everything before it has been ACKed, see releaseIdleSendBuffer())
+    socket_info->tcb.seq_send_init = socket_info->tcb.send_next;
+    
+    return true;
+}
+
+
+// Only in_data, rwin_buffer is allocated once out-of-order data arrives (see allocOOOBuffer())
+bool sw_allocRecvBuffers(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->in_data != NULL) {
+        return true;
+    }
+    
+    // in_data is sized to the current (auto-tuned) window
+    if (!mem_charge(MEM_RECV, socket_info->tcb.rws)) {
+        return false;
+    }
+    
+    circular_buffer_init(&(socket_info->in_data), socket_info->tcb.rws);
+        
+    // Reader must still see eof after an idle release
+    if (socket_info->recv_eof) {
+        circular_buffer_signal_eof(socket_info->in_data);
+    }
+    
+    return true;
+}
+
+
+void sw_freeSendBuffer(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->swin_buffer != NULL) {
+        circular_buffer_free(&(socket_info->swin_buffer));
+        free(socket_info->burst_data);
+        socket_info->burst_data = NULL;
+        mem_uncharge(MEM_SEND, DEFAULT_WSIZE + SEND_BURST_BYTES);
+    }
+    rack_freeRecords(socket_info);
+}
+
+
+void sw_freeRecvBuffers(struct vsocket_infoset* socket_info)
+{
+    freeOOOBuffer(socket_info);
+    
+    if (socket_info->in_data != NULL) {
+        mem_uncharge(MEM_RECV, circular_buffer_get_capacity(socket_info->in_data));
+        circular_buffer_free(&(socket_info->in_data));
+    }
+}
+
+
+// Window to advertise, clamped while the node is under memory pressure
+// WARNING: g_vsocket_table_mutex must already be acquired
+uint16_t sw_getAdvertisedWindow(struct vsocket_infoset* socket_info)
+{
+    return (uint16_t)mem_clampWindow(socket_info->tcb.ruws);
+}
+
+
+// Bytes held by a socket: the socket struct itself plus whatever buffers are currently allocated
+size_t sw_getResidentBytes(struct vsocket_infoset* socket_info)
+{
+    size_t bytes = sizeof(struct vsocket_infoset);
+    
+    if (socket_info->swin_buffer != NULL) {
+        bytes += sizeof(circular_buffer_t) + circular_buffer_get_capacity(socket_info->swin_buffer);
+        bytes += SEND_BURST_BYTES; // burst_data
+    }
+    if (socket_info->rwin_buffer != NULL) {
+        bytes += sizeof(circular_buffer_t) + circular_buffer_get_capacity(socket_info->rwin_buffer);
+        bytes += DEFAULT_WSIZE*sizeof(uint16_t); // pending_data
+    }
+    if (socket_info->in_data != NULL) {
+        bytes += sizeof(circular_buffer_t) + circular_buffer_get_capacity(socket_info->in_data);
+    }
+    
+    return bytes;
+}
+
+
 bool sw_hasSentAllData(int vsocket)
 {
     struct vsocket_infoset* socket_info=NULL;
@@ -326,7 +1423,12 @@ bool sw_hasSentAllData(int vsocket)
 	pthread_mutex_lock(&g_vsocket_table_mutex);
 	socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
     uint32_t send_next = socket_info->tcb.send_next;
+    bool has_buffer = (socket_info->swin_buffer != NULL);
     pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    if (!has_buffer) {
+        return true; // nothing was ever buffered (or all of it was ACKed and released)
+    }
                 
     uint32_t write_index = circular_buffer_get_write_index(socket_info->swin_buffer);
     uint32_t next_index = getIndexForTCBSendValue(socket_info, send_next);
@@ -350,6 +1452,12 @@ int sw_writeData(int vsocket, const unsigned char* buf, uint32_t nbyte)
         return -EBADFD; //fd in bad state
     }
     
+    if (!sw_allocSendBuffer(socket_info)) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return -ENOBUFS; //node buffer memory exhausted
+    }
+    socket_info->send_activity_us = util_getTimeUs();
+    
     sent_bytes = util_min(circular_buffer_get_available_capacity(socket_info->swin_buffer), nbyte);
     if (sent_bytes == 0) {
         // Release lock
@@ -359,6 +1467,7 @@ int sw_writeData(int vsocket, const unsigned char* buf, uint32_t nbyte)
     } else {
         int result = circular_buffer_write(socket_info->swin_buffer, (void*)buf, sent_bytes);
         assert(result == sent_bytes);
+        sw_wakeSendThread(socket_info);
     }
     
     // Release lock
@@ -375,13 +1484,109 @@ int sw_readData(int vsocket, const unsigned char* buf, uint32_t nbyte)
     // Critical Section
     pthread_mutex_lock(&g_vsocket_table_mutex);
     socket_info = (struct vsocket_infoset*)g_hash_table_lookup(s_vsocket_table, &vsocket);
-    pthread_mutex_unlock(&g_vsocket_table_mutex);
     
     if (socket_info == NULL) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
         return -ENOTSOCK; //Socket operation on non-socket
     }
+    
+    // in_data can't be released while we (possibly) block on it
+    if (!sw_allocRecvBuffers(socket_info)) {
+        bool recv_eof = socket_info->recv_eof;
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        
+        // Nothing can be buffered without in_data, so nothing is waiting to be read
+        return recv_eof ? 0 : -ENOBUFS;
+    }
+    socket_info->active_readers++;
+    
+    // Receive low-watermark: don't wake up for every small segment (in_data can't hold more than rws)
+    waitForRecvData(socket_info, util_min(util_min(socket_info->rcvlowat, nbyte), socket_info->tcb.rws));
+    
+    // Past the low-watermark timeout take whatever arrives first. in_data is only looked up now,
+    // the handle thread may have grown it while we slept (see growRecvBuffer()).
+    while (!socket_info->quit && !socket_info->recv_eof && circular_buffer_is_empty(socket_info->in_data)) {
+        socket_info->recv_push = false;
+        waitForRecvData(socket_info, 1);
+    }
+    
+    // Never blocks: there is data, or it is eof
+    circular_buffer_t* in_data = socket_info->in_data;
+    int ret = 0;
+    if (!circular_buffer_is_empty(in_data)) {
+        ret = circular_buffer_read(in_data, (void *)buf, nbyte);
+    }
+    
+    socket_info->active_readers--;
+    if (circular_buffer_is_empty(in_data)) {
+        socket_info->recv_push = false;
+    }
+    socket_info->recv_activity_us = util_getTimeUs();
+    if (ret > 0) {
+        adjustRecvSpace(socket_info, ret);
+    }
+    
+    // Reading freed space in in_data, tell the peer if the window opened far enough
+    uint32_t old_ruws = socket_info->tcb.ruws;
+    updateRecvWindow(socket_info);
+    bool send_update = (socket_info->tcb.ruws > old_ruws) && !socket_info->recv_eof;
+    
+    // The connection threads are gone and left in_data to us (see releaseThreadBuffers())
+    if (socket_info->threads_running == 0 && socket_info->active_readers == 0) {
+        sw_freeRecvBuffers(socket_info);
+        send_update = false;
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    if (send_update) {
+        // TCP window update (a pure ACK)
+        sendAck(socket_info);
+    }
+    
+    return ret;
+}
 
-    return circular_buffer_read(socket_info->in_data, (void *)buf, nbyte);
+
+// Set up what the connection threads share once the handshake is done, before they first start
+// (a thread restarted after parking finds it in place)
+// WARNING: g_vsocket_table_mutex must already be acquired
+void sw_initConnection(int vsocket, struct vsocket_infoset* socket_info)
+{
+    socket_info->start_time = util_getTimeUs();
+    cc_init(socket_info); // the MSS is negotiated by now
+    tsv_initTimer(&(socket_info->time_wait_timer), timeWaitTimerFunc, (void*)(intptr_t)vsocket);
+    tsv_initTimer(&(socket_info->pace_timer), paceTimerFunc, socket_info);
+}
+
+
+// Wake the send thread, or start it again if it parked on the idle connection
+// WARNING: g_vsocket_table_mutex must already be acquired
+void sw_wakeSendThread(struct vsocket_infoset* socket_info)
+{
+    if (!socket_info->send_parked) {
+        pthread_cond_signal(&(socket_info->send_cond));
+        return;
+    }
+    
+    struct sendFuncArg* sarg = (struct sendFuncArg*)malloc(sizeof(struct sendFuncArg));
+    sarg->socket = socket_info->vsocket;
+    socket_info->send_parked = false;
+    tcp_startSocketThread(sw_socketSendDataThreadFunc, (void*)sarg);
+}
+
+
+// Packets were queued in bq_buffer: start the handle thread again if it parked on the idle connection
+// WARNING: g_vsocket_table_mutex must already be acquired
+void sw_wakeHandleThread(struct vsocket_infoset* socket_info)
+{
+    if (!socket_info->handle_parked) {
+        return;
+    }
+    
+    struct handleFuncArg* harg = (struct handleFuncArg*)malloc(sizeof(struct handleFuncArg));
+    harg->socket = socket_info->vsocket;
+    socket_info->handle_parked = false;
+    tcp_startSocketThread(sw_socketHandlePacketThreadFunc, (void*)harg);
 }
 
 
@@ -398,110 +1603,101 @@ void* sw_socketHandlePacketThreadFunc(void* arg)
     pthread_mutex_unlock(&g_vsocket_table_mutex);    
 
     
+    struct timespec idle_timeout;
+    idle_timeout.tv_sec = BUFFER_IDLE_US/1000000;
+    idle_timeout.tv_nsec = 0;
+    
     while (!socket_info->quit) {
         
-        bqueue_dequeue(&(socket_info->bq_buffer), (void**)&ip_packet);
+        if (bqueue_timed_dequeue_rel(&(socket_info->bq_buffer), (void**)&ip_packet, &idle_timeout) != 0) {
+            pruneOOOBuffer(socket_info);
+            releaseIdleRecvBuffers(socket_info);
+            if (parkHandleThread(socket_info)) {
+                free(harg);
+                return NULL;
+            }
+            continue;
+        }
         
         if (socket_info->quit) {
             break;
         }
+        
+        pruneOOOBuffer(socket_info);
 
         tcp_packet_t* rv_tcp_packet=(tcp_packet_t*)(ip_packet->ip_data);
-        int rv_tcp_data_len=ntohs((ip_packet->ip_header).ip_len)-IP_HEADER_SIZE-TCP_HEADER_SIZE;
+        int rv_tcp_data_len=ntohs((ip_packet->ip_header).ip_len)-IP_HEADER_SIZE-tcp_getHeaderLen(rv_tcp_packet);
 
-        uint8_t recv_flag=(rv_tcp_packet->tcp_header).th_flags;
+#ifdef TCP_SEGMENT_STATS
+        uint64_t seg_start_us = util_getTimeUs();
+#endif
         
-        // Handle any data received
-        if (rv_tcp_data_len > 0) { //recv data
+        if (socket_info->ecn_ok &&
+            (IPTOS_ECN((ip_packet->ip_header).ip_tos) == IPTOS_ECN_CE ||
+             ((rv_tcp_packet->tcp_header).th_flags & (TH_ECE|TH_CWR)) != 0)) {
+            handleECN(socket_info, ip_packet, rv_tcp_packet, rv_tcp_data_len);
+        }
+        
+#ifndef TCP_NO_FAST_PATH
+        // Most segments of a bulk transfer are predicted: in-order data or a plain ACK
+        if (handleTCPFastPath(socket_info, rv_tcp_packet, rv_tcp_data_len)) {
+#ifdef TCP_SEGMENT_STATS
+            socket_info->pred_segments++;
+            socket_info->pred_time_us += util_getTimeUs() - seg_start_us;
+#endif
+            free(ip_packet);
+            continue;
+        }
+#endif
 
-            handleTCPData(socket_info, rv_tcp_packet, rv_tcp_data_len, &(ip_packet->ip_header));
-                  
-        } else {
+        uint8_t recv_flag=(rv_tcp_packet->tcp_header).th_flags;
         
-            // Handle ACK
-            if ((recv_flag & TH_ACK) != 0) {
+        // Every segment is processed in full: its ACK and window, then its data, then its FIN
+        if ((recv_flag & TH_ACK) != 0) {
 
-                handleTCPACK(socket_info, rv_tcp_packet, rv_tcp_data_len, &(ip_packet->ip_header));
-                
-                pthread_mutex_lock(&g_vsocket_table_mutex);
-                uint32_t seq_fin = socket_info->tcb.seq_fin;
-                pthread_mutex_unlock(&g_vsocket_table_mutex);
+            handleTCPACK(socket_info, rv_tcp_packet, rv_tcp_data_len, &(ip_packet->ip_header));
+            
+            pthread_mutex_lock(&g_vsocket_table_mutex);
+            uint32_t seq_fin = socket_info->tcb.seq_fin;
+            pthread_mutex_unlock(&g_vsocket_table_mutex);
 
-                // if ACK's acknum=seq_fin+1 => ACK of FIN packet received
-                if (ntohl(rv_tcp_packet->tcp_header.th_ack) == seq_fin + 1) {
-                
-                    if (isValidAction(vsocket, TCPA_RECV_ACK_FIN, &error_code)){
-                        changeState(vsocket, TCPA_RECV_ACK_FIN);
-                        
-                        // if valid action, then our state is CLOSED, and our state was LAST-ACK
-                        if (isValidAction(vsocket, TCPA_CLOSE, &error_code)) {
-                            releaseSocketResources(vsocket);
-                        }
+            // if ACK's acknum=seq_fin+1 => ACK of FIN packet received
+            if (ntohl(rv_tcp_packet->tcp_header.th_ack) == seq_fin + 1) {
+            
+                if (isValidAction(vsocket, TCPA_RECV_ACK_FIN, &error_code)){
+                    changeState(vsocket, TCPA_RECV_ACK_FIN);
+                    armTimeWait(socket_info);
+                    
+                    // if valid action, then our state is CLOSED, and our state was LAST-ACK
+                    if (isValidAction(vsocket, TCPA_CLOSE, &error_code)) {
+                        releaseSocketResources(vsocket);
                     }
-                } // end recv ACK of FIN
-
-            } // end if flag & TH_ACK
-
-            if ((recv_flag & TH_FIN) != 0) {
-        
-                if (!isValidAction(vsocket, TCPA_RECV_FIN, &error_code)){
-                    continue;
-                }
-                   
-                // Critical Section
-                pthread_mutex_lock(&g_vsocket_table_mutex);
-                socket_info->tcb.recv_fin = ntohl(rv_tcp_packet->tcp_header.th_seq);
-                uint32_t rv_fin_seqnum = socket_info->tcb.recv_fin;
-                uint32_t recv_next = socket_info->tcb.recv_next;
-                pthread_mutex_unlock(&g_vsocket_table_mutex);
-                
-                changeState(vsocket, TCPA_RECV_FIN);
-                
-                // if recv FIN seqnum == recv_next (we aren't expecting any more data)
-                // So signal_eof to in_data buffer
-                if (rv_fin_seqnum != recv_next) {
-                    continue;
                 }
+            } // end recv ACK of FIN
 
-                circular_buffer_signal_eof(socket_info->in_data);
-            
-                //Build and send ACK, acknum is seq_rcvd+1
-                tcp_packet_t ackfin_packet;
-                
-                // Critical Section
-                pthread_mutex_lock(&g_vsocket_table_mutex);
-                uint32_t saddr = socket_info->tcb.local_vip;
-                uint16_t sport = socket_info->tcb.local_port;
-                uint32_t daddr = socket_info->tcb.remote_vip;
-                uint16_t dport = socket_info->tcb.remote_port;
-                uint16_t wsize = socket_info->tcb.ruws;
-                uint32_t seqnum = socket_info->tcb.send_next;
-                  
-                if (seqnum == socket_info->tcb.seq_fin) { // We already sent FIN
-                    seqnum++;
-                }
-                   
-                pthread_mutex_unlock(&g_vsocket_table_mutex);
-                   
-                buildTCPPacket(&ackfin_packet, saddr, daddr, sport, dport, 
-                               seqnum, 1+rv_fin_seqnum, TH_ACK, wsize, NULL, 0);  
+        } // end if flag & TH_ACK
+        
+        // Handle any data received
+        if (rv_tcp_data_len > 0 && !socket_info->quit) {
+        
+            handleTCPData(socket_info, rv_tcp_packet, rv_tcp_data_len, &(ip_packet->ip_header));
+        }
 
-                tcp_sendMessage(socket_info, saddr, daddr, &ackfin_packet, TCP_HDR_SIZE);
-                 
-            } // end if flag & TH_FIN
-            
-            // Check is new state is TCPS_TIME_WAIT
-            if (isValidAction(vsocket, TCPA_TIMEOUT, &error_code)) {
-                pthread_t thread_id;
-                pthread_create(&thread_id, NULL, timeoutThreadFunc, (void*)(&vsocket));
-            }
-            
-        } // end else (not data packet)
+        if ((recv_flag & TH_FIN) != 0 && !socket_info->quit) {
+        
+            handleTCPFIN(vsocket, socket_info, rv_tcp_packet, rv_tcp_data_len);
+        }
+        
+#ifdef TCP_SEGMENT_STATS
+        socket_info->slow_segments++;
+        socket_info->slow_time_us += util_getTimeUs() - seg_start_us;
+#endif
 
         free(ip_packet);
        
     } //end while loop
     
+    releaseThreadBuffers(vsocket, socket_info);
     free(harg);
     
     return NULL;
@@ -511,115 +1707,89 @@ void* sw_socketHandlePacketThreadFunc(void* arg)
 //be responsible of sending tcp data
 void* sw_socketSendDataThreadFunc(void* arg)
 {
-    const double CLOCKS_PER_USEC = CLOCKS_PER_SEC/1000000;
-    
     struct sendFuncArg* sarg=(struct sendFuncArg*)arg;
     int vsocket = sarg->socket;
 
     // Critical Section
     pthread_mutex_lock(&g_vsocket_table_mutex);
     struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
-    socket_info->start_time = clock();
     pthread_mutex_unlock(&g_vsocket_table_mutex);
     
 
-    while (!socket_info->quit) {
+    while (true) {
             
         pthread_mutex_lock(&g_vsocket_table_mutex);
-        int dup_ack_count = socket_info->tcb.dup_ack;
+        
+        // Sleep until there is something to do: new data (sw_writeData()), an ACK or
+        // window update (handleTCPACK()), or one of the timers
+        uint64_t wakeup_us = 0;
+        while (!socket_info->quit && !checkSendWork(socket_info, &wakeup_us)) {
+            // No timer left and the buffer released: an idle established connection needs no
+            // send thread until sw_wakeSendThread() starts a new one
+            if (wakeup_us == 0 && socket_info->swin_buffer == NULL && socket_info->state == TCPS_ESTAB) {
+                socket_info->send_parked = true;
+                pthread_mutex_unlock(&g_vsocket_table_mutex);
+                free(sarg);
+                return NULL;
+            }
+            waitForSendWork(socket_info, wakeup_us);
+        }
+        
+        if (socket_info->quit) {
+            pthread_mutex_unlock(&g_vsocket_table_mutex);
+            break;
+        }
+        
+        uint64_t now = util_getTimeUs();
         uint32_t send_next = socket_info->tcb.send_next;
         uint32_t send_unack = socket_info->tcb.send_unack;
-        uint16_t remote_ruws = socket_info->tcb.remote_ruws;
-        clock_t start_time = socket_info->start_time;
-        double rto_us = socket_info->rto_us;
+        uint64_t persist_time_us = socket_info->persist_time_us;
+        uint64_t tlp_time_us = socket_info->tlp_time_us;
+        
+        // Handle six things:
+        // #1 - if (timeout) back off and retransmit from send_unack, reset timer (the persist
+        //      timer takes over while the window is closed)
+        if (persist_time_us == 0 && send_next != send_unack && now >= rack_getRTOTime(socket_info)) {
+            rack_onRTO(socket_info);
+            socket_info->start_time = now;
+            tlp_time_us = 0;
+        }
         pthread_mutex_unlock(&g_vsocket_table_mutex);
         
-        // Handle three things:
-        // #1 - if (timeout) retransmit, reset timer
-        if ((double)(clock()-start_time)/(CLOCKS_PER_USEC) > (2*rto_us)) {
-            
-            if (send_next != send_unack) {
-            
-                uint32_t data_len = util_min((send_next - send_unack), TCP_MTU);
-                
-                uint32_t unack_index = getIndexForTCBSendValue(socket_info, send_unack);
-                // Retransmit
-                transmitUnACKedData(socket_info, unack_index, data_len, send_unack, false);
-            }
-            
-            // Critical Section
-            pthread_mutex_lock(&g_vsocket_table_mutex);
-            socket_info->exp_acknum = 0;
-            socket_info->start_time = clock();
-            pthread_mutex_unlock(&g_vsocket_table_mutex);
+        // #2 - retransmit the segments RACK (or the RTO) found lost
+        retransmitLostData(socket_info);
+        
+        // #3 - if (tail loss probe timer expired) probe with new data or the last segment
+        if (persist_time_us == 0 && tlp_time_us != 0 && now >= tlp_time_us) {
+            sendLossProbe(socket_info);
         }
         
-        // #2 - if (dup_ack == 3) retransmit, reset timer and dup_ack
-        if (dup_ack_count >= 3) {
-            // Critical Section
-            pthread_mutex_lock(&g_vsocket_table_mutex);
-            socket_info->tcb.dup_ack = 0;
-            pthread_mutex_unlock(&g_vsocket_table_mutex);
-            
-            uint32_t data_len = util_min((send_next - send_unack), TCP_MTU);
-            
-            if (data_len != 0) {
-            
-                uint32_t unack_index = getIndexForTCBSendValue(socket_info, send_unack);
-	            // Retransmit
-                transmitUnACKedData(socket_info, unack_index, data_len, send_unack, false);
-            
-                // Critical Section
-                pthread_mutex_lock(&g_vsocket_table_mutex);
-                socket_info->start_time = clock();
-                socket_info->exp_acknum = 0;
-                pthread_mutex_unlock(&g_vsocket_table_mutex);
-            
-            }
-        }      
+        // #4 - if (persist timer expired) probe the closed window
+        if (persist_time_us != 0 && now >= persist_time_us) {
+            sendWindowProbe(socket_info);
+        }
 
-        // #3 - send new data, update send_next
+        releaseIdleSendBuffer(socket_info);
+
+        // #5 - send a burst of new data within the peer's window, update send_next (the segments carry any pending ACK)
+        transmitNewData(socket_info, false);
+        
+        // #6 - delayed ACK timer expired with no data to carry the ACK, send it on its own
         // Critical Section
         pthread_mutex_lock(&g_vsocket_table_mutex);
-        send_next = socket_info->tcb.send_next;
-        send_unack = socket_info->tcb.send_unack;
-        uint32_t write_index = circular_buffer_get_write_index(socket_info->swin_buffer);
+        bool ack_due = socket_info->delack_time_us != 0 && util_getTimeUs() >= socket_info->delack_time_us;
         pthread_mutex_unlock(&g_vsocket_table_mutex);
         
-        uint32_t next_index = getIndexForTCBSendValue(socket_info, send_next);
-        if (write_index != next_index) {
-
-            uint32_t data_len = 0;
-        
-            if (write_index > next_index) {
-                data_len = write_index - next_index;
-            }
-            if (write_index < next_index) {
-                data_len = write_index + (DEFAULT_WSIZE - next_index);
-            } 
-            data_len = util_min(data_len, util_min(remote_ruws, TCP_MTU));
-         
-            // Update send_next
-            pthread_mutex_lock(&g_vsocket_table_mutex);
-            socket_info->tcb.send_next = send_next + data_len;
-            pthread_mutex_unlock(&g_vsocket_table_mutex);
-            
-            transmitUnACKedData(socket_info, next_index, data_len, send_next, true);
-            
-        } else if (send_next == send_unack && circular_buffer_is_full(socket_info->swin_buffer)) {
-            
-            uint32_t data_len = util_min(remote_ruws, TCP_MTU);
-            
-            // Update send_next
-            pthread_mutex_lock(&g_vsocket_table_mutex);
-            socket_info->tcb.send_next = send_next + data_len;
-            pthread_mutex_unlock(&g_vsocket_table_mutex);
-           
-            transmitUnACKedData(socket_info, next_index, data_len, send_next, false);
+        if (ack_due) {
+            sendAck(socket_info);
         }
         
     } // end while()
     
+    tsv_cancel(&(socket_info->pace_timer));
+    releaseThreadBuffers(vsocket, socket_info);
+    free(sarg);
+    
     return NULL;
 }
 
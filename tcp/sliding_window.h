@@ -25,6 +25,8 @@ struct sendFuncArg{
    int socket;
 };
 
+struct vsocket_infoset;
+
 
 //=================================================================================================
 //      GLOBAL VARIABLES
@@ -36,10 +38,24 @@ struct sendFuncArg{
 
 bool sw_hasSentAllData(int vsocket);
 
+// Lazy buffer management. Caller must hold g_vsocket_table_mutex.
+bool sw_allocSendBuffer(struct vsocket_infoset* socket_info);
+bool sw_allocRecvBuffers(struct vsocket_infoset* socket_info);
+void sw_freeSendBuffer(struct vsocket_infoset* socket_info);
+void sw_freeRecvBuffers(struct vsocket_infoset* socket_info);
+uint16_t sw_getAdvertisedWindow(struct vsocket_infoset* socket_info);
+
+size_t sw_getResidentBytes(struct vsocket_infoset* socket_info);
+
 int sw_writeData(int vsocket, const unsigned char* buf, uint32_t nbyte);
 
 int sw_readData(int vsocket, const unsigned char* buf, uint32_t nbyte);
 
+// Caller must hold g_vsocket_table_mutex.
+void sw_initConnection(int vsocket, struct vsocket_infoset* socket_info);
+void sw_wakeSendThread(struct vsocket_infoset* socket_info);
+void sw_wakeHandleThread(struct vsocket_infoset* socket_info);
+
 void* sw_socketHandlePacketThreadFunc(void* arg);
 
 void* sw_socketSendDataThreadFunc(void* arg);
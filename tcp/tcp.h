@@ -36,7 +36,7 @@
 
 #define __FAVOR_BSD 
 
-typedef	u_long	tcp_seq;
+typedef	uint32_t	tcp_seq;
 /*
  * TCP header.
  * Per RFC 793, September, 1981.
@@ -10,6 +10,8 @@
 #include "sliding_window.h"
 #include "tcp_util.h"
 #include "port_util.h"
+#include "rack.h"
+#include "congestion.h"
 #include "util/circular_buffer.h"
 #include <errno.h>
 #include <assert.h>
@@ -28,6 +30,11 @@
 
 #define K 4 // Used in RTO calculation
 
+#define MSS_CACHE_TIMEOUT_US    600000000ULL    // re-derive a destination's MSS after 10 minutes (routes change)
+
+#define GRO_MAX_FLOWS           8       // flows coalesced at the same time within a receive burst
+#define GRO_MAX_SEGMENTS        16      // most segments merged into one unit
+
 //=================================================================================================
 //      GLOBAL VARIABLES
 //=================================================================================================
@@ -38,14 +45,54 @@ GHashTable* s_vsocket_table=NULL;
 
 
 static int g_highest_vsocket=VSOCKET_STARTER;
-pthread_t g_thread_id;
 
-static double CLOCKS_PER_USEC = CLOCKS_PER_SEC/1000000;
+// Mutex to protect s_mss_cache
+static pthread_mutex_t g_mss_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable* s_mss_cache=NULL;    //key is remote vip, value is struct mss_cache_entry
+
+struct mss_cache_entry {
+    uint16_t mss;
+    uint64_t time_us;
+};
+
+// Receive coalescing (software GRO): consecutive in-order segments of a flow arriving in one
+// receive burst are merged into one unit before they are queued for the socket
+struct gro_flow {
+    struct vsocket_infoset* socket_info;    //NULL when the slot is free
+    ip_packet_t* ip_packet;                 //unit merged so far
+    int segments;
+    tcp_seq recv_edge;                      //right edge of the receive window, units never grow past it
+};
+
+// Mutex to protect s_gro_flows (packets may be delivered by the input thread and, to local VIPs, by send threads)
+static pthread_mutex_t g_gro_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct gro_flow s_gro_flows[GRO_MAX_FLOWS];
+
+// A thread in v_poll() (or a blocking v_connect()) registers one entry with each socket it
+// waits on, and is only woken by those sockets once they are ready (see tcp_wakePollers())
+struct poll_waiter {
+    pthread_cond_t cond;                    //waited on with g_vsocket_table_mutex
+};
+
+struct poll_entry {
+    struct poll_waiter* waiter;
+    struct vsocket_infoset* socket_info;
+    short events;
+};
+
+pthread_t g_thread_id;
 
 //=================================================================================================
 //      PRIVATE FUNCTIONS
 //=================================================================================================
 
+// A segment dropped by our own interface queue was still sent as far as the handshake is
+// concerned: it is retransmitted like one lost on the way
+bool sendFailed(int result)
+{
+    return result != SENT_IP_PACKET && result != LOCAL_DROP;
+}
+
 void dropFromSocketTable(int vsocket)
 {
     pthread_mutex_lock(&g_vsocket_table_mutex);
@@ -86,6 +133,193 @@ void releaseSocket(int vsocket, bool release_port)
 }
 
 
+// MSS toward daddr: the outgoing link's MTU less the IP and TCP headers, so that every
+// segment is sent in exactly one link frame. Cached per destination.
+uint16_t getRouteMSS(uint32_t daddr)
+{
+    uint64_t now = util_getTimeUs();
+    
+    // Critical Section
+    pthread_mutex_lock(&g_mss_cache_mutex);
+    struct mss_cache_entry* entry = g_hash_table_lookup(s_mss_cache, &daddr);
+    if (entry != NULL && now - entry->time_us < MSS_CACHE_TIMEOUT_US) {
+        uint16_t mss = entry->mss;
+        pthread_mutex_unlock(&g_mss_cache_mutex);
+        return mss;
+    }
+    pthread_mutex_unlock(&g_mss_cache_mutex);
+    
+    size_t mtu = net_getMTUTowardDestination(daddr);
+    if (mtu <= IP_HEADER_SIZE + TCP_HEADER_SIZE) { // No route
+        return TCP_DEFAULT_MSS;
+    }
+    uint16_t mss = util_min(mtu - IP_HEADER_SIZE - TCP_HEADER_SIZE, TCP_MTU);
+    
+    // Critical Section
+    pthread_mutex_lock(&g_mss_cache_mutex);
+    entry = g_hash_table_lookup(s_mss_cache, &daddr);
+    if (entry == NULL) {
+        uint32_t* key = (uint32_t*)malloc(sizeof(uint32_t));
+        *key = daddr;
+        entry = (struct mss_cache_entry*)malloc(sizeof(struct mss_cache_entry));
+        g_hash_table_insert(s_mss_cache, key, entry);
+    }
+    entry->mss = mss;
+    entry->time_us = now;
+    pthread_mutex_unlock(&g_mss_cache_mutex);
+    
+    return mss;
+}
+
+
+// Segment size for a connection: the smaller of our route's MSS and the peer's MSS option.
+// A peer MSS below TCP_MIN_MSS is raised to it, it would make us send a flood of tiny segments.
+uint16_t negotiateMSS(uint16_t route_mss, tcp_packet_t* syn_packet)
+{
+    uint16_t peer_mss = tcp_getMSSOption(syn_packet);
+    if (peer_mss == 0) {
+        peer_mss = TCP_DEFAULT_MSS;
+    } else if (peer_mss < TCP_MIN_MSS) {
+        peer_mss = TCP_MIN_MSS;
+    }
+    
+    return util_min(route_mss, peer_mss);
+}
+
+
+size_t getTCPDataLen(ip_packet_t* ip_packet)
+{
+    return ntohs(ip_packet->ip_header.ip_len) - IP_HEADER_BYTES - tcp_getHeaderLen((tcp_packet_t*)(ip_packet->ip_data));
+}
+
+
+// Only plain data segments are coalesced: ACK (and PUSH) set, no options. Pure ACKs must stay
+// separate, they count as duplicate ACKs and window updates.
+bool isCoalescable(ip_packet_t* ip_packet)
+{
+    tcp_packet_t* tcp_packet = (tcp_packet_t*)(ip_packet->ip_data);
+    
+    return ((tcp_packet->tcp_header.th_flags & ~TH_PUSH) == TH_ACK &&
+            tcp_getHeaderLen(tcp_packet) == TCP_HEADER_SIZE &&
+            getTCPDataLen(ip_packet) > 0);
+}
+
+
+// Queue a unit for the socket's handle thread, starting it again if it parked on the idle connection
+void queueTCPPacket(struct vsocket_infoset* socket_info, ip_packet_t* ip_packet)
+{
+    bqueue_enqueue(&(socket_info->bq_buffer), ip_packet);
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    sw_wakeHandleThread(socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
+
+// Hand the merged unit of flow to its socket and free the slot
+// WARNING: g_gro_mutex must already be acquired (it is taken before g_vsocket_table_mutex)
+void flushGROFlow(struct gro_flow* flow)
+{
+    queueTCPPacket(flow->socket_info, flow->ip_packet);
+    flow->socket_info = NULL;
+    flow->ip_packet = NULL;
+    flow->segments = 0;
+}
+
+
+// Append ip_packet to the unit held for flow if it directly follows it with the same ACK and window,
+// and the unit still fits in the receive window (handleTCPData() drops a unit that doesn't fit)
+// WARNING: g_gro_mutex must already be acquired
+bool mergeIntoGROFlow(struct gro_flow* flow, ip_packet_t* ip_packet)
+{
+    tcp_packet_t* held = (tcp_packet_t*)(flow->ip_packet->ip_data);
+    tcp_packet_t* tcp_packet = (tcp_packet_t*)(ip_packet->ip_data);
+    size_t held_len = getTCPDataLen(flow->ip_packet);
+    size_t data_len = getTCPDataLen(ip_packet);
+    
+    if (flow->segments >= GRO_MAX_SEGMENTS ||
+        ntohs(flow->ip_packet->ip_header.ip_len) + data_len > IP_MAX_PACKET_SIZE ||
+        ntohl(tcp_packet->tcp_header.th_seq) != ntohl(held->tcp_header.th_seq) + held_len ||
+        ntohl(tcp_packet->tcp_header.th_seq) + data_len > flow->recv_edge ||
+        tcp_packet->tcp_header.th_ack != held->tcp_header.th_ack ||
+        tcp_packet->tcp_header.th_win != held->tcp_header.th_win) {
+        return false;
+    }
+    
+    // The checksums were verified per segment, the merged unit's is not used again
+    memcpy(tcp_getData(held) + held_len, tcp_getData(tcp_packet), data_len);
+    flow->ip_packet->ip_header.ip_len = htons(ntohs(flow->ip_packet->ip_header.ip_len) + data_len);
+    held->tcp_header.th_flags |= tcp_packet->tcp_header.th_flags;
+    if (IPTOS_ECN(ip_packet->ip_header.ip_tos) == IPTOS_ECN_CE) {
+        flow->ip_packet->ip_header.ip_tos |= IPTOS_ECN_CE; // a mark on any piece is a mark on the unit
+    }
+    flow->segments++;
+    
+    return true;
+}
+
+
+// Queue ip_packet for the socket, or hold it to be merged with the next segments of the burst.
+// recv_edge is the right edge of the window we advertised (recv_next + ruws).
+void coalesceTCPPacket(struct vsocket_infoset* socket_info, ip_packet_t* ip_packet, tcp_seq recv_edge)
+{
+    int index;
+    struct gro_flow* flow = NULL;
+    struct gro_flow* free_slot = NULL;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_gro_mutex);
+    for (index = 0; index < GRO_MAX_FLOWS; index++) {
+        if (s_gro_flows[index].socket_info == socket_info) {
+            flow = &(s_gro_flows[index]);
+        } else if (s_gro_flows[index].socket_info == NULL && free_slot == NULL) {
+            free_slot = &(s_gro_flows[index]);
+        }
+    }
+    
+    bool coalescable = isCoalescable(ip_packet);
+    
+    if (flow != NULL) {
+        flow->recv_edge = recv_edge;
+        if (coalescable && mergeIntoGROFlow(flow, ip_packet)) {
+            pthread_mutex_unlock(&g_gro_mutex);
+            free(ip_packet);
+            return;
+        }
+        
+        // Keep the flow's segments in order: what was held goes first
+        flushGROFlow(flow);
+        free_slot = flow;
+    }
+    
+    if (coalescable && free_slot != NULL) {
+        free_slot->socket_info = socket_info;
+        free_slot->ip_packet = ip_packet;
+        free_slot->segments = 1;
+        free_slot->recv_edge = recv_edge;
+    } else {
+        queueTCPPacket(socket_info, ip_packet);
+    }
+    pthread_mutex_unlock(&g_gro_mutex);
+}
+
+
+// Start a connection thread on a small, detached stack: nobody joins these threads. Also
+// used to restart a thread that parked on an idle connection (see sw_wakeSendThread()).
+void tcp_startSocketThread(void* (*thread_func)(void*), void* arg)
+{
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&thread_attr, SOCKET_THREAD_STACK_SIZE);
+    
+    pthread_create(&g_thread_id, &thread_attr, thread_func, arg);
+    
+    pthread_attr_destroy(&thread_attr);
+}
+
+
 void createSocketThreadFuncs(int vsocket) {
                 
     struct handleFuncArg* harg = (struct handleFuncArg*)malloc(sizeof(struct handleFuncArg));
@@ -93,13 +327,319 @@ void createSocketThreadFuncs(int vsocket) {
     struct sendFuncArg* sarg = (struct sendFuncArg*)malloc(sizeof(struct sendFuncArg));
     sarg->socket=vsocket;
     
-    pthread_create(&g_thread_id, NULL, sw_socketHandlePacketThreadFunc, (void*)harg);
-    pthread_create(&g_thread_id, NULL, sw_socketSendDataThreadFunc, (void*)sarg);
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
+    socket_info->threads_running = 2;
+    sw_initConnection(vsocket, socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    // Neither thread stays around for long on an idle connection, they park (exit) and are
+    // started again by the next packet or wakeup
+    tcp_startSocketThread(sw_socketHandlePacketThreadFunc, (void*)harg);
+    tcp_startSocketThread(sw_socketSendDataThreadFunc, (void*)sarg);
                     
     return;
 }
 
 
+// Send (again) the handshake segment of an active open: the SYN, or the SYN-ACK once a
+// simultaneous open crossed it
+int sendSynSegment(struct vsocket_infoset* socket_info)
+{
+    tcp_packet_t tcp_packet;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    uint32_t saddr = socket_info->tcb.local_vip;
+    uint32_t daddr = socket_info->tcb.remote_vip;
+    uint16_t sport = socket_info->tcb.local_port;
+    uint16_t dport = socket_info->tcb.remote_port;
+    uint16_t wsize = socket_info->tcb.rws;
+    tcp_seq seqnum = socket_info->syn_seq;
+    tcp_seq acknum = socket_info->syn_ack;
+    uint8_t flags = socket_info->syn_flags;
+    uint16_t route_mss = socket_info->syn_route_mss;
+    uint8_t tos = TCP_CONTROL_TOS(socket_info->tos);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    buildTCPSynPacket(&tcp_packet, saddr, daddr, sport, dport, seqnum, acknum, flags, wsize, route_mss);
+    
+    //NOTE: no tcp payload, size of tcp_packet=tcp_header (with options)
+    return net_sendMessage(saddr, daddr, TCP_PROTOCOL, tos, (char*)&tcp_packet, tcp_getHeaderLen(&tcp_packet));
+}
+
+
+// Take over a pending active open to finish or fail it: only one of the input thread, the
+// SYN timer and v_close() gets it. The caller cancels syn_timer once the lock is released,
+// tsv_cancel() waits for a running synTimerFunc() which takes the lock.
+// WARNING: g_vsocket_table_mutex must already be acquired
+bool claimActiveOpen(struct vsocket_infoset* socket_info)
+{
+    if (!socket_info->connecting) {
+        return false;
+    }
+    
+    socket_info->connecting = false;
+    return true;
+}
+
+
+// Fail an active open claimed by the caller with error (negative errno): the socket is CLOSED
+// again with its address and port released, and v_poll() reports V_POLLERR
+void failActiveOpen(struct vsocket_infoset* socket_info, int error)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    socket_info->connect_error = error;
+    socket_info->state = TCPS_CLOSED;
+    uint32_t local_vip = socket_info->tcb.local_vip;
+    uint16_t local_port = socket_info->tcb.local_port;
+    uint32_t remote_vip = socket_info->tcb.remote_vip;
+    uint16_t remote_port = socket_info->tcb.remote_port;
+    tcp_wakePollers(socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    ptu_removeSocketAddr(local_vip, local_port, remote_vip, remote_port);
+    ptu_releasePort(local_port);
+}
+
+
+// Fail a pending active open (see failActiveOpen()). Returns false if the handshake was
+// already over.
+bool abortActiveOpen(struct vsocket_infoset* socket_info, int error)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    bool claimed = claimActiveOpen(socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    if (claimed) {
+        tsv_cancel(&(socket_info->syn_timer));
+        failActiveOpen(socket_info, error);
+    }
+    return claimed;
+}
+
+
+// SYN retransmission timer (runs on the timer thread): send the handshake segment again and
+// double the timeout, give up after SYN_MAX_RETRIES
+void synTimerFunc(void* arg)
+{
+    struct vsocket_infoset* socket_info = (struct vsocket_infoset*)arg;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    if (!socket_info->connecting) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return;
+    }
+    if (socket_info->syn_retries == SYN_MAX_RETRIES) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        // error code: Timer expired
+        abortActiveOpen(socket_info, -ETIME);
+        return;
+    }
+    socket_info->syn_retries++;
+    tsv_schedule(&(socket_info->syn_timer), util_getTimeUs() + (SYN_TIMEOUT_US << socket_info->syn_retries));
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    if (sendFailed(sendSynSegment(socket_info))) {
+        //error code: Communication error on send
+        abortActiveOpen(socket_info, -ECOMM);
+    }
+}
+
+
+// Set up the TCB of a connection leaving SYN_SENT/SYN_RCVD from the peer's segment (the caller
+// moves it to ESTAB)
+// WARNING: g_vsocket_table_mutex must already be acquired
+void setupActiveOpenTCB(struct vsocket_infoset* socket_info, tcp_packet_t* recv_tcp_packet,
+                        uint16_t mss, tcp_seq seq_recv_init)
+{
+    // Set Send Window Size and MSS
+    socket_info->tcb.sws = ntohs(recv_tcp_packet->tcp_header.th_win);
+    socket_info->tcb.mss = mss;
+    // Set seq send & recv values (from received packet)
+    socket_info->tcb.seq_send_init = ntohl((recv_tcp_packet->tcp_header).th_ack);
+    socket_info->tcb.send_next = socket_info->tcb.seq_send_init;
+    socket_info->tcb.send_unack = socket_info->tcb.seq_send_init;
+    socket_info->tcb.seq_recv_init = seq_recv_init;
+    socket_info->tcb.recv_next = socket_info->tcb.seq_recv_init;
+    socket_info->tcb.dup_ack = 0;
+    socket_info->tcb.remote_ruws = ntohs(recv_tcp_packet->tcp_header.th_win);
+    socket_info->tcb.max_sndwnd = socket_info->tcb.remote_ruws;
+}
+
+
+// Handshake segment for a socket in v_connect(), handled right here on the input thread (there
+// is no handle thread yet). Segments the handshake doesn't expect are dropped. Returns false if
+// the socket isn't connecting.
+bool continueActiveOpen(int vsocket, struct vsocket_infoset* socket_info, ip_packet_t* ip_packet)
+{
+    tcp_packet_t* recv_tcp_packet = (tcp_packet_t*)ip_packet->ip_data;
+    uint8_t ecn_flags = (recv_tcp_packet->tcp_header).th_flags & (TH_ECE|TH_CWR);
+    uint8_t recv_flag = (recv_tcp_packet->tcp_header).th_flags & ~(TH_ECE|TH_CWR);
+    tcp_seq recv_seq = ntohl(recv_tcp_packet->tcp_header.th_seq);
+    tcp_seq recv_ack = ntohl(recv_tcp_packet->tcp_header.th_ack);
+    int error_code = 0;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    if (!socket_info->connecting) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return false;
+    }
+    tcp_seq syn_seq = socket_info->syn_seq;
+    tcp_seq syn_ack = socket_info->syn_ack;
+    uint32_t saddr = socket_info->tcb.local_vip;
+    uint32_t daddr = socket_info->tcb.remote_vip;
+    uint16_t sport = socket_info->tcb.local_port;
+    uint16_t dport = socket_info->tcb.remote_port;
+    uint16_t wsize = socket_info->tcb.rws;
+    uint8_t tos = TCP_CONTROL_TOS(socket_info->tos);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    if (recv_flag == TH_SYN+TH_ACK && isValidAction(vsocket, TCPA_RECV_SYN_ACK, &error_code)) { //from SYN_SENT-> ESTAB
+    
+        // Check for correct ack number
+        if (recv_ack != syn_seq+1) {
+            return true;
+        }
+        
+        // Critical Section
+        pthread_mutex_lock(&g_vsocket_table_mutex);
+        // Claimed before the ACK goes out: once the peer has it, the connection must not be
+        // given up here (the SYN timer or v_close() may have done so meanwhile)
+        if (!claimActiveOpen(socket_info)) {
+            pthread_mutex_unlock(&g_vsocket_table_mutex);
+            return true;
+        }
+        uint16_t mss = negotiateMSS(socket_info->syn_route_mss, recv_tcp_packet);
+        setupActiveOpenTCB(socket_info, recv_tcp_packet, mss, recv_seq + 1);
+        socket_info->ecn_ok = socket_info->ecn && ecn_flags == TH_ECE;
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        tsv_cancel(&(socket_info->syn_timer));
+        
+        tcp_packet_t tcp_packet;
+        buildTCPPacket(&tcp_packet, saddr, daddr, sport, dport, recv_ack, recv_seq + 1, TH_ACK, wsize, NULL, 0);
+        
+        // Send ACK of SYN-ACK
+        //NOTE: no tcp payload, size of tcp_packet=tcp_header
+        if (sendFailed(net_sendMessage(saddr, daddr, TCP_PROTOCOL, tos, (char*)&tcp_packet, sizeof(struct tcphdr)))) {
+            //error code: Communication error on send
+            failActiveOpen(socket_info, -ECOMM);
+            return true;
+        }
+        
+        changeState(vsocket, TCPA_RECV_SYN_ACK);
+        
+    } else if (recv_flag == TH_SYN && isValidAction(vsocket, TCPA_RECV_SYN, &error_code)) { //simult connect, from SYN_SENT->SYN_RCVD
+    
+        // Critical Section
+        pthread_mutex_lock(&g_vsocket_table_mutex);
+        if (!socket_info->connecting) {
+            pthread_mutex_unlock(&g_vsocket_table_mutex);
+            return true;
+        }
+        // From now on the SYN timer retransmits the SYN-ACK
+        socket_info->syn_seq = rand()%MAX_SEQACK_NUM; //random generated seq number
+        socket_info->syn_ack = recv_seq + 1;
+        socket_info->syn_flags = TH_SYN+TH_ACK;
+        socket_info->syn_mss = negotiateMSS(socket_info->syn_route_mss, recv_tcp_packet);
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        changeState(vsocket, TCPA_RECV_SYN);
+        
+        if (sendFailed(sendSynSegment(socket_info))) {
+            // error code: Communication error on send
+            abortActiveOpen(socket_info, -ECOMM);
+        }
+        return true;
+        
+    } else if (recv_flag == TH_ACK && isValidAction(vsocket, TCPA_RECV_ACK, &error_code)) { //from SYN_RCVD -> ESTAB
+    
+        // Check for correct ack and sequence numbers
+        if (recv_ack != syn_seq+1 || recv_seq != syn_ack) {
+            return true;
+        }
+        
+        // Critical Section
+        pthread_mutex_lock(&g_vsocket_table_mutex);
+        if (!claimActiveOpen(socket_info)) {
+            pthread_mutex_unlock(&g_vsocket_table_mutex);
+            return true;
+        }
+        // MSS from the SYN received before, length of packet is zero
+        setupActiveOpenTCB(socket_info, recv_tcp_packet, socket_info->syn_mss, recv_seq);
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        changeState(vsocket, TCPA_RECV_ACK);
+        tsv_cancel(&(socket_info->syn_timer));
+        
+    } else { // Packet didn't have correct flags (not a handshake packet)
+        return true;
+    }
+    
+    // Create logger
+    lgr_open(vsocket);
+    
+    //connection established, create send and handle thread function
+    createSocketThreadFuncs(vsocket);
+    
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    tcp_wakePollers(socket_info);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    return true;
+}
+
+
+// WARNING: g_vsocket_table_mutex must already be acquired
+void addPollEntry(struct poll_entry* entry)
+{
+    entry->socket_info->poll_entries = g_list_prepend(entry->socket_info->poll_entries, entry);
+}
+
+
+// WARNING: g_vsocket_table_mutex must already be acquired
+void removePollEntry(struct poll_entry* entry)
+{
+    entry->socket_info->poll_entries = g_list_remove(entry->socket_info->poll_entries, entry);
+}
+
+
+// Readiness of one socket for v_poll()
+// WARNING: g_vsocket_table_mutex must already be acquired
+short getPollEvents(struct vsocket_infoset* socket_info)
+{
+    short revents = 0;
+    
+    if (socket_info->connect_error != 0) {
+        revents |= V_POLLERR;
+    }
+    if (socket_info->connecting) {
+        return revents;
+    }
+    
+    if (socket_info->state == TCPS_LISTEN) {
+        // v_accept() runs the handshake of the queued SYN
+        if (!bqueue_empty(&(socket_info->bq_buffer))) {
+            revents |= V_POLLIN;
+        }
+        return revents;
+    }
+    
+    if (socket_info->recv_eof ||
+        (socket_info->in_data != NULL && circular_buffer_get_size(socket_info->in_data) > 0)) {
+        revents |= V_POLLIN;
+    }
+    if ((socket_info->state == TCPS_ESTAB || socket_info->state == TCPS_CLOSE_WAIT) &&
+        (socket_info->swin_buffer == NULL ||
+         circular_buffer_get_available_capacity(socket_info->swin_buffer) >= POLL_WRITE_LOWAT)) {
+        revents |= V_POLLOUT;
+    }
+    return revents;
+}
+
+
 //=================================================================================================
 //      PUBLIC FUNCTIONS
 //=================================================================================================
@@ -108,32 +648,50 @@ void createSocketThreadFuncs(int vsocket) {
 void tcp_initialSetUp()
 {
     s_vsocket_table=g_hash_table_new(g_int_hash, g_int_equal);
+    s_mss_cache=g_hash_table_new(g_int_hash, g_int_equal);
+    tsv_init();
 }
 
 
-int tcp_sendMessage(struct vsocket_infoset* socket_info, uint32_t saddr, uint32_t daddr, 
+// Returns the result of net_sendMessage()
+int tcp_sendMessage(struct vsocket_infoset* socket_info, uint32_t saddr, uint32_t daddr, uint8_t tos,
                     tcp_packet_t* tcp_packet, size_t packet_len)
 {
     struct timespec timestamp;
     clock_gettime(CLOCK_MONOTONIC, &timestamp);
 
     lgr_storeSendPacket(socket_info, &timestamp, tcp_packet, packet_len);
-    if (net_sendMessage(saddr, daddr, TCP_PROTOCOL, (char*)tcp_packet, packet_len) != true) {
-        return false;
-    }
+    return net_sendMessage(saddr, daddr, TCP_PROTOCOL, tos, (char*)tcp_packet, packet_len);
+}
+
+
+// Send new data of one connection as a super-segment, split into MSS sized segments only by
+// the network layer (software GSO). Only new data is sent with an ECN codepoint in tos, pure
+// ACKs and retransmissions (tcp_sendMessage()) never are (RFC 3168 6.1.4/6.1.5). Returns the
+// result of net_sendMessageGSO().
+int tcp_sendSuperSegment(struct vsocket_infoset* socket_info, uint32_t saddr, uint32_t daddr, uint8_t tos,
+                         tcp_super_segment_t* super_segment)
+{
+    struct timespec timestamp;
+    clock_gettime(CLOCK_MONOTONIC, &timestamp);
     
-    return true;
+    // Logged once, the logger only reads the header
+    lgr_storeSendPacket(socket_info, &timestamp, (tcp_packet_t*)&(super_segment->header),
+                        sizeof(struct tcphdr)+super_segment->data_len);
+    
+    return net_sendMessageGSO(saddr, daddr, TCP_PROTOCOL, tos, super_segment, tcp_segmentSuperSegment);
 }
 
 
 void tcp_handleTCPPacket(ip_packet_t* ip_packet)
 {
-    clock_t receipt_time = clock(); // used for RTO
+    uint64_t receipt_time = util_getTimeUs(); // used for RTO
     struct timespec timestamp;
     clock_gettime(CLOCK_MONOTONIC, &timestamp);
     
+    // Full size, coalesced segments are appended to it (see coalesceTCPPacket())
     ip_packet_t* cp_ip_packet = (ip_packet_t*)malloc(sizeof(ip_packet_t));  
-    memcpy(cp_ip_packet, ip_packet, sizeof(ip_packet_t));
+    memcpy(cp_ip_packet, ip_packet, ntohs(ip_packet->ip_header.ip_len));
 
     tcp_packet_t* tcp_packet = (tcp_packet_t*)(cp_ip_packet->ip_data);
     
@@ -160,8 +718,20 @@ void tcp_handleTCPPacket(ip_packet_t* ip_packet)
     uint16_t checksum=tcp_checksum(tcp_w_pseudo, tcp_w_pseudo_len);
     if (checksum != 0) {
        printf("warning!, checksum is not 0 but %u! tcp packet dropped\n", checksum);
+       free(cp_ip_packet);
        return;
     }
+    
+    // The data offset must cover the fixed header and stay within the segment, everything
+    // below (options, tcp_getData()) trusts it
+    if (tcp_packet_len < TCP_HEADER_SIZE ||
+        (tcp_packet->tcp_header).th_off < TCP_HEADER_SIZE/4 ||
+        tcp_getHeaderLen(tcp_packet) > (size_t)tcp_packet_len) {
+        
+        printf("warning!, bad tcp data offset! tcp packet dropped\n");
+        free(cp_ip_packet);
+        return;
+    }
 
     struct tcphdr tcp_header=tcp_packet->tcp_header;
     uint16_t local_port=ntohs(tcp_header.th_dport);
@@ -174,6 +744,7 @@ void tcp_handleTCPPacket(ip_packet_t* ip_packet)
            printf("no socket are for port %u !\n", local_port);
            ptu_printAddrTup2Socket();
            
+           free(cp_ip_packet);
            return;
         }
     }
@@ -185,6 +756,7 @@ void tcp_handleTCPPacket(ip_packet_t* ip_packet)
     if (socket_info == NULL) {
         printf("socket %d is not registered with a state !\n", vsocket);
         tcp_printSockets();
+        free(cp_ip_packet);
         return;
     }
     
@@ -193,8 +765,9 @@ void tcp_handleTCPPacket(ip_packet_t* ip_packet)
     
     // Critical Section
     pthread_mutex_lock(&g_vsocket_table_mutex);
-    if (socket_info->exp_acknum == acknum) {
-        double r = (double)(receipt_time - socket_info->send_time)/CLOCKS_PER_USEC;
+    // The first ACK covering the timed segment ends the sample (ACKs are cumulative and may be delayed)
+    if ((tcp_header.th_flags & TH_ACK) != 0 && socket_info->exp_acknum != 0 && acknum >= socket_info->exp_acknum) {
+        double r = (double)(receipt_time - socket_info->send_time);
         
         if (!(socket_info->first_measure)) { // Normal case
         
@@ -212,14 +785,62 @@ void tcp_handleTCPPacket(ip_packet_t* ip_packet)
         socket_info->rto_us = socket_info->srtt_us + util_max(1000, K*socket_info->rttvar_us);
         
         socket_info->exp_acknum = 0;
-        
-    } else if (socket_info->exp_acknum < acknum) { // Missed expected ACK, reset
-        socket_info->exp_acknum = 0;
     }
+    bool connecting = socket_info->connecting;
+    bool listening = (socket_info->state == TCPS_LISTEN);
+    tcp_seq recv_edge = socket_info->tcb.recv_next + socket_info->tcb.ruws;
     pthread_mutex_unlock(&g_vsocket_table_mutex);    
     
     lgr_storeRecvPacket(socket_info, &timestamp, tcp_packet, tcp_packet_len);
-    bqueue_enqueue(&(socket_info->bq_buffer), cp_ip_packet);
+    
+    if (connecting && continueActiveOpen(vsocket, socket_info, cp_ip_packet)) {
+        free(cp_ip_packet);
+        return;
+    }
+    
+    coalesceTCPPacket(socket_info, cp_ip_packet, recv_edge);
+    
+    if (listening) { // a connection request for v_accept()
+        pthread_mutex_lock(&g_vsocket_table_mutex);
+        tcp_wakePollers(socket_info);
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+    }
+}
+
+
+// The readiness of socket_info may have changed: wake the threads waiting in v_poll() on it
+// for an event it is now ready for. Nothing to do unless someone waits on this socket.
+// WARNING: g_vsocket_table_mutex must already be acquired
+void tcp_wakePollers(struct vsocket_infoset* socket_info)
+{
+    if (socket_info->poll_entries == NULL) {
+        return;
+    }
+    
+    short revents = getPollEvents(socket_info);
+    GList* node;
+    for (node = socket_info->poll_entries; node != NULL; node = node->next) {
+        struct poll_entry* entry = (struct poll_entry*)node->data;
+        if ((revents & (entry->events | V_POLLERR)) != 0) {
+            pthread_cond_signal(&(entry->waiter->cond));
+        }
+    }
+}
+
+
+// End of a receive burst (see util_callFlushHandlers()): queue every unit still held
+void tcp_flushCoalescedPackets(void)
+{
+    int index;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_gro_mutex);
+    for (index = 0; index < GRO_MAX_FLOWS; index++) {
+        if (s_gro_flows[index].socket_info != NULL) {
+            flushGROFlow(&(s_gro_flows[index]));
+        }
+    }
+    pthread_mutex_unlock(&g_gro_mutex);
 }
 
 
@@ -227,24 +848,31 @@ int v_socket()
 {
     g_highest_vsocket++;
     
-    struct vsocket_infoset* vsocket_info=(struct vsocket_infoset*)malloc(sizeof(struct vsocket_infoset)); 
-    memset((char*)vsocket_info, 0, sizeof(vsocket_info));
+    // Cache line aligned so the sections of different writer threads never share a line
+    struct vsocket_infoset* vsocket_info=(struct vsocket_infoset*)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct vsocket_infoset)); 
+    memset((char*)vsocket_info, 0, sizeof(struct vsocket_infoset));
 
     //initial set up of tcb's info
+    vsocket_info->vsocket = g_highest_vsocket;
     vsocket_info->state=TCPS_CLOSED;
     
     vsocket_info->rto_us = 3000000; // 3 seconds
     vsocket_info->first_measure = true;    
     
+    vsocket_info->tcb.mss = TCP_MTU;
+    vsocket_info->tcb.rws = RECV_WSIZE_INIT;
+    vsocket_info->tcb.ruws = RECV_WSIZE_INIT;
+    vsocket_info->rcvbuf_max = DEFAULT_WSIZE;
+    vsocket_info->rcvlowat = 1;
+    vsocket_info->ecn = true;
+    
     // Initialize bqueue
     bqueue_init(&(vsocket_info->bq_buffer));
+    pthread_cond_init(&(vsocket_info->send_cond), NULL);
+    pthread_cond_init(&(vsocket_info->recv_cond), NULL);
+    tsv_initTimer(&(vsocket_info->syn_timer), synTimerFunc, vsocket_info);
 
-    //initialize circular buffer
-    circular_buffer_init(&(vsocket_info->swin_buffer), DEFAULT_WSIZE);
-    circular_buffer_init(&(vsocket_info->rwin_buffer), DEFAULT_WSIZE);
-    circular_buffer_init(&(vsocket_info->in_data), DEFAULT_WSIZE*2);//in_data doesn't have to the same as sw wsize
-    
-    memset(vsocket_info->pending_data, 0, DEFAULT_WSIZE*sizeof(int));
+    // NOTE: circular buffers are allocated on first use (sw_allocSendBuffer/sw_allocRecvBuffers)
     
     int* newsocket=(int*)malloc(sizeof(int));
     *newsocket=g_highest_vsocket;
@@ -262,7 +890,43 @@ void printSocketStatePair(gpointer socket, gpointer socket_info)
     TCP_State_t state=((struct vsocket_infoset*)socket_info)->state;
     printf("socket %d -> state: ", *((int*)socket));
     printStateAsString(state);
-    printf("\n");
+    printf(", resident: %zu bytes\n", sw_getResidentBytes((struct vsocket_infoset*)socket_info));
+    
+    struct vsocket_infoset* info = (struct vsocket_infoset*)socket_info;
+#ifdef TCP_SEGMENT_STATS
+    if (info->pred_segments + info->slow_segments > 0) {
+        printf("    header prediction: %" PRIu64 " fast (%.2f us/segment), %" PRIu64 " slow (%.2f us/segment)\n",
+               info->pred_segments, info->pred_segments ? (double)info->pred_time_us/info->pred_segments : 0.0,
+               info->slow_segments, info->slow_segments ? (double)info->slow_time_us/info->slow_segments : 0.0);
+    }
+#endif
+    if (info->cwnd != 0) {
+        printf("    congestion: %s, cwnd %u, pipe %u", cc_getName(info->cc_kind), info->cwnd, cc_getPipe(info));
+        if (info->cc_kind == TCP_CC_BBR) {
+            printf(", bandwidth %" PRIu64 " B/s, min rtt %" PRIu64 " us", info->bbr.btl_bw, info->bbr.min_rtt_us);
+        } else if (info->ssthresh != UINT32_MAX) {
+            printf(", ssthresh %u", info->ssthresh);
+        }
+        if (info->fixed_pacing_rate != 0) {
+            printf(", pacing %" PRIu64 " B/s (fixed)", info->fixed_pacing_rate);
+        } else if (info->pacing_rate != 0) {
+            printf(", pacing %" PRIu64 " B/s", info->pacing_rate);
+        }
+        if (info->max_rate != 0) {
+            printf(", max rate %" PRIu64 " B/s", info->max_rate);
+        }
+        printf("\n");
+    }
+    if (info->retrans_segments + info->tlp_probes > 0) {
+        printf("    retransmitted: %u segments, %u tail loss probes, %u timeouts, %u spurious recoveries undone\n",
+               info->retrans_segments, info->tlp_probes, info->rto_timeouts, info->spurious_undos);
+    }
+    if (info->ecn_ok) {
+        printf("    ecn: %u CE marks received, %u window reductions\n", info->ecn_ce_received, info->ecn_reductions);
+    }
+    if (info->local_drops > 0) {
+        printf("    dropped locally: %u segments\n", info->local_drops);
+    }
 }
 
 void tcp_printSockets(void)
@@ -294,6 +958,37 @@ void tcp_printSocketWindowsSizes(int vsocket)
     printf("------End Windows-----\n\n");
 }
 
+// Rate cap of one socket (a negative vsocket prints every capped socket)
+void printRateLimitPair(gpointer key, gpointer value, gpointer vsocket)
+{
+    struct vsocket_infoset* info = (struct vsocket_infoset*)value;
+    int socket = *(int*)key;
+    int wanted = *(int*)vsocket;
+    
+    if ((wanted >= 0 && socket != wanted) || (wanted < 0 && info->max_rate == 0)) {
+        return;
+    }
+    
+    if (info->max_rate == 0) {
+        printf("socket %d: unlimited\n", socket);
+        return;
+    }
+    printf("socket %d: max rate %" PRIu64 " B/s, %" PRId64 " bytes in bucket, drained %u times\n",
+           socket, info->max_rate, info->rate_tokens, info->rate_limited);
+}
+
+void tcp_printRateLimits(int vsocket)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    
+    printf("\n------Rate Limits-----\n");
+    g_hash_table_foreach(s_vsocket_table, (GHFunc)printRateLimitPair, &vsocket);
+    printf("------End Rate Limits-----\n\n");
+    
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+}
+
 void tcp_printSocketRecvWin(int vsocket, bool non_read_only)
 {
     struct vsocket_infoset* socket_info = NULL;
@@ -303,6 +998,11 @@ void tcp_printSocketRecvWin(int vsocket, bool non_read_only)
     socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
     pthread_mutex_unlock(&g_vsocket_table_mutex);
     
+    if (socket_info == NULL || socket_info->rwin_buffer == NULL) {
+        printf("socket %d has no receive window allocated\n", vsocket);
+        return;
+    }
+    
     if (non_read_only) {
         circular_buffer_print_unread_contents(socket_info->rwin_buffer);
     } else {
@@ -330,7 +1030,6 @@ int v_connect(int vsocket, struct in_addr* addr, uint16_t port)
         return error_code;
     }
    
-    tcp_packet_t tcp_packet;
     uint32_t daddr=addr->s_addr;
     ushort dport=port;
 
@@ -346,11 +1045,13 @@ int v_connect(int vsocket, struct in_addr* addr, uint16_t port)
     tcp_seq seqnum = rand()%MAX_SEQACK_NUM;
     tcp_seq ack = rand()%MAX_SEQACK_NUM;
 
-    u_short wsize=DEFAULT_WSIZE;
-   
-    //build packet with no tcp data and //print
-    buildTCPPacket(&tcp_packet, saddr, daddr, sport, dport, seqnum, ack, TH_SYN, wsize, NULL, 0);
+    u_short wsize=RECV_WSIZE_INIT;
+    uint16_t route_mss=getRouteMSS(daddr);
     
+    ptu_addSocketAtAddr(saddr, sport, daddr, dport, vsocket);
+    
+    changeState(vsocket, TCPA_ACTIVE_OPEN);
+   
     // Critical Section
     pthread_mutex_lock(&g_vsocket_table_mutex);
     // Setup TCB
@@ -362,185 +1063,54 @@ int v_connect(int vsocket, struct in_addr* addr, uint16_t port)
     socket_info->tcb.rws = wsize;
     socket_info->tcb.ruws = wsize;
     socket_info->tcb.remote_ruws = 0;
+    //SYN with no tcp data (only the MSS option)
+    //ECN-setup SYN: ECE and CWR both set (RFC 3168 6.1.1)
+    socket_info->syn_seq = seqnum;
+    socket_info->syn_ack = ack;
+    socket_info->syn_flags = TH_SYN + (socket_info->ecn ? TH_ECE+TH_CWR : 0);
+    socket_info->syn_route_mss = route_mss;
+    socket_info->syn_retries = 0;
+    socket_info->connect_error = 0;
+    socket_info->connecting = true;
+    tsv_schedule(&(socket_info->syn_timer), util_getTimeUs() + SYN_TIMEOUT_US);
+    bool nonblock = socket_info->nonblock;
     pthread_mutex_unlock(&g_vsocket_table_mutex);
-    
-    ptu_addSocketAtAddr(saddr, sport, daddr, dport, vsocket);
 
     //1. send SYN packet
-    //NOTE: no tcp payload, size of tcp_packet=tcp_header
-    if (net_sendMessage(saddr, daddr, TCP_PROTOCOL, (char*)&tcp_packet, sizeof(struct tcphdr)) != true) {
+    if (sendFailed(sendSynSegment(socket_info))) {
         //error code: Communication error on send
-        releaseSocket(vsocket, true);
+        abortActiveOpen(socket_info, -ECOMM);
+        dropFromSocketTable(vsocket);
         return -ECOMM;
     }
     
-    changeState(vsocket, TCPA_ACTIVE_OPEN);
+    // The rest of the handshake runs on the input thread and the SYN timer
+    if (nonblock) {
+        return -EINPROGRESS; // v_poll() reports V_POLLOUT once connected, V_POLLERR if it failed
+    }
     
-    int retry = 0;
-    int seconds = 1;
-    struct timespec timeout;
-    timeout.tv_sec = seconds;
-    timeout.tv_nsec = 0;
- 
-    bool quit = false;
-    while (!quit) {
+    // Wait like v_poll() for V_POLLOUT (connected) or V_POLLERR
+    struct poll_waiter waiter;
+    pthread_cond_init(&(waiter.cond), NULL);
+    struct poll_entry entry = { &waiter, socket_info, V_POLLOUT };
     
-        ip_packet_t* ip_packet = NULL;
-        
-        int ret = bqueue_timed_dequeue_rel(&(socket_info->bq_buffer), (void**)&ip_packet, &timeout);
-        //printf("ret: %d\n", ret);
-        if (ret == -ETIMEDOUT) {
-            if (retry == 3) {
-                // error code: Timer expired 
-                releaseSocket(vsocket, true);
-                return -ETIME;
-            }
-            retry++;
-            seconds *= 2; // Double timeout
-            timeout.tv_sec = seconds; 
-            //1. send SYN packet
-            //NOTE: no tcp payload, size of tcp_packet=tcp_header
-            if (net_sendMessage(saddr, daddr, TCP_PROTOCOL, (char*)&tcp_packet, sizeof(struct tcphdr)) != true) {
-                //error code: Communication error on send 
-                releaseSocket(vsocket, true);
-                return -ECOMM;
-            }
-            continue;
-        } else if (ret == -EINVAL) {
-            return ret;
-        }
-        
-        
-        tcp_packet_t* recv_tcp_packet = NULL;
-        recv_tcp_packet = (tcp_packet_t*)ip_packet->ip_data;
-        
-        uint8_t recv_flag=(recv_tcp_packet->tcp_header).th_flags;
-        
-        // Continue handshake 
-        if (recv_flag==TH_SYN+TH_ACK) { //from SYN_SENT-> ESTAB
-        
-            // Check valid state for send SYN
-            if (isValidAction(vsocket, TCPA_RECV_SYN_ACK, &error_code) == false) {
-                releaseSocket(vsocket, true);
-                return error_code;
-            }
-            
-            // Check for correct ack number
-            if (ntohl(recv_tcp_packet->tcp_header.th_ack) != seqnum+1) {
-                //printf("incorrect ack!\n");
-                continue;
-            }
-            
-            // Critical Section
-            pthread_mutex_lock(&g_vsocket_table_mutex);
-            socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
-            // Set Send Window Size (from received packet)
-            socket_info->tcb.sws = ntohs(recv_tcp_packet->tcp_header.th_win);
-            // Set seq send & recv values (from received packet)
-            socket_info->tcb.seq_send_init = ntohl((recv_tcp_packet->tcp_header).th_ack);
-            socket_info->tcb.send_next = socket_info->tcb.seq_send_init;
-            socket_info->tcb.send_unack = socket_info->tcb.seq_send_init;
-            socket_info->tcb.seq_recv_init = ntohl(recv_tcp_packet->tcp_header.th_seq) + 1;
-            socket_info->tcb.recv_next = socket_info->tcb.seq_recv_init;
-            socket_info->tcb.dup_ack = 0;
-            socket_info->tcb.remote_ruws =ntohs(recv_tcp_packet->tcp_header.th_win);
-            pthread_mutex_unlock(&g_vsocket_table_mutex);
-            
-            buildTCPPacket(&tcp_packet, saddr, daddr, sport, dport,     
-                           ntohl(recv_tcp_packet->tcp_header.th_ack), 
-                           ntohl(recv_tcp_packet->tcp_header.th_seq) + 1, TH_ACK, wsize, NULL, 0);
-                
-            // Send ACK of SYN-ACK
-            //NOTE: no tcp payload, size of tcp_packet=tcp_header
-            if (net_sendMessage(saddr, daddr, TCP_PROTOCOL, (char*)&tcp_packet, sizeof(struct tcphdr)) != true) {
-                //rror code: Communication error on send
-                releaseSocket(vsocket, true);
-                return -ECOMM;
-            }
-            
-            // Create logger
-            lgr_open(vsocket);
-            
-            changeState(vsocket, TCPA_RECV_SYN_ACK);
-            //connection established, create send and handle thread function
-            createSocketThreadFuncs(vsocket);
-            
-            quit = true;
-        }
-        else if (recv_flag==TH_SYN) {//simult connect, from SYN_SENT->SYN_RCVD
-        
-            // Check valid state for send SYN
-            if (isValidAction(vsocket, TCPA_RECV_SYN, &error_code) == false) {
-                releaseSocket(vsocket, true);
-                return error_code;
-            }
-            
-            buildTCPPacket(&tcp_packet, saddr, daddr, sport, dport,     
-                           rand()%MAX_SEQACK_NUM, //random generated seq number
-                           ntohl(recv_tcp_packet->tcp_header.th_seq) + 1, TH_SYN+TH_ACK, wsize, NULL, 0);
-            
-            //NOTE: no tcp payload, size of tcp_packet=tcp_header
-            if (net_sendMessage(ntohl(ip_packet->ip_header.ip_dst), ntohl(ip_packet->ip_header.ip_src),
-                                TCP_PROTOCOL, (char*)&tcp_packet, sizeof(struct tcphdr)) != true) {
-                // error code: Communication error on send
-                releaseSocket(vsocket, true);
-                return -ECOMM;
-            }
-            
-            changeState(vsocket, TCPA_RECV_SYN);
-            
-            // Change last sequence and ack numbers
-            seqnum = ntohl(tcp_packet.tcp_header.th_seq);
-            ack = ntohl(tcp_packet.tcp_header.th_ack);
-	    }
-	    else if (recv_flag==TH_ACK) {
-	
-	        // Check valid state for send SYN
-            if (isValidAction(vsocket, TCPA_RECV_ACK, &error_code) == false) {
-                releaseSocket(vsocket, true);
-                return error_code;
-            }
-            
-            // Check for correct ack number
-            if (tcp_packet.tcp_header.th_ack != htonl(seqnum+1)) {
-                continue;
-
-            }
-            // Check for correct sequence number
-            if (tcp_packet.tcp_header.th_seq != htonl(ack)) {
-                continue;
-            }
-            
-            // Critical Section
-            pthread_mutex_lock(&g_vsocket_table_mutex);
-            socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
-            // Set Send Window Size (from received packet)
-            socket_info->tcb.sws = ntohs(recv_tcp_packet->tcp_header.th_win);
-            // Set seq send & recv values (from received packet)
-            socket_info->tcb.seq_send_init = ntohl((recv_tcp_packet->tcp_header).th_ack);
-            socket_info->tcb.send_next = socket_info->tcb.seq_send_init;
-            socket_info->tcb.send_unack = socket_info->tcb.seq_send_init;
-            socket_info->tcb.seq_recv_init = ntohl(recv_tcp_packet->tcp_header.th_seq); // Length of packet is zero
-            socket_info->tcb.recv_next = socket_info->tcb.seq_recv_init;
-            socket_info->tcb.remote_ruws = ntohs(recv_tcp_packet->tcp_header.th_win);
-            socket_info->tcb.dup_ack = 0;
-            pthread_mutex_unlock(&g_vsocket_table_mutex);
-            
-            // Create logger
-            lgr_open(vsocket);
-            
-            changeState(vsocket, TCPA_RECV_ACK);
-
-            //connection established, create send and handle thread function
-            createSocketThreadFuncs(vsocket);
-
-            quit = true;
-        }
-        else { // Packet didn't have correct flags (not a handshake packet)
-            continue;
-        }
-        
-    } // end while()
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    addPollEntry(&entry);
+    // Claimed but not over yet while still in SYN_SENT/SYN_RCVD
+    while (socket_info->connecting || socket_info->state == TCPS_SYN_SENT || socket_info->state == TCPS_SYN_RCVD) {
+        pthread_cond_wait(&(waiter.cond), &g_vsocket_table_mutex);
+    }
+    removePollEntry(&entry);
+    error_code = socket_info->connect_error;
+    socket_info->connect_error = 0;
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    pthread_cond_destroy(&(waiter.cond));
+    
+    if (error_code != 0) {
+        dropFromSocketTable(vsocket);
+        return error_code;
+    }
     
     return SUCCESS;
 }
@@ -649,7 +1219,8 @@ int v_accept(int vsocket, struct in_addr* node)
 
         tcp_packet_t* tcp_packet=(tcp_packet_t*)ip_packet->ip_data;
 
-        uint8_t recv_flag=(tcp_packet->tcp_header).th_flags;
+        uint8_t ecn_flags=(tcp_packet->tcp_header).th_flags & (TH_ECE|TH_CWR);
+        uint8_t recv_flag=(tcp_packet->tcp_header).th_flags & ~(TH_ECE|TH_CWR);
         if (recv_flag==TH_SYN) { //client request new connection through listen socket
             
             recv_connection = true;
@@ -660,6 +1231,7 @@ int v_accept(int vsocket, struct in_addr* node)
             uint16_t local_port = ntohs((tcp_packet->tcp_header).th_dport);
             uint32_t remote_vip = ntohl((ip_packet->ip_header).ip_src);
             uint16_t remote_port = ntohs((tcp_packet->tcp_header).th_sport);
+            uint16_t route_mss = getRouteMSS(remote_vip);
                 
             pthread_mutex_lock(&g_vsocket_table_mutex);
             entry_ptr = (struct vsocket_infoset*)g_hash_table_lookup(s_vsocket_table, &newsocket);
@@ -668,9 +1240,22 @@ int v_accept(int vsocket, struct in_addr* node)
             entry_ptr->tcb.local_port = local_port;
             entry_ptr->tcb.remote_vip = remote_vip;
             entry_ptr->tcb.remote_port = remote_port;
-            entry_ptr->tcb.rws = DEFAULT_WSIZE;
-            entry_ptr->tcb.ruws = DEFAULT_WSIZE;
             entry_ptr->tcb.sws = ntohs(tcp_packet->tcp_header.th_win);
+            entry_ptr->tcb.mss = negotiateMSS(route_mss, tcp_packet);
+            entry_ptr->rcvbuf_max = listen_socket_info->rcvbuf_max; // options are inherited from the listener
+            entry_ptr->nodelay = listen_socket_info->nodelay;
+            entry_ptr->rcvlowat = listen_socket_info->rcvlowat;
+            entry_ptr->cc_kind = listen_socket_info->cc_kind;
+            entry_ptr->fixed_pacing_rate = listen_socket_info->fixed_pacing_rate;
+            cc_setMaxRate(entry_ptr, listen_socket_info->max_rate);
+            entry_ptr->ecn = listen_socket_info->ecn;
+            entry_ptr->tos = listen_socket_info->tos;
+            entry_ptr->nonblock = listen_socket_info->nonblock;
+            uint8_t tos = TCP_CONTROL_TOS(entry_ptr->tos);
+            // ECN-setup SYN carries ECE and CWR, the SYN-ACK agrees with ECE alone (RFC 3168 6.1.1)
+            entry_ptr->ecn_ok = entry_ptr->ecn && ecn_flags == (TH_ECE|TH_CWR);
+            uint8_t syn_ack_flags = TH_SYN+TH_ACK + (entry_ptr->ecn_ok ? TH_ECE : 0);
+            uint16_t wsize = entry_ptr->tcb.rws;
             pthread_mutex_unlock(&g_vsocket_table_mutex); 
                 
             ptu_addSocketAtAddr(local_vip, local_port, remote_vip, remote_port, newsocket);
@@ -681,12 +1266,12 @@ int v_accept(int vsocket, struct in_addr* node)
             uint32_t seqnum = rand()%MAX_SEQACK_NUM;
             uint32_t acknum = ntohl(tcp_packet->tcp_header.th_seq)+1;
               
-            buildTCPPacket(&syn_ack_packet, ntohl(ip_packet->ip_header.ip_dst), ntohl(ip_packet->ip_header.ip_src), 
-                           ntohs(tcp_packet->tcp_header.th_dport), ntohs(tcp_packet->tcp_header.th_sport), 
-                           seqnum, acknum, TH_SYN+TH_ACK, ntohs(tcp_packet->tcp_header.th_win), NULL, 0);
+            buildTCPSynPacket(&syn_ack_packet, ntohl(ip_packet->ip_header.ip_dst), ntohl(ip_packet->ip_header.ip_src), 
+                              ntohs(tcp_packet->tcp_header.th_dport), ntohs(tcp_packet->tcp_header.th_sport), 
+                              seqnum, acknum, syn_ack_flags, wsize, route_mss);
 
-            if (net_sendMessage(ntohl(ip_packet->ip_header.ip_dst), ntohl(ip_packet->ip_header.ip_src),
-                                TCP_PROTOCOL, (char*)&syn_ack_packet, sizeof(struct tcphdr)) != true) {
+            if (sendFailed(net_sendMessage(ntohl(ip_packet->ip_header.ip_dst), ntohl(ip_packet->ip_header.ip_src),
+                                TCP_PROTOCOL, tos, (char*)&syn_ack_packet, tcp_getHeaderLen(&syn_ack_packet)))) {
                 //error code: Communication error on send
                 releaseSocket(newsocket, false); // Don't release port (used by listen socket)
                 return -ECOMM;
@@ -724,7 +1309,7 @@ int v_accept(int vsocket, struct in_addr* node)
     
         tcp_packet_t* tcp_packet=(tcp_packet_t*)ip_packet->ip_data;
 
-        uint8_t recv_flag=(tcp_packet->tcp_header).th_flags;
+        uint8_t recv_flag=(tcp_packet->tcp_header).th_flags & ~(TH_ECE|TH_CWR);
         if (recv_flag==TH_ACK) {
          
             if (!isValidAction(newsocket, TCPA_RECV_ACK, &error_code)) { //check valid action before checking ack number
@@ -746,6 +1331,7 @@ int v_accept(int vsocket, struct in_addr* node)
                 (entry_ptr->tcb).recv_next = (entry_ptr->tcb).seq_recv_init;
                 (entry_ptr->tcb).dup_ack = 0;
                 (entry_ptr->tcb).remote_ruws =ntohs(tcp_packet->tcp_header.th_win);
+                (entry_ptr->tcb).max_sndwnd = (entry_ptr->tcb).remote_ruws;
                 pthread_mutex_unlock(&g_vsocket_table_mutex); 
                 
                 // Create logger
@@ -859,14 +1445,19 @@ int v_shutdown(int vsocket, int type)
             uint32_t daddr = socket_info->tcb.remote_vip;
             uint16_t dport = socket_info->tcb.remote_port;
             uint32_t acknum = socket_info->tcb.recv_next;
-            uint16_t wsize = socket_info->tcb.ruws;      
+            uint16_t wsize = sw_getAdvertisedWindow(socket_info);
             uint32_t rv_fin_seqnum = socket_info->tcb.recv_fin;
             uint32_t recv_next = socket_info->tcb.recv_next;
             uint32_t seqnum = socket_info->tcb.send_next;
+            uint8_t tos = socket_info->tos;
             
             socket_info->tcb.seq_fin = seqnum;
             socket_info->tcb.send_next = socket_info->tcb.send_next + 1; // Increment send_next
-            circular_buffer_increment_write_pointer(socket_info->swin_buffer, 1);
+            if (socket_info->swin_buffer != NULL) {
+                circular_buffer_increment_write_pointer(socket_info->swin_buffer, 1);
+            }
+            rack_onTransmit(socket_info, seqnum, 1, util_getTimeUs()); // retransmitted like data until ACKed
+            sw_wakeSendThread(socket_info); // for its retransmission timer, the thread may have parked
             pthread_mutex_unlock(&g_vsocket_table_mutex);
             // End Critical Section
                    
@@ -878,7 +1469,7 @@ int v_shutdown(int vsocket, int type)
      
             buildTCPPacket(&tcp_packet, saddr, daddr, sport, dport, seqnum, acknum, TH_FIN+TH_ACK, wsize, NULL, 0);
                     
-            tcp_sendMessage(socket_info, saddr, daddr, &tcp_packet, TCP_HEADER_SIZE);
+            tcp_sendMessage(socket_info, saddr, daddr, tos, &tcp_packet, TCP_HEADER_SIZE);
 
             changeState(vsocket, TCPA_SEND_FIN);
                    
@@ -897,6 +1488,17 @@ int v_shutdown(int vsocket, int type)
 int v_close(int vsocket)
 {  
 	int error_code;
+    
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    // A non-blocking v_connect() still in its handshake is simply abandoned
+    if (socket_info != NULL && abortActiveOpen(socket_info, -ECONNABORTED)) {
+        dropFromSocketTable(vsocket);
+        return 0;
+    }
+    
 	if (isValidAction(vsocket, TCPA_CLOSE, &error_code)){
 	    changeState(vsocket, TCPA_CLOSE);
         return 0;
@@ -911,6 +1513,259 @@ int v_close(int vsocket)
 }
 
 
+/* Wait until one of the sockets in fds is ready for the events asked for, or timeout_ms
+   passed (-1 = no timeout, 0 = just check). Sets revents of every entry and returns the
+   number of entries with any set, 0 on timeout. V_POLLERR and V_POLLNVAL are always
+   reported. */
+int v_poll(struct v_pollfd* fds, int nfds, int timeout_ms)
+{
+    int index;
+    int ready = 0;
+    struct timespec deadline;
+    
+    if (timeout_ms > 0) {
+        // pthread_cond_timedwait() takes an absolute CLOCK_REALTIME time
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t nsec = deadline.tv_nsec + (uint64_t)timeout_ms*1000000;
+        deadline.tv_sec += nsec/1000000000;
+        deadline.tv_nsec = nsec%1000000000;
+    }
+    
+    struct poll_waiter waiter;
+    pthread_cond_init(&(waiter.cond), NULL);
+    struct poll_entry* entries = (struct poll_entry*)calloc(nfds, sizeof(struct poll_entry));
+    bool registered = false;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    while (true) {
+        ready = 0;
+        for (index = 0; index < nfds; index++) {
+            struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &(fds[index].vsocket));
+            
+            if (socket_info == NULL) {
+                fds[index].revents = V_POLLNVAL;
+            } else {
+                fds[index].revents = getPollEvents(socket_info) & (fds[index].events | V_POLLERR);
+            }
+            if (fds[index].revents != 0) {
+                ready++;
+            }
+        }
+        
+        if (ready > 0 || timeout_ms == 0) {
+            break;
+        }
+        
+        // Only the sockets waited on wake us up, each once it is ready
+        if (!registered) {
+            for (index = 0; index < nfds; index++) {
+                entries[index].waiter = &waiter;
+                entries[index].socket_info = g_hash_table_lookup(s_vsocket_table, &(fds[index].vsocket));
+                entries[index].events = fds[index].events;
+                addPollEntry(&(entries[index]));
+            }
+            registered = true;
+        }
+        
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&(waiter.cond), &g_vsocket_table_mutex);
+        } else if (pthread_cond_timedwait(&(waiter.cond), &g_vsocket_table_mutex, &deadline) == ETIMEDOUT) {
+            timeout_ms = 0; // one last look
+        }
+    }
+    
+    // Sockets are never freed, so those closed meanwhile still hold their entry
+    if (registered) {
+        for (index = 0; index < nfds; index++) {
+            removePollEntry(&(entries[index]));
+        }
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    free(entries);
+    pthread_cond_destroy(&(waiter.cond));
+    
+    return ready;
+}
+
+
+/* Set a per-socket option (see TCP_Option_t). Sockets returned by v_accept()
+   inherit the options of the listening socket. */
+int v_setsockopt(int vsocket, TCP_Option_t option, int value)
+{
+    int ret = 0;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
+    
+    if (socket_info == NULL) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return -EBADF;
+    }
+    
+    switch (option) {
+        case TCPO_RCVBUF_MAX:
+            // No window scaling, so the window can't go past DEFAULT_WSIZE (a lower
+            // limit only stops further growth, the window is never shrunk)
+            if (value <= 0 || value > DEFAULT_WSIZE) {
+                ret = -EINVAL;
+                break;
+            }
+            socket_info->rcvbuf_max = value;
+            break;
+            
+        case TCPO_RCVBUF:
+        case TCPO_MAXSEG:
+        case TCPO_ERROR:
+            ret = -EPERM; // read only
+            break;
+            
+        case TCPO_NODELAY:
+            socket_info->nodelay = (value != 0);
+            sw_wakeSendThread(socket_info); // held back data may go now
+            break;
+            
+        case TCPO_RCVLOWAT:
+            if (value <= 0 || value > DEFAULT_WSIZE) {
+                ret = -EINVAL;
+                break;
+            }
+            socket_info->rcvlowat = value;
+            pthread_cond_broadcast(&(socket_info->recv_cond)); // a lower mark may already be met
+            break;
+            
+        case TCPO_CONGESTION:
+            if (value < 0 || value >= TCP_CC_KINDS) {
+                ret = -EINVAL;
+                break;
+            }
+            socket_info->cc_kind = value;
+            cc_init(socket_info); // the new algorithm starts over from the initial window
+            sw_wakeSendThread(socket_info);
+            break;
+            
+        case TCPO_PACING_RATE:
+            if (value < 0) {
+                ret = -EINVAL;
+                break;
+            }
+            socket_info->fixed_pacing_rate = value;
+            socket_info->pace_time_us = 0; // the next segment is paced at the new rate
+            sw_wakeSendThread(socket_info);
+            break;
+            
+        case TCPO_MAX_RATE:
+            if (value < 0) {
+                ret = -EINVAL;
+                break;
+            }
+            cc_setMaxRate(socket_info, value);
+            sw_wakeSendThread(socket_info);
+            break;
+            
+        case TCPO_ECN:
+            socket_info->ecn = (value != 0); // takes effect with the next handshake
+            break;
+            
+        case TCPO_DSCP:
+            if (value < 0 || value > (IPTOS_DSCP_MASK >> 2)) {
+                ret = -EINVAL;
+                break;
+            }
+            socket_info->tos = value << 2;
+            break;
+            
+        case TCPO_NONBLOCK:
+            socket_info->nonblock = (value != 0);
+            break;
+            
+        default:
+            ret = -ENOPROTOOPT;
+            break;
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    return ret;
+}
+
+
+int v_getsockopt(int vsocket, TCP_Option_t option, int* value)
+{
+    int ret = 0;
+    
+    // Critical Section
+    pthread_mutex_lock(&g_vsocket_table_mutex);
+    struct vsocket_infoset* socket_info = g_hash_table_lookup(s_vsocket_table, &vsocket);
+    
+    if (socket_info == NULL) {
+        pthread_mutex_unlock(&g_vsocket_table_mutex);
+        return -EBADF;
+    }
+    
+    switch (option) {
+        case TCPO_RCVBUF:
+            *value = socket_info->tcb.rws;
+            break;
+            
+        case TCPO_RCVBUF_MAX:
+            *value = socket_info->rcvbuf_max;
+            break;
+            
+        case TCPO_NODELAY:
+            *value = socket_info->nodelay;
+            break;
+            
+        case TCPO_MAXSEG:
+            *value = socket_info->tcb.mss;
+            break;
+            
+        case TCPO_RCVLOWAT:
+            *value = socket_info->rcvlowat;
+            break;
+            
+        case TCPO_CONGESTION:
+            *value = socket_info->cc_kind;
+            break;
+            
+        case TCPO_PACING_RATE: {
+            uint64_t rate = cc_getPacingRate(socket_info); // the rate in use, fixed or derived
+            *value = (rate > INT32_MAX) ? INT32_MAX : (int)rate;
+            break;
+        }
+            
+        case TCPO_MAX_RATE:
+            *value = (int)socket_info->max_rate;
+            break;
+            
+        case TCPO_ECN:
+            *value = socket_info->ecn;
+            break;
+            
+        case TCPO_DSCP:
+            *value = socket_info->tos >> 2;
+            break;
+            
+        case TCPO_NONBLOCK:
+            *value = socket_info->nonblock;
+            break;
+            
+        case TCPO_ERROR:
+            *value = socket_info->connect_error;
+            socket_info->connect_error = 0;
+            break;
+            
+        default:
+            ret = -ENOPROTOOPT;
+            break;
+    }
+    pthread_mutex_unlock(&g_vsocket_table_mutex);
+    
+    return ret;
+}
+
+
 //=================================================================================================
 //      END OF FILE
 //=================================================================================================
@@ -10,6 +10,7 @@
 #include "tcp_util.h"
 #include "state_machine.h"
 #include "logger.h"
+#include "timer_service.h"
 #include "util/bqueue.h"
 #include "util/circular_buffer.h"
 #include <glib.h>
@@ -21,58 +22,313 @@
 #define DEFAULT_WSIZE 65535
 #define TCP_HDR_SIZE  20
 
+#define RECV_WSIZE_INIT  (16*1024)     // initial receive window, auto-tuning grows it up to rcvbuf-max
+                                       // (in_data always holds exactly rws bytes, at most 65535)
 
+#define BUFFER_IDLE_US           5000000      // release an idle connection's buffers after 5 seconds
+#define DELACK_US                40000        // longest an ACK waits for outgoing data to carry it (RFC 1122: < 0.5 sec)
+#define SOCKET_THREAD_STACK_SIZE (256*1024)   // per-connection send/handle thread stack, both exit on an
+                                              // idle connection and are started again on demand
+
+#define SYN_TIMEOUT_US           1000000      // first SYN retransmission timeout, doubled on every retry
+#define SYN_MAX_RETRIES          3            // v_connect() fails with -ETIME after 1+2+4+8 seconds
+
+// tos of SYN, SYN-ACK and pure ACKs: at least CS4, the interactive egress band, so that handshakes and
+// ACKs don't wait behind the bulk data of a socket with a low (or the default) TCPO_DSCP
+#define TCP_CONTROL_TOS(tos)     ((IPTOS_CLASS(tos) >= IPTOS_CLASS_CS4) ? (tos) : IPTOS_CLASS_CS4)
+
+
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED   __attribute__((aligned(CACHE_LINE_SIZE)))
+
+
+// Options for v_setsockopt()/v_getsockopt()
+typedef enum TCP_Option {
+
+    TCPO_RCVBUF = 0,    // current receive window/in_data size (read only)
+    TCPO_RCVBUF_MAX,    // limit for receive window auto-tuning, 1..DEFAULT_WSIZE
+    TCPO_NODELAY,       // non-zero disables Nagle: send small segments even with data in flight
+    TCPO_MAXSEG,        // negotiated MSS (read only)
+    TCPO_RCVLOWAT,      // bytes v_read() waits for before waking up (unless PSH/FIN/timeout), 1..DEFAULT_WSIZE
+    TCPO_CONGESTION,    // congestion control algorithm (TCP_Congestion_t), resets its state when changed
+    TCPO_PACING_RATE,   // fixed pacing rate in bytes/s, 0 = derived by the congestion control (default)
+    TCPO_MAX_RATE,      // cap on the transmit rate in bytes/s (token bucket), 0 = unlimited (default)
+    TCPO_ECN,           // non-zero negotiates ECN on connect/accept (default), set before the handshake
+    TCPO_DSCP,          // DSCP (0..63) of data segments, selects the egress priority band (default 0)
+    TCPO_NONBLOCK,      // non-zero makes v_connect() return -EINPROGRESS at once, see v_poll()
+    TCPO_ERROR          // why the last v_connect() failed (negative errno, 0 = none), cleared when read (read only)
+
+} TCP_Option_t;
+
+
+// Readiness events of v_poll()
+#define V_POLLIN    0x01    // v_read() returns data or eof, or a listening socket has a connection request
+#define V_POLLOUT   0x04    // connected and v_write() has room
+#define V_POLLERR   0x08    // v_connect() failed, see TCPO_ERROR (always reported)
+#define V_POLLNVAL  0x20    // not a socket (always reported)
+
+#define POLL_WRITE_LOWAT (DEFAULT_WSIZE/2)  // free send buffer bytes for V_POLLOUT, so that a writer isn't
+                                            // woken by every ACK for a few bytes of room
+
+struct v_pollfd {
+    int vsocket;
+    short events;           //V_POLLIN and/or V_POLLOUT
+    short revents;          //set by v_poll()
+};
+
+
+// Congestion control algorithms for TCPO_CONGESTION (see congestion.c)
+typedef enum TCP_Congestion {
+
+    TCP_CC_RENO = 0,    // loss-based (RFC 5681): halves the window on loss, the default
+    TCP_CC_BBR,         // model-based: paces at the estimated bottleneck bandwidth, caps inflight at 2*BDP
+    TCP_CC_KINDS
+
+} TCP_Congestion_t;
+
+
+// BBR's path model and state machine, owned by congestion.c
+#define BBR_BW_ROUNDS   10
+
+struct bbr_state {
+    uint8_t mode;
+    uint64_t bw_rounds[BBR_BW_ROUNDS];  //highest delivery rate (bytes/s) of each of the last round trips
+    uint64_t btl_bw;                    //bottleneck bandwidth estimate: max of bw_rounds
+    uint64_t min_rtt_us;                //0 = no sample
+    uint64_t min_rtt_stamp_us;
+    uint64_t round_count;
+    uint64_t next_round_delivered;      //a round trip ends once a segment sent after this much was delivered
+    bool round_start;
+    uint64_t full_bw;                   //STARTUP ends when btl_bw stops growing
+    uint32_t full_bw_count;
+    bool filled_pipe;
+    uint32_t cycle_index;               //PROBE_BW gain cycle
+    uint64_t cycle_stamp_us;
+    uint64_t probe_rtt_done_us;
+    bool probe_rtt_round_done;
+    uint32_t prior_cwnd;                //cwnd restored after recovery and PROBE_RTT
+    double pacing_gain;
+    double cwnd_gain;
+};
+
+
+// Sections are grouped by the thread writing them, each on its own cache line: the send
+// thread advances send_next, ACK processing (handle and input threads) send_unack and the
+// peer's window, the handle thread and v_read() the receive side.
 struct tcb_infoset {
 
+   // connection addresses, only written during the handshake
    uint32_t local_vip;
    uint16_t local_port;
    uint32_t remote_vip;
    uint16_t remote_port;
 
-   //tcb send variables
-   tcp_seq send_unack;      //oldest unacknowledged sequence number
-   tcp_seq send_next;       //next sequence number to be sent
-   tcp_seq seq_fin;         //seq number of FIN
-   uint64_t sws;            //sender max window size
-   tcp_seq seq_send_init;   //initial send seq number
-   tcp_seq dup_ack;         //counter for duplicate ACK
-   tcp_seq remote_ruws;     //remote receiver usable window size
+   //tcb send variables, written by the send thread
+   struct {
+      tcp_seq send_next;       //next sequence number to be sent
+      tcp_seq seq_fin;         //seq number of FIN
+      tcp_seq seq_send_init;   //seq number at index 0 of swin_buffer
+      uint32_t sws;            //sender max window size
+      uint32_t mss;            //largest segment we send
+   } CACHE_ALIGNED;
+   
+   //tcb send variables, written by ACK processing
+   struct {
+      tcp_seq send_unack;      //oldest unacknowledged sequence number
+      uint32_t dup_ack;        //counter for duplicate ACK
+      uint32_t remote_ruws;    //remote receiver usable window size
+      uint32_t max_sndwnd;     //largest window the remote receiver has offered
+   } CACHE_ALIGNED;
 
    //tcb recv variables
-   tcp_seq recv_fin;
-   tcp_seq recv_next;       //next sequence number expected on an incoming segments, 
-   uint64_t rws;            //receiver max window size
-   tcp_seq ruws;            //receiver usable window size
-   tcp_seq seq_recv_init;   //initial recv seq number
+   struct {
+      tcp_seq recv_fin;
+      tcp_seq recv_next;       //next sequence number expected on an incoming segments, 
+      tcp_seq seq_recv_init;   //initial recv seq number
+      uint32_t rws;            //receiver max window size
+      uint32_t ruws;           //receiver usable window size
+   } CACHE_ALIGNED;
 };
 
 
 struct vsocket_infoset {
 
+    // read-mostly: state, queue and buffer pointers
     TCP_State_t state;
     uint32_t no_read;
-    Logger_t logger;
-    clock_t start_time;
+    int vsocket;                //the socket id this is registered under
+    bool quit;
+    uint32_t threads_running;   //send/handle threads still using the buffers, a parked one counts
+    bool handle_parked;         //handle thread exited on an idle connection, the next packet starts it
+    bool send_parked;           //send thread exited on an idle connection, the next wakeup starts it
+    
+    bqueue_t bq_buffer; //for connection and raw tcp packet rcvd
+    
+    // Buffers below are allocated on first use and released again when the
+    // connection goes idle (see sliding_window.c), so listening and idle
+    // sockets only cost the size of this struct.
+    circular_buffer_t* swin_buffer;
+    char* burst_data;           //new data of one send burst copied out of swin_buffer, allocated with it
+    circular_buffer_t* rwin_buffer;
+    circular_buffer_t* in_data; //for inorder tcp packet rcvd(filtered by rsw)
+    uint16_t* pending_data;     //length of out-of-order segment stored at each rwin index
     
+    Logger_t* logger;           //allocated by lgr_open() once the connection is established
+    
+    // active open: v_connect() sends the SYN, the input thread finishes the handshake
+    // (see continueActiveOpen()) and syn_timer retransmits
+    bool nonblock;              //TCPO_NONBLOCK
+    bool connecting;            //handshake in progress
+    int connect_error;          //TCPO_ERROR
+    struct tsv_timer syn_timer;
+    uint32_t syn_retries;
+    tcp_seq syn_seq;            //our SYN, or SYN-ACK once a simultaneous open crossed it
+    tcp_seq syn_ack;
+    uint8_t syn_flags;
+    uint16_t syn_route_mss;     //MSS announced in it
+    uint16_t syn_mss;           //negotiated from the peer's SYN (simultaneous open)
+    GList* poll_entries;        //threads in v_poll() waiting on this socket (see tcp_wakePollers())
+    
+    struct tcb_infoset tcb;
+    
+    // RTT samples and the RTO estimate, written by the input thread alone (tcp_handleTCPPacket())
     struct {
         double rttvar_us;
         double srtt_us;
         double rto_us;
+        bool first_measure;
+    } CACHE_ALIGNED;
+    
+    // ACK processing, written by the handle thread for every ACK. The send thread only writes here
+    // on timer events (RTO, RACK reordering timer, loss probe, restart from idle), never per segment.
+    struct {
+        uint64_t start_time;        //retransmission timer (util_getTimeUs()), restarted on every new ACK
+        uint64_t send_activity_us;  //last time swin_buffer was used
+        
+        // loss detection: RACK-TLP and the RTO (see rack.c)
+        uint32_t rack_lost;         //records marked lost, not retransmitted yet
+        uint32_t rack_lost_bytes;
+        uint32_t rack_delivered;    //records past send_unack marked delivered by duplicate ACKs
+        uint32_t rack_delivered_bytes;
+        uint64_t rack_xmit_time_us; //send time of the most recently sent segment known delivered, 0 = none
+        tcp_seq rack_end_seq;       //and its end
+        uint64_t rack_rtt_us;       //and its RTT
+        uint64_t rack_min_rtt_us;   //smallest RTT of a segment sent only once, 0 = no sample
+        uint64_t rack_timer_us;     //reordering timer expiry, 0 when not armed
+        uint64_t tlp_time_us;       //tail loss probe expiry, 0 when not armed
+        bool tlp_outstanding;       //probe sent, not ACKed yet
+        uint32_t rto_backoff;       //doublings of the RTO since data was last ACKed
         
-        clock_t send_time;
+        // congestion control (see congestion.c)
+        uint32_t cwnd;              //congestion window: most bytes in the network (the pipe)
+        uint32_t ssthresh;
+        uint32_t cwnd_acked;        //bytes ACKed towards the next congestion avoidance increase
+        bool in_recovery;           //RACK found loss, until recovery_point is ACKed
+        bool in_loss;               //after an RTO, until recovery_point is ACKed
+        tcp_seq recovery_point;     //send_next when recovery started
+        uint32_t prr_delivered;     //PRR (RFC 6937): bytes delivered since recovery started
+        uint32_t recover_fs;        //flight size when recovery started
+        bool undo_armed;            //the current reduction may still turn out spurious (see rack.c)
+        uint32_t prior_cwnd;        //cwnd and ssthresh before the reduction, restored by an undo
+        uint32_t prior_ssthresh;
+        uint64_t pacing_rate;       //bytes/s set by the congestion control, 0 = not paced
+        struct bbr_state bbr;
+        
+        // delivery rate estimation
+        uint64_t delivered;         //bytes delivered so far
+        uint64_t delivered_time_us; //when delivered last grew
+        uint64_t first_sent_time_us;//send time of the most recently delivered segment
+        uint64_t app_limited;       //samples are app-limited until delivered passes this, 0 = not
+        
+        // shown by tcp_printSockets()
+        uint32_t spurious_undos;    //reductions undone as spurious
+        uint32_t ecn_reductions;    //reductions caused by ECE
+    } CACHE_ALIGNED;
+    
+    // transmit path, written by the send thread (ACKs only clear the persist timer and exp_acknum)
+    struct {
+        uint64_t send_time;         //RTT sample in progress: sent at send_time, ends with an ACK of exp_acknum
         uint32_t exp_acknum;
         
-        bool first_measure;
-    };
+        uint64_t persist_time_us;   //persist timer expiry, 0 when not armed (peer window open)
+        uint32_t persist_backoff;   //doublings of the persist timer since the window closed
+        uint64_t sws_hold_time_us;  //since when small segment data is held back, 0 = nothing held
+        
+        GQueue* tx_records;         //struct tx_record per segment in flight, NULL until data is sent
+        tcp_seq tlp_end_seq;        //send_next when the last probe went out
+        uint32_t prr_out;           //bytes (re)transmitted since recovery started
+        uint32_t undo_retrans;      //retransmissions of the current reduction not proven spurious yet
+        bool ecn_cwr_pending;       //window reduced, the next new data carries CWR
+        
+        uint64_t pace_time_us;      //earliest time the next paced segment may go out
+        struct tsv_timer pace_timer;//wakes the send thread at pace_time_us
+        int64_t rate_tokens;        //bytes that may go out now, negative after overdrawing
+        uint64_t rate_refill_us;    //when rate_tokens was last refilled
+        
+        // shown by tcp_printSockets()
+        uint32_t retrans_segments;
+        uint32_t tlp_probes;
+        uint32_t rto_timeouts;
+        uint32_t rate_limited;      //times the send path drained the token bucket
+        uint32_t local_drops;       //segments our own interface queue dropped
+    } CACHE_ALIGNED;
     
-    struct tcb_infoset tcb;
-    bqueue_t bq_buffer; //for connection and raw tcp packet rcvd
-    circular_buffer_t* swin_buffer;
-    circular_buffer_t* rwin_buffer;
+    // send side options and handshake results, read-mostly (v_setsockopt(), the handshake)
+    struct {
+        pthread_cond_t send_cond;   //wakes the send thread, waited on with g_vsocket_table_mutex
+        bool nodelay;               //TCPO_NODELAY
+        TCP_Congestion_t cc_kind;   //TCPO_CONGESTION
+        uint64_t fixed_pacing_rate; //TCPO_PACING_RATE, overrides pacing_rate unless 0
+        uint64_t max_rate;          //TCPO_MAX_RATE, transmit rate cap (token bucket) in bytes/s, 0 = unlimited
+        
+        // ECN (RFC 3168, see handleECN() in sliding_window.c)
+        bool ecn;                   //TCPO_ECN
+        bool ecn_ok;                //negotiated in the handshake: new data goes out ECT(0)
+        
+        uint8_t tos;                //TCPO_DSCP, shifted into place for ip_tos (ECN bits clear)
+    } CACHE_ALIGNED;
     
-    circular_buffer_t* in_data; //for inorder tcp packet rcvd(filtered by rsw)
-    int pending_data[DEFAULT_WSIZE];
-    bool quit;
+    // receive side
+    struct {
+        uint32_t ooo_segments;      //number of non-zero entries in pending_data
+        uint32_t active_readers;    //threads currently inside sw_readData() using in_data
+        bool recv_eof;              //eof was signaled on in_data
+        struct tsv_timer time_wait_timer;   //closes the socket 2MSL after TIME_WAIT is entered
+        
+        // reader wakeups (receive low-watermark)
+        pthread_cond_t recv_cond;   //wakes readers in sw_readData(), waited on with g_vsocket_table_mutex
+        uint32_t rcvlowat;          //TCPO_RCVLOWAT
+        uint32_t recv_wait_bytes;   //bytes a sleeping reader waits for, 0 = no reader waiting
+        bool recv_push;             //PSH received since in_data was last emptied
+        
+        uint64_t recv_activity_us;  //last time rwin_buffer/in_data were used
+        
+        // receive window auto-tuning (dynamic right-sizing)
+        uint32_t rcvbuf_max;        //TCPO_RCVBUF_MAX
+        uint32_t rcvbuf_target;     //rws wanted by sw_readData(), applied by the handle thread
+        uint32_t rcvq_copied;       //bytes read by the application in the current RTT
+        uint32_t rcvq_space;        //most bytes read by the application in one RTT
+        uint64_t rcvq_time_us;      //start of the current RTT
+        
+        tcp_seq rcv_rtt_seq;        //receiver RTT sample ends once recv_next reaches this
+        uint64_t rcv_rtt_time_us;   //start of the current receiver RTT sample (0 = none)
+        double rcv_rtt_us;          //receiver RTT estimate (0 = not measured yet)
+        
+        uint64_t delack_time_us;    //delayed ACK deadline, 0 = no ACK pending
+        uint32_t delack_bytes;      //in-order bytes received since the last ACK went out
+        
+        bool ecn_echo;              //CE received: every ACK carries ECE until the peer sends CWR
+        bool ecn_quickack;          //ACK the segment that started ecn_echo right away
+        uint32_t ecn_ce_received;   //CE marked segments received
+        
+#ifdef TCP_SEGMENT_STATS
+        // per-segment cost of the handle thread, written by it alone (shown by tcp_printSockets())
+        uint64_t pred_segments;     //segments taken by the header prediction fast path
+        uint64_t pred_time_us;
+        uint64_t slow_segments;     //segments taken by the general path
+        uint64_t slow_time_us;
+#endif
+    } CACHE_ALIGNED;
 };
 
 //=================================================================================================
@@ -89,13 +345,21 @@ extern GHashTable* s_vsocket_table;
 
 void tcp_handleTCPPacket(ip_packet_t* ip_packet);
 
+void tcp_flushCoalescedPackets(void);
+
+void tcp_wakePollers(struct vsocket_infoset* socket_info);
+
+void tcp_startSocketThread(void* (*thread_func)(void*), void* arg);
+
 
 void continueTCPConnection_S2E(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr, int vsocket);
 void continueTCPConnection_S2R(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr);
 
 
-int tcp_sendMessage(struct vsocket_infoset* socket_info, uint32_t saddr, uint32_t daddr, 
+int tcp_sendMessage(struct vsocket_infoset* socket_info, uint32_t saddr, uint32_t daddr, uint8_t tos,
                     tcp_packet_t* tcp_packet, size_t packet_len);
+int tcp_sendSuperSegment(struct vsocket_infoset* socket_info, uint32_t saddr, uint32_t daddr, uint8_t tos,
+                         tcp_super_segment_t* super_segment);
 
 void tcp_initialSetUp(void);
 
@@ -107,6 +371,8 @@ int v_socket(void);
 
 void tcp_printSocketRecvWin(int vsocket, bool non_read_only);
 
+void tcp_printRateLimits(int vsocket);
+
 void printSocketStatePair(gpointer socket, gpointer socket_info);
 void printAllSocketsState();
 void printPort2SocketPair(gpointer port, gpointer socket);
@@ -128,6 +394,12 @@ int v_shutdown(int vsocket, int type);
 
 int v_close(int vsocket);
 
+int v_poll(struct v_pollfd* fds, int nfds, int timeout_ms);
+
+int v_setsockopt(int vsocket, TCP_Option_t option, int value);
+
+int v_getsockopt(int vsocket, TCP_Option_t option, int* value);
+
 void testPrint();
 
 
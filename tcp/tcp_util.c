@@ -1,11 +1,10 @@
 #include "tcp_util.h"
 
 
-uint16_t tcp_checksum(char* packet, size_t len)
+// Unfolded one's complement sum of buf added to sum, so that it can be computed in parts
+uint32_t addChecksum(uint32_t sum, char* buf, size_t len)
 {
-  uint16_t *p = (uint16_t*)packet;
-  uint16_t answer;
-  long sum = 0;
+  uint16_t *p = (uint16_t*)buf;
   uint16_t odd_byte = 0;
 
   while (len > 1) {
@@ -18,19 +17,33 @@ uint16_t tcp_checksum(char* packet, size_t len)
     *(uint8_t*)(&odd_byte) = *(uint8_t*)p;
     sum += odd_byte;
   }
+  
+  return sum;
+}
+
 
+uint16_t foldChecksum(uint32_t sum)
+{
   sum = (sum >> 16) + (sum & 0xffff); /* add hi 16 to low 16 */
   sum += (sum >> 16);           /* add carry */
-  answer = ~sum;                /* olenes-complemelent, trulencate*/
-  return answer;
+  return (uint16_t)~sum;        /* olenes-complemelent, trulencate*/
+}
 
+
+uint16_t tcp_checksum(char* packet, size_t len)
+{
+  return foldChecksum(addChecksum(0, packet, len));
 }
 
 
 
-void buildTCPPacket(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr, u_short sport, u_short dport, 
-                    uint32_t seqnum, uint32_t ack, u_char flag, u_short wsize, char* data, size_t data_len)
+// Options (if any) go first in tcp_data, the payload follows them
+void buildTCPPacketWithOptions(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr, u_short sport, u_short dport, 
+                               uint32_t seqnum, uint32_t ack, u_char flag, u_short wsize, char* options, size_t options_len,
+                               char* data, size_t data_len)
 {
+  assert(options_len%4 == 0 && options_len+data_len <= TCP_MTU);
+
   //populate header
   (tcp_packet->tcp_header).th_sport=htons(sport);
   (tcp_packet->tcp_header).th_dport=htons(dport);
@@ -39,42 +52,171 @@ void buildTCPPacket(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr, u_
   (tcp_packet->tcp_header).th_flags=flag;
   (tcp_packet->tcp_header).th_win=htons(wsize);
   (tcp_packet->tcp_header).th_x2=0;
-  (tcp_packet->tcp_header).th_off=sizeof(struct tcphdr)/4;
+  (tcp_packet->tcp_header).th_off=(sizeof(struct tcphdr)+options_len)/4;
   (tcp_packet->tcp_header).th_urp=htons(0);
 
+  memset(tcp_packet->tcp_data, 0, TCP_MTU);
+  
+  //copy options and data
+  memcpy(tcp_packet->tcp_data, options, options_len);
+  memcpy(tcp_packet->tcp_data+options_len, data, data_len);
  
   //compute checksum by forming pseudo header
   (tcp_packet->tcp_header).th_sum=0;
+  size_t tcp_len=sizeof(struct tcphdr)+options_len+data_len;
   pseudo_tcphdr_t pseudo_header;
   pseudo_header.source_addr=htonl(saddr);
   pseudo_header.dest_addr=htonl(daddr);
   pseudo_header.reserved=0;
   pseudo_header.protocol=TCP_PROTOCOL;
-  pseudo_header.tcp_len=htons(sizeof(struct tcphdr)+data_len);
+  pseudo_header.tcp_len=htons(tcp_len);
   
 
-  //copy pseudo header, tcp header and tcp data to buffer
-  int tcp_w_pseudo_len=sizeof(pseudo_header)+sizeof(struct tcphdr)+data_len;
+  //copy pseudo header and tcp packet (header, options, data) to buffer
+  int tcp_w_pseudo_len=sizeof(pseudo_header)+tcp_len;
 
   char tcp_w_pseudo[tcp_w_pseudo_len];
-  int start=0;
-  memcpy(tcp_w_pseudo+start, (char*)&pseudo_header, sizeof(pseudo_header));
-  start+=sizeof(pseudo_header);
-  memcpy(tcp_w_pseudo+start, (char*)&(tcp_packet->tcp_header), sizeof(struct tcphdr));
-  start+=sizeof(struct tcphdr);
-  memcpy(tcp_w_pseudo+start, data, data_len);  
+  memcpy(tcp_w_pseudo, (char*)&pseudo_header, sizeof(pseudo_header));
+  memcpy(tcp_w_pseudo+sizeof(pseudo_header), (char*)tcp_packet, tcp_len);
 
   (tcp_packet->tcp_header).th_sum=tcp_checksum(tcp_w_pseudo, tcp_w_pseudo_len);
+}
 
-  memset(tcp_packet->tcp_data, 0, TCP_MTU);
+
+void buildTCPPacket(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr, u_short sport, u_short dport, 
+                    uint32_t seqnum, uint32_t ack, u_char flag, u_short wsize, char* data, size_t data_len)
+{
+  buildTCPPacketWithOptions(tcp_packet, saddr, daddr, sport, dport, seqnum, ack, flag, wsize, NULL, 0, data, data_len);
+}
+
+
+// SYN or SYN-ACK carrying the MSS option
+void buildTCPSynPacket(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr, u_short sport, u_short dport, 
+                       uint32_t seqnum, uint32_t ack, u_char flag, u_short wsize, uint16_t mss)
+{
+  char options[TCP_OPT_MSS_LEN];
+  options[0]=TCPOPT_MAXSEG;
+  options[1]=TCPOLEN_MAXSEG;
+  options[2]=(mss>>8)&0xff;
+  options[3]=mss&0xff;
   
-  //copy data
-  memcpy(tcp_packet->tcp_data, data, data_len);
+  buildTCPPacketWithOptions(tcp_packet, saddr, daddr, sport, dport, seqnum, ack, flag, wsize, options, TCP_OPT_MSS_LEN, NULL, 0);
 }
 
 
+// Super-segment of data_len bytes, cut into mss sized pieces by tcp_segmentSuperSegment()
+void tcp_buildSuperSegment(tcp_super_segment_t* super_segment, uint32_t saddr, uint32_t daddr, u_short sport, u_short dport, 
+                           uint32_t seqnum, uint32_t ack, u_char flag, u_short wsize, char* data, size_t data_len, size_t mss, bool push)
+{
+  struct tcphdr* header=&(super_segment->header);
+  
+  //populate header template, th_seq, th_off/th_flags (PSH differs per piece) and th_sum left out of the checksum
+  header->th_sport=htons(sport);
+  header->th_dport=htons(dport);
+  header->th_seq=0;
+  header->th_ack=htonl(ack);
+  header->th_flags=0;
+  header->th_win=htons(wsize);
+  header->th_x2=0;
+  header->th_off=0;
+  header->th_urp=htons(0);
+  header->th_sum=0;
+  
+  pseudo_tcphdr_t pseudo_header;
+  pseudo_header.source_addr=htonl(saddr);
+  pseudo_header.dest_addr=htonl(daddr);
+  pseudo_header.reserved=0;
+  pseudo_header.protocol=TCP_PROTOCOL;
+  pseudo_header.tcp_len=0;
+  
+  super_segment->header_sum=addChecksum(addChecksum(0, (char*)&pseudo_header, sizeof(pseudo_header)),
+                                        (char*)header, sizeof(struct tcphdr));
+  header->th_seq=htonl(seqnum);
+  header->th_off=sizeof(struct tcphdr)/4;
+  header->th_flags=flag;
+  
+  super_segment->seqnum=seqnum;
+  super_segment->data=data;
+  super_segment->data_len=data_len;
+  super_segment->mss=mss;
+  super_segment->push=push;
+}
+
+
+// gso_segment_t of TCP: piece number index of the super-segment, only th_seq, the length
+// and the payload are added to the checksum
+size_t tcp_segmentSuperSegment(void* super_segment, int index, char* buf)
+{
+  tcp_super_segment_t* sseg=(tcp_super_segment_t*)super_segment;
+  
+  size_t offset=index*sseg->mss;
+  if (offset >= sseg->data_len) {
+    return 0;
+  }
+  size_t data_len=util_min(sseg->mss, sseg->data_len-offset);
+  size_t tcp_len=sizeof(struct tcphdr)+data_len;
+  
+  struct tcphdr* header=(struct tcphdr*)buf;
+  memcpy(header, &(sseg->header), sizeof(struct tcphdr));
+  memcpy(buf+sizeof(struct tcphdr), sseg->data+offset, data_len);
+  header->th_seq=htonl(sseg->seqnum+offset);
+  if (sseg->push && offset+data_len == sseg->data_len) {
+    header->th_flags|=TH_PUSH;
+  }
+  if (index > 0) {
+    header->th_flags&=~TH_CWR; //CWR goes out once, on the first piece
+  }
+  
+  //th_off and th_flags share the 16 bit word that follows th_ack
+  uint32_t sum=sseg->header_sum+htons(tcp_len);
+  sum=addChecksum(sum, (char*)&(header->th_seq), sizeof(header->th_seq));
+  sum=addChecksum(sum, (char*)&(header->th_ack)+sizeof(header->th_ack), sizeof(uint16_t));
+  sum=addChecksum(sum, buf+sizeof(struct tcphdr), data_len);
+  header->th_sum=foldChecksum(sum);
+  
+  return tcp_len;
+}
 
 
+// Header length including options (th_off)
+size_t tcp_getHeaderLen(tcp_packet_t* tcp_packet)
+{
+  return (tcp_packet->tcp_header).th_off*4;
+}
+
+
+char* tcp_getData(tcp_packet_t* tcp_packet)
+{
+  return ((char*)tcp_packet)+tcp_getHeaderLen(tcp_packet);
+}
+
+
+// MSS option of a received SYN/SYN-ACK, 0 if there is none
+uint16_t tcp_getMSSOption(tcp_packet_t* tcp_packet)
+{
+  size_t options_len=tcp_getHeaderLen(tcp_packet)-sizeof(struct tcphdr);
+  unsigned char* options=(unsigned char*)tcp_packet->tcp_data;
+  size_t i=0;
+  
+  while (i<options_len) {
+    if (options[i]==TCPOPT_EOL) {
+      break;
+    }
+    if (options[i]==TCPOPT_NOP) {
+      i++;
+      continue;
+    }
+    if (i+1>=options_len || options[i+1]<2) { // malformed
+      break;
+    }
+    if (options[i]==TCPOPT_MAXSEG && options[i+1]==TCPOLEN_MAXSEG && i+TCPOLEN_MAXSEG<=options_len) {
+      return (options[i+2]<<8) | options[i+3];
+    }
+    i+=options[i+1];
+  }
+  
+  return 0;
+}
 
 
 
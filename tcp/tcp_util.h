@@ -37,12 +37,37 @@
 
 #define PSEUDO_TCPHDR_SIZE 12
 
+// ECN flags of the TCP header (RFC 3168 6.1), not defined by every libc
+#ifndef TH_ECE
+#define TH_ECE  0x40
+#endif
+#ifndef TH_CWR
+#define TH_CWR  0x80
+#endif
+
+#define TCP_OPT_MSS_LEN     4       // kind, length, 16 bit MSS (sent on SYN and SYN-ACK)
+#define TCP_DEFAULT_MSS     536     // assumed if the peer sends no MSS option (RFC 1122 4.2.2.6)
+#define TCP_MIN_MSS         88      // smallest peer MSS accepted, as Linux: tiny segments only cost CPU and headers
+
 typedef struct{
   struct tcphdr tcp_header;
   char tcp_data[TCP_MTU];
 } tcp_packet_t;
 
 
+// Software GSO (see net_sendMessageGSO()): new data goes out as MSS-sized pieces that share
+// one header template and the checksum of everything but th_seq, the length and the payload
+typedef struct{
+  struct tcphdr header;   //template of every piece, th_seq is that of the first piece
+  uint32_t seqnum;
+  uint32_t header_sum;    //unfolded one's complement sum of the pseudo header and template (without length, th_seq, th_off/th_flags)
+  bool push;              //PSH on the last piece
+  char* data;
+  size_t data_len;
+  size_t mss;
+} tcp_super_segment_t;
+
+
 //pseudo header for computing tcp checksum
 typedef struct{
   uint32_t source_addr;
@@ -66,6 +91,18 @@ uint16_t tcp_checksum(char* packet, size_t len);
 
 void buildTCPPacket(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr, u_short sport, u_short dport, uint32_t seqnum, uint32_t ack, u_char flag, u_short wsize, char* data, size_t data_len);
 
+void buildTCPSynPacket(tcp_packet_t* tcp_packet, uint32_t saddr, uint32_t daddr, u_short sport, u_short dport, uint32_t seqnum, uint32_t ack, u_char flag, u_short wsize, uint16_t mss);
+
+size_t tcp_getHeaderLen(tcp_packet_t* tcp_packet);
+
+char* tcp_getData(tcp_packet_t* tcp_packet);
+
+uint16_t tcp_getMSSOption(tcp_packet_t* tcp_packet);
+
+void tcp_buildSuperSegment(tcp_super_segment_t* super_segment, uint32_t saddr, uint32_t daddr, u_short sport, u_short dport, uint32_t seqnum, uint32_t ack, u_char flag, u_short wsize, char* data, size_t data_len, size_t mss, bool push);
+
+size_t tcp_segmentSuperSegment(void* super_segment, int index, char* buf);
+
 void printTCPPacket(tcp_packet_t* tcp_packet);
 
 
@@ -0,0 +1,226 @@
+//================================================================================================= 
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "timer_service.h"
+
+//=================================================================================================
+//      GLOBAL VARIABLES
+//=================================================================================================
+
+// Mutex to protect all variables below and the heap_index/expiry_us of every timer
+static pthread_mutex_t g_timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_timer_cond = PTHREAD_COND_INITIALIZER;
+
+// Binary min-heap of the armed timers, ordered by expiry_us
+static struct tsv_timer** s_timer_heap = NULL;
+static int s_timer_count = 0;
+static int s_timer_size = 0;
+
+// Timer whose callback is running, tsv_cancel() waits on s_done_cond until it returned
+static pthread_t s_timer_thread;
+static struct tsv_timer* s_running_timer = NULL;
+static pthread_cond_t s_done_cond = PTHREAD_COND_INITIALIZER;
+
+//=================================================================================================
+//      PRIVATE FUNCTIONS
+//=================================================================================================
+
+// WARNING: g_timer_mutex must already be acquired
+void placeTimer(struct tsv_timer* timer, int index)
+{
+    s_timer_heap[index] = timer;
+    timer->heap_index = index;
+}
+
+
+// WARNING: g_timer_mutex must already be acquired
+void siftUp(int index)
+{
+    struct tsv_timer* timer = s_timer_heap[index];
+    
+    while (index > 0) {
+        int parent = (index - 1)/2;
+        if (s_timer_heap[parent]->expiry_us <= timer->expiry_us) {
+            break;
+        }
+        placeTimer(s_timer_heap[parent], index);
+        index = parent;
+    }
+    placeTimer(timer, index);
+}
+
+
+// WARNING: g_timer_mutex must already be acquired
+void siftDown(int index)
+{
+    struct tsv_timer* timer = s_timer_heap[index];
+    
+    while (true) {
+        int child = 2*index + 1;
+        if (child >= s_timer_count) {
+            break;
+        }
+        if (child + 1 < s_timer_count && s_timer_heap[child + 1]->expiry_us < s_timer_heap[child]->expiry_us) {
+            child++;
+        }
+        if (timer->expiry_us <= s_timer_heap[child]->expiry_us) {
+            break;
+        }
+        placeTimer(s_timer_heap[child], index);
+        index = child;
+    }
+    placeTimer(timer, index);
+}
+
+
+// WARNING: g_timer_mutex must already be acquired
+void removeTimer(struct tsv_timer* timer)
+{
+    int index = timer->heap_index;
+    
+    timer->heap_index = -1;
+    s_timer_count--;
+    if (index == s_timer_count) {
+        return;
+    }
+    
+    // Move the last timer into the hole, then restore the heap order around it
+    struct tsv_timer* last = s_timer_heap[s_timer_count];
+    placeTimer(last, index);
+    siftUp(index);
+    siftDown(last->heap_index);
+}
+
+
+// Sleep on s_timer_cond until the given util_getTimeUs() time
+// WARNING: g_timer_mutex must already be acquired
+void waitUntil(uint64_t expiry_us, uint64_t now)
+{
+    // pthread_cond_timedwait() takes an absolute CLOCK_REALTIME time
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t nsec = deadline.tv_nsec + (expiry_us - now)*1000;
+    deadline.tv_sec += nsec/1000000000;
+    deadline.tv_nsec = nsec%1000000000;
+    
+    pthread_cond_timedwait(&s_timer_cond, &g_timer_mutex, &deadline);
+}
+
+
+// Fire due timers, then sleep until the earliest armed one (or until one is armed earlier)
+void* timerThreadFunc(void* arg)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_timer_mutex);
+    while (true) {
+        if (s_timer_count == 0) {
+            pthread_cond_wait(&s_timer_cond, &g_timer_mutex);
+            continue;
+        }
+        
+        uint64_t now = util_getTimeUs();
+        struct tsv_timer* timer = s_timer_heap[0];
+        if (timer->expiry_us > now + TSV_SLACK_US) {
+            waitUntil(timer->expiry_us, now);
+            continue;
+        }
+        
+        removeTimer(timer);
+        tsv_callback_t callback = timer->callback;
+        void* callback_arg = timer->arg;
+        s_running_timer = timer;
+        
+        pthread_mutex_unlock(&g_timer_mutex);
+        callback(callback_arg);
+        pthread_mutex_lock(&g_timer_mutex);
+        
+        s_running_timer = NULL;
+        pthread_cond_broadcast(&s_done_cond);
+    }
+    
+    return NULL;
+}
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+// Start the timer thread: one thread with one heap serves the timers of every connection
+void tsv_init(void)
+{
+    s_timer_size = TSV_INITIAL_SIZE;
+    s_timer_heap = (struct tsv_timer**)malloc(s_timer_size*sizeof(struct tsv_timer*));
+    
+    pthread_create(&s_timer_thread, NULL, timerThreadFunc, NULL);
+    pthread_detach(s_timer_thread);
+}
+
+
+void tsv_initTimer(struct tsv_timer* timer, tsv_callback_t callback, void* arg)
+{
+    timer->expiry_us = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->heap_index = -1;
+}
+
+
+// Arm the timer to fire at expiry_us (a util_getTimeUs() time), moving it if already armed
+void tsv_schedule(struct tsv_timer* timer, uint64_t expiry_us)
+{
+    // Critical Section
+    pthread_mutex_lock(&g_timer_mutex);
+    if (timer->heap_index >= 0) {
+        if (timer->expiry_us == expiry_us) {
+            pthread_mutex_unlock(&g_timer_mutex);
+            return;
+        }
+        timer->expiry_us = expiry_us;
+        siftUp(timer->heap_index);
+        siftDown(timer->heap_index);
+    } else {
+        if (s_timer_count == s_timer_size) {
+            s_timer_size *= 2;
+            s_timer_heap = (struct tsv_timer**)realloc(s_timer_heap, s_timer_size*sizeof(struct tsv_timer*));
+        }
+        timer->expiry_us = expiry_us;
+        placeTimer(timer, s_timer_count++);
+        siftUp(timer->heap_index);
+    }
+    
+    // The timer thread only needs to wake up if its next expiry moved earlier
+    if (timer->heap_index == 0) {
+        pthread_cond_signal(&s_timer_cond);
+    }
+    pthread_mutex_unlock(&g_timer_mutex);
+}
+
+
+// Disarm the timer and wait for its callback if it is running, so that the callback is over
+// when this returns. Called from a callback, it doesn't wait (the callback would be waiting on
+// itself). Never call it holding a lock the callback takes: the two would wait on each other.
+void tsv_cancel(struct tsv_timer* timer)
+{
+    bool on_timer_thread = pthread_equal(pthread_self(), s_timer_thread);
+    
+    // Critical Section
+    pthread_mutex_lock(&g_timer_mutex);
+    while (true) {
+        // A running callback may re-arm its timer while we wait
+        if (timer->heap_index >= 0) {
+            removeTimer(timer);
+        }
+        if (s_running_timer != timer || on_timer_thread) {
+            break;
+        }
+        pthread_cond_wait(&s_done_cond, &g_timer_mutex);
+    }
+    pthread_mutex_unlock(&g_timer_mutex);
+}
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
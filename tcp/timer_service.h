@@ -0,0 +1,50 @@
+#ifndef _TIMER_SERVICE_H_
+#define _TIMER_SERVICE_H_
+
+//================================================================================================= 
+//      Author: Brett Decker and Xinwei Liu
+//=================================================================================================
+//      INCLUDE FILES
+//=================================================================================================
+
+#include "utility.h"
+
+//=================================================================================================
+//      DEFINITIONS AND MACROS
+//=================================================================================================
+
+// Timers due within TSV_SLACK_US of each other fire in the same pass
+#define TSV_SLACK_US        50
+#define TSV_INITIAL_SIZE    64
+
+
+typedef void (*tsv_callback_t)(void* arg);
+
+// One timer, embedded in its owner. The callback runs on the timer thread without any
+// lock held; it may re-arm its own timer. tsv_cancel() waits for a running callback.
+struct tsv_timer {
+    uint64_t expiry_us;         //util_getTimeUs() time
+    tsv_callback_t callback;
+    void* arg;
+    int heap_index;             //-1 while not armed
+};
+
+
+//=================================================================================================
+//      PUBLIC FUNCTIONS
+//=================================================================================================
+
+void tsv_init(void);
+
+void tsv_initTimer(struct tsv_timer* timer, tsv_callback_t callback, void* arg);
+
+void tsv_schedule(struct tsv_timer* timer, uint64_t expiry_us);
+
+void tsv_cancel(struct tsv_timer* timer);
+
+
+//=================================================================================================
+//      END OF FILE
+//=================================================================================================
+
+#endif //_TIMER_SERVICE_H_
@@ -6,6 +6,8 @@
 
 #include "utility.h"
 
+#include <time.h>
+
 //=================================================================================================
 //      DEFINITIONS AND MACROS
 //=================================================================================================
@@ -19,6 +21,9 @@
 static handler_t g_handlers[256];   // Max possible values for IP header Protocol
 static int g_protocol_defined[256]; // Max possible values for IP header Protocol
 
+static flush_handler_t g_flush_handlers[256];
+static int g_flush_handler_count = 0;
+
 //=================================================================================================
 //      PUBLIC FUNCTIONS
 //=================================================================================================
@@ -38,6 +43,22 @@ void util_callHandler(uint8_t protocol, ip_packet_t* ip_packet)
 }
 
 
+void util_netRegisterFlushHandler(flush_handler_t handler)
+{
+    g_flush_handlers[g_flush_handler_count++] = handler;
+}
+
+
+// Whoever passes packets to util_callHandler() calls this once its burst of packets is done
+void util_callFlushHandlers(void)
+{
+    int index;
+    for (index = 0; index < g_flush_handler_count; index++) {
+        (g_flush_handlers[index])();
+    }
+}
+
+
 uint32_t util_convertVIPString2Int(char* vip_address) 
 {
     uint32_t vip_integer, byte;
@@ -104,6 +125,16 @@ double util_abs(double val)
 }
 
 
+// Monotonic wall-clock time in microseconds (unlike clock(), advances while threads sleep)
+uint64_t util_getTimeUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return ((uint64_t)now.tv_sec)*1000000 + now.tv_nsec/1000;
+}
+
+
 //=================================================================================================
 //      END OF FILE
 //=================================================================================================
@@ -111,6 +111,9 @@ typedef struct {
 
 typedef void (*handler_t)(ip_packet_t*);
 
+// Called at the end of a receive burst, protocols that hold (coalesce) packets hand them on
+typedef void (*flush_handler_t)(void);
+
 
 //=================================================================================================
 //      PUBLIC FUNCTIONS
@@ -118,6 +121,8 @@ typedef void (*handler_t)(ip_packet_t*);
 
 void util_netRegisterHandler(uint8_t protocol, handler_t handler);
 void util_callHandler(uint8_t protocol, ip_packet_t* ip_packet);
+void util_netRegisterFlushHandler(flush_handler_t handler);
+void util_callFlushHandlers(void);
 
 uint32_t util_convertVIPString2Int(char* vip_address);
 char* util_convertVIPInt2String(uint32_t vip_addr_num);
@@ -133,6 +138,8 @@ uint32_t util_max(uint32_t val1, uint32_t val2);
 
 double util_abs(double val);
 
+uint64_t util_getTimeUs(void);
+
 //=================================================================================================
 //      END OF FILE
 //=================================================================================================